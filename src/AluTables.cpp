@@ -0,0 +1,7 @@
+#include "AluTables.h"
+
+// constinit keeps the tables out of dynamic initialization: they are
+// generated by the compiler and land in read-only data.
+constinit const std::array<uint8_t, 256> AluTables::ZSP = AluTables::BuildZSP();
+constinit const std::array<uint8_t, 2 * 256 * 256> AluTables::Add = AluTables::BuildAdd();
+constinit const std::array<uint8_t, 2 * 256 * 256> AluTables::Subtract = AluTables::BuildSubtract();
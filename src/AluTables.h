@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+// Flag lookup tables for the 8080 ALU, generated at compile time.
+//
+// ZSP holds the Z, S and P bits for every 8-bit result. Add and Subtract
+// hold the full Z/S/P/CY/AC flag byte for every (carry, v1, v2) triple,
+// indexed by Index(), so ADD/ADC/INR and SUB/SBB/CMP/DCR resolve their
+// flags with a single load.
+//
+// Footprint: ZSP is 256 bytes, Add and Subtract are 128 KB each.
+struct AluTables
+{
+	static constexpr uint8_t CY_BIT = 0x01;
+	static constexpr uint8_t P_BIT  = 0x04;
+	static constexpr uint8_t AC_BIT = 0x10;
+	static constexpr uint8_t Z_BIT  = 0x40;
+	static constexpr uint8_t S_BIT  = 0x80;
+
+	static constexpr uint32_t Index(uint8_t carry, uint8_t v1, uint8_t v2)
+	{
+		return (uint32_t(carry) << 16) | (uint32_t(v1) << 8) | v2;
+	}
+
+	static constexpr std::array<uint8_t, 256> BuildZSP()
+	{
+		std::array<uint8_t, 256> table{};
+
+		for (int value = 0; value < 256; value++) {
+			int bits = 0;
+			for (int i = 0; i < 8; i++)
+				bits += (value >> i) & 0x1;
+
+			uint8_t f = 0;
+			if (value == 0)			f |= Z_BIT;
+			if (value & 0x80)		f |= S_BIT;
+			if ((bits & 0x1) == 0)	f |= P_BIT;
+
+			table[value] = f;
+		}
+
+		return table;
+	}
+
+	// v1 + v2 + carry. AC is the carry out of bit 3.
+	static constexpr std::array<uint8_t, 2 * 256 * 256> BuildAdd()
+	{
+		std::array<uint8_t, 2 * 256 * 256> table{};
+		std::array<uint8_t, 256> zsp = BuildZSP();
+
+		for (int c = 0; c < 2; c++) {
+			for (int v1 = 0; v1 < 256; v1++) {
+				for (int v2 = 0; v2 < 256; v2++) {
+					int res = v1 + v2 + c;
+
+					uint8_t f = zsp[res & 0xFF];
+					if (res > 0xFF)								f |= CY_BIT;
+					if ((v1 & 0xF) + (v2 & 0xF) + c > 0xF)		f |= AC_BIT;
+
+					table[Index(c, v1, v2)] = f;
+				}
+			}
+		}
+
+		return table;
+	}
+
+	// v1 - v2 - borrow. The 8080 subtracts by adding the complement of v2
+	// with the inverted borrow, so CY is the inverted carry out (a borrow)
+	// and AC is the uninverted carry out of bit 3 of that addition.
+	static constexpr std::array<uint8_t, 2 * 256 * 256> BuildSubtract()
+	{
+		std::array<uint8_t, 2 * 256 * 256> table{};
+		std::array<uint8_t, 256> zsp = BuildZSP();
+
+		for (int c = 0; c < 2; c++) {
+			for (int v1 = 0; v1 < 256; v1++) {
+				for (int v2 = 0; v2 < 256; v2++) {
+					int res = v1 - v2 - c;
+
+					uint8_t f = zsp[res & 0xFF];
+					if (res < 0)										f |= CY_BIT;
+					if ((v1 & 0xF) + (~v2 & 0xF) + (1 - c) > 0xF)		f |= AC_BIT;
+
+					table[Index(c, v1, v2)] = f;
+				}
+			}
+		}
+
+		return table;
+	}
+
+	static const std::array<uint8_t, 256> ZSP;
+	static const std::array<uint8_t, 2 * 256 * 256> Add;
+	static const std::array<uint8_t, 2 * 256 * 256> Subtract;
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "Memory.h"
+
+// Banked memory for guests that need more than 64 KB, as banked CP/M 3
+// and MP/M do. A run of pages is banked, everything else is common to
+// all banks. The guest selects a bank by writing its number to the bank
+// register, an MMIO byte, and reads it back from there. The rest of the
+// register's page is plain storage.
+//
+// The banks themselves are Memory's, see Memory::MapBanks(), so the CPU
+// and the engines see nothing new and snapshots and checkpoints carry
+// every bank and the selection. A switch drops cached code over the
+// banked pages and marks them dirty. The register's page is device state
+// and is not captured.
+class BankSwitch : public MemoryDevice
+{
+public:
+	// Banks first..first+count-1 into banks copies, with the register at
+	// registerAddr. Bank 0 starts selected, holding what memory held, the
+	// others start zeroed. The run must be at least one page and end
+	// within memory, there must be at least one bank, the register's page
+	// must not be banked and the memory must not be banked already.
+	// Otherwise nothing is mapped and Valid() returns false.
+	BankSwitch(Memory* memory, uint8_t first, uint32_t count, uint32_t banks, uint16_t registerAddr)
+		: m_Memory(memory), m_RegisterAddr(registerAddr),
+		m_Valid(Check(first, count, registerAddr) && memory->MapBanks(first, count, banks))
+	{
+		if (!m_Valid)
+			return;
+
+		memcpy(m_Page, m_Memory->m_Memory + (registerAddr & 0xFF00), MEMORY_PAGE_SIZE);
+		m_Memory->MapMMIO(registerAddr >> 8, 1, this);
+	}
+
+	~BankSwitch()
+	{
+		if (!m_Valid)
+			return;
+
+		m_Memory->MapRAM(m_RegisterAddr >> 8, 1);
+		m_Memory->UnmapBanks();
+	}
+
+	bool Valid() const { return m_Valid; }
+
+	uint32_t GetBank() const { return m_Memory->GetBank(); }
+
+	// Numbers past the last bank wrap around
+	void Select(uint32_t bank)
+	{
+		if (m_Valid)
+			m_Memory->SelectBank(bank);
+	}
+
+	uint8_t Read(uint16_t addr) override
+	{
+		if (addr == m_RegisterAddr)
+			return static_cast<uint8_t>(GetBank());
+
+		return m_Page[addr & 0xFF];
+	}
+
+	void Write(uint16_t addr, uint8_t val) override
+	{
+		if (addr == m_RegisterAddr)
+			Select(val);
+		else
+			m_Page[addr & 0xFF] = val;
+	}
+
+private:
+	static bool Check(uint8_t first, uint32_t count, uint16_t registerAddr)
+	{
+		const uint32_t page = registerAddr >> 8;
+
+		return page < first || page >= first + count;
+	}
+
+private:
+	Memory* m_Memory;
+	uint16_t m_RegisterAddr;
+	bool m_Valid;
+
+	uint8_t m_Page[MEMORY_PAGE_SIZE]{};
+};
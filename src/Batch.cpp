@@ -0,0 +1,98 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+#include "Batch.h"
+#include "CPM.h"
+#include "Loader.h"
+#include "Memory.h"
+
+///////////////////////////////////
+//////////////BATCH///////////////
+/////////////////////////////////
+
+std::vector<BatchResult> BatchRunner::Run(const std::vector<BatchJob>& jobs)
+{
+	std::vector<BatchResult> results(jobs.size());
+
+	// Each task writes only its own result
+	for (size_t i = 0; i < jobs.size(); i++)
+		m_Pool.Submit([&jobs, &results, i] { results[i] = RunJob(jobs[i]); });
+
+	m_Pool.Wait();
+	return results;
+}
+
+BatchResult BatchRunner::RunJob(const BatchJob& job)
+{
+	BatchResult result;
+	auto start = std::chrono::steady_clock::now();
+
+	// Memory is too big for a worker's stack
+	auto memory = std::make_unique<Memory>();
+
+	for (const std::string& spec : job.images) {
+		std::string path;
+		uint16_t address;
+
+		if (!Loader::ParseImageSpec(spec.c_str(), path, address, result.error) ||
+			!Loader::Load(memory.get(), path.c_str(), address, result.error))
+			return result;
+	}
+
+	BufferConsole console(&result.output);
+	CPM cpm(memory.get());
+	cpm.SetConsole(&console);
+
+	auto cpu = std::make_unique<i8080>(memory.get(), &cpm);
+	cpu->SetEngine(job.engine);
+	result.engine = cpu->GetEngine();
+
+	result.reason = cpu->Run(job.budget);
+	result.state = cpu->GetState();
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	return result;
+}
+
+bool BatchRunner::LoadJobFile(const char* path, i8080::Engine engine, std::vector<BatchJob>& jobs, std::string& error)
+{
+	FILE* file = fopen(path, "r");
+	if (!file) {
+		error = std::string("Cannot open ") + path;
+		return false;
+	}
+
+	char line[1024];
+
+	while (fgets(line, sizeof(line), file)) {
+		BatchJob job;
+		job.engine = engine;
+
+		for (char* token = strtok(line, " \t\r\n"); token; token = strtok(nullptr, " \t\r\n")) {
+			if (token[0] == '#')
+				break;
+
+			if (strspn(token, "0123456789") == strlen(token))
+				job.budget = strtoull(token, nullptr, 10);
+			else
+				job.images.push_back(token);
+		}
+
+		if (job.images.empty())
+			continue;
+
+		jobs.push_back(std::move(job));
+	}
+
+	fclose(file);
+
+	if (jobs.empty()) {
+		error = std::string("No jobs in ") + path;
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "i8080.h"
+#include "ThreadPool.h"
+
+// Instructions a job runs unless its line in the job file says otherwise
+#define BATCH_DEFAULT_BUDGET 1000000000ull
+
+// One program to run on a machine of its own
+struct BatchJob {
+	std::vector<std::string> images;	// "path[@address]", loaded in order
+	uint64_t budget = BATCH_DEFAULT_BUDGET;
+	i8080::Engine engine = i8080::Engine::Interpreter;
+};
+
+// How a job ended. Reason is StopReason::None if its images failed to
+// load, with the message in error.
+struct BatchResult {
+	i8080::StopReason reason = i8080::StopReason::None;
+	i8080::Engine engine{};	// the one that ran, see i8080::SetEngine()
+	i8080::State state{};
+	std::string output;		// everything the program wrote to the console
+	std::string error;
+	double seconds = 0;
+};
+
+// Runs many independent jobs in one process on a ThreadPool. Every job
+// gets its own Memory, CPM and i8080, built on the worker that runs it
+// and gone once it finishes, so jobs share nothing and a program that
+// exits, halts or fails ends only its own machine. Console output is
+// captured per job rather than written to stdout.
+class BatchRunner
+{
+public:
+	// Zero threads means one per hardware thread
+	explicit BatchRunner(unsigned threads = 0)
+		: m_Pool(threads) {}
+
+	unsigned GetThreadCount() const { return m_Pool.GetThreadCount(); }
+
+	// Results are in the order of the jobs
+	std::vector<BatchResult> Run(const std::vector<BatchJob>& jobs);
+
+	static BatchResult RunJob(const BatchJob& job);
+
+	// One job per line: image specs and an optional instruction budget,
+	// separated by spaces. A token of digits alone is the budget, '#'
+	// starts a comment and lines without images are skipped. Jobs get the
+	// engine given here.
+	static bool LoadJobFile(const char* path, i8080::Engine engine, std::vector<BatchJob>& jobs, std::string& error);
+
+private:
+	ThreadPool m_Pool;
+};
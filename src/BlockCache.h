@@ -0,0 +1,396 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "i8080.h"
+#include "Memory.h"
+#include "Profiler.h"
+
+#define BLOCK_MAX_INSTRUCTIONS 32
+
+// Debug builds check every idle loop skip against running the loop
+#ifndef I8080_VERIFY_IDLE_SKIP
+	#if _DEBUG
+		#define I8080_VERIFY_IDLE_SKIP 1
+	#else
+		#define I8080_VERIFY_IDLE_SKIP 0
+	#endif
+#endif
+
+// Pre-decoded straight-line runs of instructions, keyed by the address
+// of their first byte. A block ends at the first JMP, CALL, RET, PCHL
+// or HLT, conditional or not. Pages holding cached code are watched in
+// Memory, and a write to a byte covered by a block drops that block.
+class BlockCache : public WriteListener
+{
+public:
+	struct Instruction {
+		i8080::OperandHandler handler;
+		uint16_t operand;
+		uint8_t opcode;
+		uint8_t length;
+		uint8_t cycles;
+	};
+
+	// A block that is a whole delay loop, counting a register or pair
+	// down to zero and touching nothing else:
+	//   loop: DCR r / JNZ loop
+	//   loop: DCX rp / MOV A,hi / ORA lo / JNZ loop	(or MOV A,lo / ORA hi)
+	// Every iteration but the last only changes the counter and the time,
+	// so the engines skip them in one step with SkipIdleLoop().
+	struct IdleLoop {
+		enum class Kind : uint8_t { None, Counter8, Counter16 };
+
+		Kind kind = Kind::None;
+		uint8_t counter = 0;	// register index for Counter8, pair index for Counter16
+	};
+
+	struct Block {
+		uint16_t start{};
+		uint16_t end{};		// last byte of the last instruction
+		uint32_t cycles{};	// T-states of all instructions, branches not taken
+		IdleLoop idle;
+		std::vector<Instruction> instructions;
+	};
+
+public:
+	BlockCache(Memory* memory)
+		: m_Memory(memory), m_Blocks(65536)
+	{
+		m_Memory->SetWriteListener(this);
+	}
+
+	~BlockCache()
+	{
+		Flush();
+		m_Memory->SetWriteListener(nullptr);
+	}
+
+	const Block* Find(uint16_t addr) const { return m_Blocks[addr].get(); }
+
+	const Block* Lookup(uint16_t addr)
+	{
+		const Block* block = m_Blocks[addr].get();
+		return block ? block : Translate(addr);
+	}
+
+	// Decodes from addr up to and including the first control transfer.
+	// Blocks never wrap past 0xFFFF.
+	const Block* Translate(uint16_t addr)
+	{
+		auto block = std::make_unique<Block>();
+		block->start = addr;
+
+		uint32_t pc = addr;
+
+		while (block->instructions.size() < BLOCK_MAX_INSTRUCTIONS) {
+			uint8_t opcode = m_Memory->Fetch(pc);
+			uint8_t length = i8080::s_LengthTable[opcode];
+
+			if (pc + length > 0x10000)
+				break;
+
+			uint16_t operand{};
+			if (length == 2)
+				operand = m_Memory->Fetch(pc + 1);
+			else if (length == 3)
+				operand = m_Memory->Fetch(pc + 1) | (m_Memory->Fetch(pc + 2) << 8);
+
+			uint8_t cycles = i8080::s_CycleTable[opcode];
+
+			block->instructions.push_back({ i8080::s_OperandTable[opcode], operand, opcode, length, cycles });
+			block->cycles += cycles;
+			pc += length;
+
+			if (EndsBlock(i8080::s_GroupTable[opcode]))
+				break;
+		}
+
+		// An instruction that would wrap is left to the interpreter
+		if (block->instructions.empty())
+			return nullptr;
+
+		block->end = pc - 1;
+		block->idle = DetectIdleLoop(*block);
+
+		return Insert(std::move(block));
+	}
+
+	static IdleLoop DetectIdleLoop(const Block& block)
+	{
+		const std::vector<Instruction>& code = block.instructions;
+		const Instruction& last = code.back();
+
+		// JNZ back to the top of the block
+		if (last.opcode != 0xC2 || last.operand != block.start)
+			return {};
+
+		const uint8_t first = code[0].opcode;
+
+		if (code.size() == 2 && i8080::s_GroupTable[first] == i8080::OpGroup::DCR) {
+			uint8_t reg = (first & 0x38) >> 3;
+
+			if (reg != MEMORY_REF)
+				return { IdleLoop::Kind::Counter8, reg };
+		}
+
+		if (code.size() == 4 && i8080::s_GroupTable[first] == i8080::OpGroup::DCX) {
+			uint8_t rp = (first & 0x30) >> 4;
+
+			// The pair's registers are 2 * rp and 2 * rp + 1, e.g. B and C
+			const uint8_t hi = rp * 2;
+			const uint8_t lo = rp * 2 + 1;
+
+			// MOV A,r is 0x78 | r, ORA r is 0xB0 | r
+			bool test = (code[1].opcode == (0x78 | hi) && code[2].opcode == (0xB0 | lo)) ||
+						(code[1].opcode == (0x78 | lo) && code[2].opcode == (0xB0 | hi));
+
+			if (rp != 0x3 && test)
+				return { IdleLoop::Kind::Counter16, rp };
+		}
+
+		return {};
+	}
+
+	// Skips the iterations of the idle loop at the CPU's PC that fit the
+	// budget, but always leaves at least one to run for real, so the flags
+	// and A come out exactly as the loop leaves them. Returns the number
+	// of instructions skipped.
+	static uint64_t SkipIdleLoop(i8080* cpu, const Block& block, uint64_t count)
+	{
+		const uint64_t length = block.instructions.size();
+		const uint8_t counter = block.idle.counter;
+
+		// Iterations left, including the current one. A counter of 0 wraps.
+		uint64_t iterations{};
+		if (block.idle.kind == IdleLoop::Kind::Counter8)
+			iterations = cpu->registers[counter] ? cpu->registers[counter] : 0x100;
+		else
+			iterations = cpu->registers.pairs[counter] ? cpu->registers.pairs[counter] : 0x10000;
+
+		if (count / length < 2)
+			return 0;
+
+		uint64_t skip = std::min(iterations - 1, count / length - 1);
+		if (skip == 0)
+			return 0;
+
+#if I8080_VERIFY_IDLE_SKIP
+		// Run the skipped iterations and the next one, then do the same
+		// by skipping, and make sure both end up in the same place
+		const auto registers = cpu->registers;
+		const auto flags = cpu->m_flags;
+		const uint16_t PC = cpu->PC;
+		const uint64_t cycles = cpu->m_Cycles;
+
+#if I8080_COVERAGE
+		// The trial run is not part of the guest's execution, so it leaves
+		// the map and the previous block alone
+		uint8_t* const coverage = cpu->m_Coverage;
+		const uint16_t coveragePrev = cpu->m_CoveragePrev;
+		cpu->m_Coverage = nullptr;
+#endif
+
+		for (uint64_t i = 0; i <= skip; i++)
+			RunIteration(cpu, block);
+
+#if I8080_COVERAGE
+		cpu->m_Coverage = coverage;
+		cpu->m_CoveragePrev = coveragePrev;
+#endif
+
+		const i8080::State expected = cpu->GetState();
+		const uint64_t expectedCycles = cpu->m_Cycles;
+
+		cpu->registers = registers;
+		cpu->m_flags = flags;
+		cpu->PC = PC;
+		cpu->m_Cycles = cycles;
+#endif
+
+		if (block.idle.kind == IdleLoop::Kind::Counter8)
+			cpu->registers[counter] -= static_cast<uint8_t>(skip);
+		else
+			cpu->registers.pairs[counter] -= static_cast<uint16_t>(skip);
+
+		cpu->m_Cycles += skip * block.cycles;
+
+#if I8080_COVERAGE
+		// Each skipped iteration ended on the back edge to the loop, and the
+		// map must count them as the interpreter would
+		for (uint64_t i = 0; i < skip; i++)
+			cpu->CoverEdge(block.start);
+#endif
+
+#if I8080_VERIFY_IDLE_SKIP
+		RunIteration(cpu, block);
+
+		// A debug trap rather than an exit, so a host running many machines
+		// stops in the debugger at the bad skip instead of quietly ending
+		if (!(cpu->GetState() == expected) || cpu->m_Cycles != expectedCycles)
+			abort();
+
+		return (skip + 1) * length;
+#else
+		return skip * length;
+#endif
+	}
+
+	// Runs the block at the CPU's PC as the engines do, but one instruction
+	// at a time with the T-states each took, and reports them to the
+	// profiler as i8080::ProfiledCycle() would. Only the last instruction
+	// can move the call stack. Returns the number of instructions run.
+	uint64_t RunProfiled(i8080* cpu, const Block& block)
+	{
+		Profiler* profiler = cpu->m_Profiler;
+		uint64_t executed = 0;
+
+		for (const Instruction& instr : block.instructions) {
+			const uint16_t pc = cpu->PC;
+			const uint16_t sp = cpu->SP;
+			const uint64_t cycles = cpu->m_Cycles;
+
+			cpu->PC += instr.length;
+			cpu->m_Cycles += instr.cycles;
+			(cpu->*instr.handler)(instr.operand);
+			executed++;
+
+			profiler->Count(pc, instr.opcode, static_cast<uint32_t>(cpu->m_Cycles - cycles));
+
+			if (executed == block.instructions.size())
+				cpu->ProfileStack(pc, instr.opcode, sp);
+
+			if (m_Invalidated)
+				break;
+		}
+
+		return executed;
+	}
+
+	static bool EndsBlock(i8080::OpGroup group)
+	{
+		switch (group)
+		{
+			case i8080::OpGroup::JMP:
+			case i8080::OpGroup::CALL:
+			case i8080::OpGroup::RET:
+			case i8080::OpGroup::PCHL:
+			case i8080::OpGroup::HLT:
+			case i8080::OpGroup::Invalid:
+				return true;
+
+			default:
+				return false;
+		}
+	}
+
+	Block* Insert(std::unique_ptr<Block> block)
+	{
+		Block* b = block.get();
+
+		for (uint32_t addr = b->start; addr <= b->end; addr++) {
+			m_CodeBytes[addr]++;
+		}
+
+		for (uint32_t page = b->start >> 8; page <= (b->end >> 8u); page++) {
+			m_PageBlocks[page].push_back(b->start);
+			m_Memory->WatchPage(page, true);
+		}
+
+		m_Blocks[b->start] = std::move(block);
+		return b;
+	}
+
+	// Set when a write dropped a block since the last ClearInvalidated(),
+	// so the engine can stop running a block that may be stale.
+	bool Invalidated() const { return m_Invalidated; }
+	const bool* InvalidatedFlag() const { return &m_Invalidated; }
+
+	void ClearInvalidated()
+	{
+		m_Invalidated = false;
+		m_Retired.clear();
+	}
+
+	void OnWrite(uint16_t addr) override
+	{
+		if (m_CodeBytes[addr] == 0)
+			return;
+
+		std::vector<uint16_t> hit;
+		for (uint16_t start : m_PageBlocks[addr >> 8]) {
+			const Block* b = m_Blocks[start].get();
+
+			if (addr >= b->start && addr <= b->end)
+				hit.push_back(start);
+		}
+
+		for (uint16_t start : hit) {
+			Retire(start);
+		}
+	}
+
+	void Flush()
+	{
+		for (uint32_t page = 0; page < 256; page++) {
+			while (!m_PageBlocks[page].empty()) {
+				Retire(m_PageBlocks[page].back());
+			}
+		}
+	}
+
+private:
+#if I8080_VERIFY_IDLE_SKIP
+	static void RunIteration(i8080* cpu, const Block& block)
+	{
+		for (const Instruction& instr : block.instructions) {
+			cpu->PC += instr.length;
+			cpu->m_Cycles += instr.cycles;
+			(cpu->*instr.handler)(instr.operand);
+		}
+	}
+#endif
+
+	// Blocks are kept alive until ClearInvalidated(), since the one
+	// being dropped may be the one currently executing.
+	void Retire(uint16_t start)
+	{
+		std::unique_ptr<Block> block = std::move(m_Blocks[start]);
+
+		for (uint32_t addr = block->start; addr <= block->end; addr++) {
+			m_CodeBytes[addr]--;
+		}
+
+		for (uint32_t page = block->start >> 8; page <= (block->end >> 8u); page++) {
+			std::vector<uint16_t>& list = m_PageBlocks[page];
+
+			for (size_t i = 0; i < list.size(); i++) {
+				if (list[i] == start) {
+					list[i] = list.back();
+					list.pop_back();
+					break;
+				}
+			}
+
+			if (list.empty())
+				m_Memory->WatchPage(page, false);
+		}
+
+		m_Retired.push_back(std::move(block));
+		m_Invalidated = true;
+	}
+
+private:
+	Memory* m_Memory;
+
+	std::vector<std::unique_ptr<Block>> m_Blocks;
+	std::vector<std::unique_ptr<Block>> m_Retired;
+	std::vector<uint16_t> m_PageBlocks[256];
+
+	uint8_t m_CodeBytes[65536]{};
+	bool m_Invalidated = false;
+};
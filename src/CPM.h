@@ -1,12 +1,26 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
-#include <cstdio>
+#include <cstring>
+#include <vector>
 
+#include "Console.h"
 #include "Memory.h"
 
+// What console reads get once the input runs out, CP/M's end of file
+#define CPM_EOF 0x1A
+
 class CPM
 {
+public:
+	// Everything a machine snapshot needs to put the CP/M side back
+	struct State {
+		bool exited = false;
+		bool failed = false;
+	};
+
 public:
 	CPM(Memory* _memory)
 		: memory(_memory) { }
@@ -15,36 +29,150 @@ public:
 		memory = nullptr;
 	}
 
-	void Call(uint8_t code, uint16_t addr)
+	// Functions that return a byte put it in result, for the CPU to leave
+	// in A and L as the BDOS does, and return true
+	bool Call(uint8_t code, uint16_t addr, uint8_t& result)
 	{
 		switch (code)
 		{
 			case 0x0: WBOOT(); break;
+			case 0x1: result = C_READ(); return true;
 			case 0x9: C_WRITESTR(addr); break;
+			case 0xA: C_READSTR(addr); break;
 
 			default:
-				fprintf(stderr, "INVALID CPM FUNCTION CALL\nExiting...\n");
-				exit(1);
+				failed = true;
 		}
+
+		return false;
 	}
 
+	// The program is done. The CPU stops with StopReason::Exit once it
+	// sees Exited(). Nothing goes to the console, which only gets what the
+	// program wrote.
 	void WBOOT()
 	{
-		printf("CPM WBOOT\n");
-		exit(0);
+		exited = true;
 	}
 
+	bool Exited() const { return exited; }
+
+	// The program called a function that is not implemented. The CPU
+	// stops with StopReason::Error once it sees Failed() and records the
+	// function in its Fault.
+	bool Failed() const { return failed; }
+
+	State GetState() const { return { exited, failed }; }
+	void SetState(const State& state) { exited = state.exited; failed = state.failed; }
+
+	// Prints the string at addr up to the '$', which is not printed, in
+	// one write and with nothing added, as the BDOS does. Memory Read()
+	// takes straight from m_Memory is searched with memchr(), and written
+	// from where it lies when the string is all there. MMIO pages and
+	// pages with read watchpoints are read a byte at a time. The string
+	// wraps at the top of memory, and one with no '$' anywhere ends after
+	// the whole address space rather than going round forever.
 	void C_WRITESTR(uint16_t addr)
 	{
-		uint8_t c = memory->Read(addr++);
+		size_t scanned = 0;
+		text.clear();
+
+		while (scanned < MEMORY_SIZE) {
+			const size_t run = std::min(memory->GetFastReadRun(addr), MEMORY_SIZE - scanned);
+
+			if (run) {
+				const uint8_t* start = memory->m_Memory + addr;
+				const uint8_t* end = static_cast<const uint8_t*>(memchr(start, '$', run));
+				const size_t length = end ? end - start : run;
+
+				if (end && text.empty()) {
+					console->Write(start, length);
+					return;
+				}
+
+				text.insert(text.end(), start, start + length);
+
+				if (end)
+					break;
+
+				addr = static_cast<uint16_t>(addr + length);
+				scanned += length;
+				continue;
+			}
+
+			// Up to the end of the slow page
+			const uint8_t c = memory->Read(addr);
+
+			if (c == '$')
+				break;
+
+			text.push_back(c);
+			addr++;
+			scanned++;
+		}
+
+		console->Write(text.data(), text.size());
+	}
+
+	// Next console byte, echoed. Once the input runs out every read
+	// gets CPM_EOF.
+	uint8_t C_READ()
+	{
+		if (inputPos == inputSize)
+			return CPM_EOF;
+
+		uint8_t c = input[inputPos++];
+		Put(c);
+		return c;
+	}
+
+	// Reads a line into the buffer at addr: its first byte is the most
+	// the program takes, the count goes in the second and the characters
+	// after. The line ends at CR or LF, which is not stored, or where the
+	// input does. The end is echoed as a lone CR, as the CP/M 2.2 BDOS
+	// does, and the program prints its own LF.
+	void C_READSTR(uint16_t addr)
+	{
+		const uint8_t max = memory->Read(addr);
+		uint8_t count = 0;
+
+		while (count < max && inputPos < inputSize) {
+			uint8_t c = input[inputPos++];
 
-		while (c != '$') {
-			printf("%c", c);
-			c = memory->Read(addr++);
+			if (c == '\r' || c == '\n')
+				break;
+
+			memory->Write(static_cast<uint16_t>(addr + 2 + count++), c);
+			Put(c);
 		}
-		printf("\n");
+
+		memory->Write(static_cast<uint16_t>(addr + 1), count);
+		Put('\r');
+	}
+
+	// Console input comes from the bytes given here, which must outlive
+	// the reads. Not part of State: set it again after a restore.
+	void SetInput(const uint8_t* data, size_t size)
+	{
+		input = data;
+		inputSize = size;
+		inputPos = 0;
 	}
 
+	// Console output goes to stdout until a console is set, which must
+	// outlive the calls. Pass nullptr to go back to stdout.
+	void SetConsole(ConsoleSink* _console) { console = _console ? _console : FileConsole::Stdout(); }
+
+private:
+	void Put(uint8_t c) { console->Write(&c, 1); }
+
 private:
 	Memory* memory;
+	ConsoleSink* console = FileConsole::Stdout();
+	std::vector<uint8_t> text;		// C_WRITESTR's string when it is not in one piece
+	const uint8_t* input = nullptr;
+	size_t inputSize = 0;
+	size_t inputPos = 0;
+	bool exited = false;
+	bool failed = false;
 };
\ No newline at end of file
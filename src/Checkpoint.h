@@ -0,0 +1,369 @@
+#pragma once
+
+#include <algorithm>
+#include <bitset>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "i8080.h"
+#include "Memory.h"
+#include "CPM.h"
+
+#define CHECKPOINT_FILE_MAGIC "I8080CKP"
+#define CHECKPOINT_FILE_VERSION 2
+
+// CPU and CP/M state at one checkpoint. In the file each is followed by
+// its page numbers, one byte each, then the 256 bytes of every page, then
+// its bank slot numbers, four bytes each, then the 256 bytes of every
+// bank slot.
+struct CheckpointRecord {
+	uint64_t cycles;
+	uint16_t PC;
+	uint16_t SP;
+	uint8_t registers[8];	// in opcode order, B to A
+	uint8_t flags;
+	uint8_t stop;			// i8080::StopReason
+	uint8_t exited;			// CPM::State
+	uint8_t failed;
+	uint32_t pages;			// stored with this checkpoint
+	uint8_t faultKind;		// i8080::Fault, all 0 unless stop is Error
+	uint8_t faultCode;
+	uint16_t faultPC;
+	uint32_t bank;			// Memory::Banks, all 0 unless memory is banked
+	uint32_t bankCount;
+	uint32_t bankSlots;		// pages of every bank
+	uint32_t bankPages;		// bank slots stored with this checkpoint
+};
+
+static_assert(sizeof(CheckpointRecord) == 48, "CheckpointRecord is part of the checkpoint file format");
+
+// A run of incremental checkpoints of one machine. The first checkpoint
+// stores every page, each later one only the pages written since the one
+// before, found through Memory's dirty bitmap. The CPU and CP/M state is
+// stored in full every time.
+//
+// Any checkpoint can be put back on the machine. For each page the log
+// keeps the checkpoints that stored it, so a restore looks up the newest
+// copy at or before the checkpoint and does not replay the ones between.
+// Only pages that differ from the machine as it is are written.
+//
+// Banked memory is kept the same way. Each checkpoint holds the banks as
+// Memory shares them, which costs nothing for the bank pages unchanged
+// since the checkpoint before, and the file stores only those that did
+// change.
+class CheckpointLog
+{
+public:
+	CheckpointLog(i8080* cpu, Memory* memory, CPM* cpm)
+		: m_CPU(cpu), m_Memory(memory), m_CPM(cpm) {}
+
+	// Returns the index of the new checkpoint
+	size_t Add()
+	{
+		const std::bitset<MEMORY_PAGES>& dirty = m_Memory->GetDirtyPages();
+		const uint32_t index = static_cast<uint32_t>(m_Records.size());
+
+		CheckpointRecord record = MakeRecord(m_CPU->GetState(), m_CPM->GetState(), m_Memory);
+
+		// After a Restore() the memory may be at an older checkpoint than
+		// the newest, and the pages that differ between them are stored too
+		for (uint32_t page = 0; page < MEMORY_PAGES; page++) {
+			if (m_Synced && !dirty[page] && (index == 0 || FindSlot(page, m_Current) == FindSlot(page, index - 1)))
+				continue;
+
+			m_History[page].push_back({ index, static_cast<uint32_t>(m_PageData.size()) });
+
+			Memory::PageData& data = m_PageData.emplace_back();
+			memcpy(data.data(), m_Memory->m_Memory + page * MEMORY_PAGE_SIZE, MEMORY_PAGE_SIZE);
+
+			m_PageNumbers.push_back(static_cast<uint8_t>(page));
+			record.pages++;
+		}
+
+		m_Records.push_back(record);
+		m_Banks.push_back(m_Memory->GetBanks());
+		m_Records.back().bankPages = static_cast<uint32_t>(ChangedSlots(index).size());
+
+		m_Current = index;
+		m_Synced = true;
+
+		m_Memory->ClearDirtyPages();
+		return index;
+	}
+
+	size_t Count() const { return m_Records.size(); }
+
+	// T-states the machine had run at the checkpoint
+	uint64_t GetCycles(size_t index) const { return m_Records[index].cycles; }
+
+	// Puts the machine back as it was at the checkpoint. Add() after this
+	// appends as usual, storing what differs from the newest checkpoint.
+	// Costs the pages that differ between the machine and the checkpoint.
+	bool Restore(size_t index)
+	{
+		if (index >= m_Records.size())
+			return false;
+
+		// The banks first, the selected bank's pages come back with the rest
+		if (m_Records[index].bankCount != m_Memory->GetBankCount() || !m_Memory->SetBanks(m_Banks[index]))
+			return false;
+
+		const std::bitset<MEMORY_PAGES>& dirty = m_Memory->GetDirtyPages();
+		const uint32_t target = static_cast<uint32_t>(index);
+
+		// The memory is at m_Current apart from the dirty pages
+		for (uint32_t page = 0; page < MEMORY_PAGES; page++) {
+			uint32_t slot = FindSlot(page, target);
+
+			if (!m_Synced || dirty[page] || slot != FindSlot(page, m_Current))
+				m_Memory->Load(static_cast<uint16_t>(page * MEMORY_PAGE_SIZE), m_PageData[slot].data(), MEMORY_PAGE_SIZE);
+		}
+
+		const CheckpointRecord& record = m_Records[index];
+
+		i8080::State state;
+		memcpy(state.registers, record.registers, sizeof(state.registers));
+		state.flags = record.flags;
+		state.PC = record.PC;
+		state.SP = record.SP;
+		state.cycles = record.cycles;
+		state.stop = static_cast<i8080::StopReason>(record.stop);
+		state.fault = { static_cast<i8080::Fault::Kind>(record.faultKind), record.faultCode, record.faultPC };
+
+		m_CPU->SetState(state);
+		m_CPM->SetState({ record.exited != 0, record.failed != 0 });
+
+		m_Current = target;
+		m_Synced = true;
+
+		m_Memory->ClearDirtyPages();
+		return true;
+	}
+
+	// Header, then each checkpoint's record, page numbers, pages, bank
+	// slot numbers and bank pages
+	bool Save(const char* path) const
+	{
+		FILE* file = fopen(path, "wb");
+		if (!file)
+			return false;
+
+		FileHeader header{};
+		memcpy(header.magic, CHECKPOINT_FILE_MAGIC, sizeof(header.magic));
+		header.version = CHECKPOINT_FILE_VERSION;
+		header.recordSize = sizeof(CheckpointRecord);
+		header.count = m_Records.size();
+
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+		size_t first = 0;
+
+		for (size_t i = 0; ok && i < m_Records.size(); i++) {
+			const uint32_t pages = m_Records[i].pages;
+			const std::vector<uint32_t> slots = ChangedSlots(i);
+
+			ok = fwrite(&m_Records[i], sizeof(CheckpointRecord), 1, file) == 1 &&
+				fwrite(&m_PageNumbers[first], 1, pages, file) == pages &&
+				fwrite(&m_PageData[first], MEMORY_PAGE_SIZE, pages, file) == pages &&
+				fwrite(slots.data(), sizeof(uint32_t), slots.size(), file) == slots.size();
+
+			for (size_t n = 0; ok && n < slots.size(); n++)
+				ok = fwrite(m_Banks[i].pages[slots[n]]->data(), MEMORY_PAGE_SIZE, 1, file) == 1;
+
+			first += pages;
+		}
+
+		return fclose(file) == 0 && ok;
+	}
+
+	// Replaces the log with the file's. The machine is left alone until a
+	// Restore(), which then writes every page. An Add() before that stores
+	// every page too. A file whose first checkpoint does not store every
+	// page and bank slot exactly once, or whose states are out of range, is
+	// rejected. A checkpoint whose banks are laid out differently from the
+	// one before must store every bank slot too. Restoring a checkpoint
+	// whose banks are not laid out as the machine's fails.
+	bool Load(const char* path)
+	{
+		FILE* file = fopen(path, "rb");
+		if (!file)
+			return false;
+
+		FileHeader header{};
+		bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+			memcmp(header.magic, CHECKPOINT_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+			header.version == CHECKPOINT_FILE_VERSION &&
+			header.recordSize == sizeof(CheckpointRecord);
+
+		std::vector<CheckpointRecord> records;
+		std::vector<uint8_t> numbers;
+		std::vector<Memory::PageData> data;
+		std::vector<Memory::Banks> banks;
+
+		for (uint64_t i = 0; ok && i < header.count; i++) {
+			CheckpointRecord record;
+			ok = fread(&record, sizeof(record), 1, file) == 1 && record.pages <= MEMORY_PAGES &&
+				(i > 0 || record.pages == MEMORY_PAGES) &&
+				record.stop <= static_cast<uint8_t>(i8080::StopReason::Error) &&
+				record.faultKind <= static_cast<uint8_t>(i8080::Fault::Kind::BDOS) &&
+				ValidBanks(record, i > 0 ? &records.back() : nullptr);
+
+			if (ok) {
+				size_t first = numbers.size();
+				numbers.resize(first + record.pages);
+				data.resize(first + record.pages);
+
+				ok = fread(&numbers[first], 1, record.pages, file) == record.pages &&
+					fread(&data[first], MEMORY_PAGE_SIZE, record.pages, file) == record.pages;
+
+				// Each page at most once, so in the first checkpoint every page
+				std::bitset<MEMORY_PAGES> seen;
+				for (size_t n = first; ok && n < numbers.size(); n++) {
+					ok = !seen[numbers[n]];
+					seen.set(numbers[n]);
+				}
+
+				Memory::Banks& current = banks.emplace_back();
+				if (i > 0 && record.bankPages < record.bankSlots)
+					current = banks[banks.size() - 2];
+
+				current.selected = record.bank;
+				current.pages.resize(record.bankSlots);
+
+				std::vector<uint32_t> slots(record.bankPages);
+				std::vector<bool> stored(record.bankSlots);
+				ok = ok && fread(slots.data(), sizeof(uint32_t), slots.size(), file) == slots.size();
+
+				for (size_t n = 0; ok && n < slots.size(); n++) {
+					auto page = std::make_shared<Memory::PageData>();
+
+					ok = slots[n] < record.bankSlots && !stored[slots[n]] &&
+						fread(page->data(), MEMORY_PAGE_SIZE, 1, file) == 1;
+
+					if (ok) {
+						stored[slots[n]] = true;
+						current.pages[slots[n]] = std::move(page);
+					}
+				}
+
+				records.push_back(record);
+			}
+		}
+
+		fclose(file);
+
+		if (!ok)
+			return false;
+
+		m_Records = std::move(records);
+		m_PageNumbers = std::move(numbers);
+		m_PageData = std::move(data);
+		m_Banks = std::move(banks);
+
+		for (uint32_t page = 0; page < MEMORY_PAGES; page++)
+			m_History[page].clear();
+
+		size_t slot = 0;
+		for (uint32_t i = 0; i < m_Records.size(); i++) {
+			for (uint32_t n = 0; n < m_Records[i].pages; n++, slot++)
+				m_History[m_PageNumbers[slot]].push_back({ i, static_cast<uint32_t>(slot) });
+		}
+
+		m_Current = 0;
+		m_Synced = false;
+		return true;
+	}
+
+private:
+	struct FileHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t recordSize;
+		uint64_t count;
+	};
+
+	// A copy of one page: the checkpoint that stored it and where
+	struct Version {
+		uint32_t checkpoint;
+		uint32_t slot;
+	};
+
+	static CheckpointRecord MakeRecord(const i8080::State& state, const CPM::State& cpm, const Memory* memory)
+	{
+		CheckpointRecord record{};
+		record.cycles = state.cycles;
+		record.PC = state.PC;
+		record.SP = state.SP;
+		memcpy(record.registers, state.registers, sizeof(record.registers));
+		record.flags = state.flags;
+		record.stop = static_cast<uint8_t>(state.stop);
+		record.exited = cpm.exited;
+		record.failed = cpm.failed;
+		record.faultKind = static_cast<uint8_t>(state.fault.kind);
+		record.faultCode = state.fault.code;
+		record.faultPC = state.fault.PC;
+		record.bank = memory->GetBank();
+		record.bankCount = memory->GetBankCount();
+		record.bankSlots = static_cast<uint32_t>(memory->GetBanks().pages.size());
+		return record;
+	}
+
+	// Bank layout in range, and stored in full where it is new
+	static bool ValidBanks(const CheckpointRecord& record, const CheckpointRecord* previous)
+	{
+		const bool same = previous && previous->bankCount == record.bankCount && previous->bankSlots == record.bankSlots;
+
+		if (record.bankCount == 0)
+			return record.bankSlots == 0 && record.bank == 0 && record.bankPages == 0;
+
+		return record.bankSlots > 0 && record.bankSlots % record.bankCount == 0 &&
+			record.bankSlots / record.bankCount <= MEMORY_PAGES && record.bank < record.bankCount &&
+			record.bankPages <= record.bankSlots && (same || record.bankPages == record.bankSlots);
+	}
+
+	// Bank slots that differ from the checkpoint before, all of them if
+	// there is none or the banks were laid out differently
+	std::vector<uint32_t> ChangedSlots(size_t index) const
+	{
+		const std::vector<std::shared_ptr<const Memory::PageData>>& pages = m_Banks[index].pages;
+		const bool all = index == 0 || m_Records[index - 1].bankCount != m_Records[index].bankCount ||
+			m_Banks[index - 1].pages.size() != pages.size();
+
+		std::vector<uint32_t> slots;
+		for (uint32_t slot = 0; slot < pages.size(); slot++) {
+			if (all || pages[slot] != m_Banks[index - 1].pages[slot])
+				slots.push_back(slot);
+		}
+
+		return slots;
+	}
+
+	// The newest copy of the page at or before the checkpoint. Checkpoint
+	// 0 stores every page, so there always is one.
+	uint32_t FindSlot(uint32_t page, uint32_t checkpoint) const
+	{
+		const std::vector<Version>& history = m_History[page];
+
+		auto it = std::upper_bound(history.begin(), history.end(), checkpoint,
+			[](uint32_t c, const Version& v) { return c < v.checkpoint; });
+
+		return (it - 1)->slot;
+	}
+
+private:
+	i8080* m_CPU;
+	Memory* m_Memory;
+	CPM* m_CPM;
+
+	std::vector<CheckpointRecord> m_Records;
+	std::vector<uint8_t> m_PageNumbers;			// page of each stored copy, in checkpoint order
+	std::vector<Memory::PageData> m_PageData;	// the copies themselves
+	std::vector<Version> m_History[MEMORY_PAGES];
+	std::vector<Memory::Banks> m_Banks;			// as each checkpoint shared them
+
+	// The checkpoint the machine's memory matched at the last
+	// ClearDirtyPages(). Unknown before the first Add() and after Load().
+	uint32_t m_Current = 0;
+	bool m_Synced = false;
+};
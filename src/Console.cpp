@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <cstring>
+
+#include "Console.h"
+
+///////////////////////////////////
+//////////////CONSOLE/////////////
+/////////////////////////////////
+
+FileConsole* FileConsole::Stdout()
+{
+	static FileConsole console(stdout);
+	return &console;
+}
+
+AsyncConsole::AsyncConsole(ConsoleSink* target)
+	: m_Target(target), m_Ring(CONSOLE_RING_SIZE)
+{
+	m_Thread = std::thread([this] { Drain(); });
+}
+
+AsyncConsole::~AsyncConsole()
+{
+	m_Stopping.store(true, std::memory_order_release);
+	m_Signal.fetch_add(1, std::memory_order_release);
+	m_Signal.notify_one();
+
+	m_Thread.join();
+	m_Target->Flush();
+}
+
+void AsyncConsole::Write(const uint8_t* data, size_t size)
+{
+	uint64_t head = m_Head.load(std::memory_order_relaxed);
+
+	while (size) {
+		const uint64_t tail = m_Tail.load(std::memory_order_acquire);
+		const size_t space = CONSOLE_RING_SIZE - static_cast<size_t>(head - tail);
+
+		if (space == 0) {
+			m_Tail.wait(tail, std::memory_order_acquire);
+			continue;
+		}
+
+		// At most two copies, the second from the start of the ring
+		const size_t count = std::min(size, space);
+		const size_t offset = static_cast<size_t>(head % CONSOLE_RING_SIZE);
+		const size_t first = std::min(count, CONSOLE_RING_SIZE - offset);
+
+		memcpy(&m_Ring[offset], data, first);
+		memcpy(&m_Ring[0], data + first, count - first);
+
+		head += count;
+		data += count;
+		size -= count;
+
+		m_Head.store(head, std::memory_order_release);
+		m_Signal.fetch_add(1, std::memory_order_release);
+		m_Signal.notify_one();
+	}
+}
+
+void AsyncConsole::Flush()
+{
+	const uint64_t head = m_Head.load(std::memory_order_relaxed);
+
+	for (uint64_t tail = m_Tail.load(std::memory_order_acquire); tail != head; tail = m_Tail.load(std::memory_order_acquire))
+		m_Tail.wait(tail, std::memory_order_acquire);
+
+	// The writer is idle until the next Write(), which is this thread's
+	m_Target->Flush();
+}
+
+void AsyncConsole::Drain()
+{
+	uint64_t tail = 0;
+
+	while (1) {
+		const uint32_t signal = m_Signal.load(std::memory_order_acquire);
+		const bool stopping = m_Stopping.load(std::memory_order_acquire);
+		const uint64_t head = m_Head.load(std::memory_order_acquire);
+
+		if (head == tail) {
+			if (stopping)
+				return;
+
+			m_Signal.wait(signal, std::memory_order_acquire);
+			continue;
+		}
+
+		const size_t offset = static_cast<size_t>(tail % CONSOLE_RING_SIZE);
+		const size_t count = std::min(static_cast<size_t>(head - tail), CONSOLE_RING_SIZE - offset);
+
+		m_Target->Write(&m_Ring[offset], count);
+
+		tail += count;
+		m_Tail.store(tail, std::memory_order_release);
+		m_Tail.notify_one();
+	}
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Bytes AsyncConsole buffers before Write() has to wait for the writer
+#define CONSOLE_RING_SIZE 65536
+
+// Where CP/M console output goes. Each BDOS call hands over its bytes in
+// one Write(), exactly as the guest would see them on a terminal.
+class ConsoleSink
+{
+public:
+	virtual ~ConsoleSink() {}
+
+	virtual void Write(const uint8_t* data, size_t size) = 0;
+
+	// Returns once everything written so far has reached its destination
+	virtual void Flush() {}
+};
+
+// Appends to a string, so machines running side by side, or a caller
+// that checks the output, keep theirs apart. The string is the caller's
+// and must outlive the console.
+class BufferConsole : public ConsoleSink
+{
+public:
+	explicit BufferConsole(std::string* buffer)
+		: m_Buffer(buffer) { }
+
+	void Write(const uint8_t* data, size_t size) override { m_Buffer->append(reinterpret_cast<const char*>(data), size); }
+
+private:
+	std::string* m_Buffer;
+};
+
+// Writes to a stdio stream, which stays the caller's to close
+class FileConsole : public ConsoleSink
+{
+public:
+	explicit FileConsole(FILE* file)
+		: m_File(file) { }
+
+	void Write(const uint8_t* data, size_t size) override { fwrite(data, 1, size, m_File); }
+	void Flush() override { fflush(m_File); }
+
+	// What a CPM writes to until given a console of its own
+	static FileConsole* Stdout();
+
+private:
+	FILE* m_File;
+};
+
+// Hands the bytes to a writer thread that passes them on to another
+// console, so a slow file or terminal does not hold up the guest. The
+// two sides share a single-producer, single-consumer ring and only ever
+// touch their own end of it: Write() copies in and publishes the head,
+// the writer copies out and publishes the tail. Each side sleeps on the
+// other's counter only when the ring is full or empty.
+//
+// Only one thread may Write() and Flush(). The destructor passes on
+// whatever is left before the writer stops.
+class AsyncConsole : public ConsoleSink
+{
+public:
+	explicit AsyncConsole(ConsoleSink* target);
+	~AsyncConsole();
+
+	AsyncConsole(const AsyncConsole&) = delete;
+	AsyncConsole& operator=(const AsyncConsole&) = delete;
+
+	void Write(const uint8_t* data, size_t size) override;
+	void Flush() override;
+
+private:
+	void Drain();
+
+private:
+	ConsoleSink* m_Target;
+	std::vector<uint8_t> m_Ring;
+
+	// Running byte counts, the ring offset is their low bits. Apart so
+	// the two threads don't share a cache line.
+	alignas(64) std::atomic<uint64_t> m_Head{ 0 };
+	alignas(64) std::atomic<uint64_t> m_Tail{ 0 };
+
+	// Bumped after each publish and on stopping, for the writer to sleep
+	// on: either may happen between its look at the ring and its wait
+	alignas(64) std::atomic<uint32_t> m_Signal{ 0 };
+	std::atomic<bool> m_Stopping{ false };
+
+	std::thread m_Thread;
+};
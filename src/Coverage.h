@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+// Edge coverage for coverage-guided fuzzing is compiled in only with
+// I8080_COVERAGE=1. With 0 the hooks and the i8080 members behind them
+// are gone entirely, so the engines are exactly as without it.
+#ifndef I8080_COVERAGE
+	#define I8080_COVERAGE 0
+#endif
+
+// Bytes in a coverage map, one hit counter per hashed edge
+#define COVERAGE_MAP_SIZE 65536
+
+// AFL-style edge coverage. Every JMP, CALL, RET and PCHL, taken or not,
+// ends a block: the PC it leaves for is hashed, and the counter at that
+// hash xor the previous block's, shifted, is bumped. The shift keeps
+// A->B and B->A apart. Counters skip zero when they wrap, so an edge
+// once hit never reads as unseen.
+//
+// The map is the caller's, COVERAGE_MAP_SIZE bytes, and may be shared
+// with a fuzzer in another process. Clear it between runs as the fuzzer
+// expects, and reset the previous block with the machine.
+struct Coverage
+{
+	// Spreads the PC over the map, as AFL's QEMU mode does
+	static constexpr uint16_t Hash(uint16_t pc)
+	{
+		return static_cast<uint16_t>((pc >> 4) ^ (pc << 8));
+	}
+
+	static void Hit(uint8_t* map, uint16_t& prev, uint16_t pc)
+	{
+		const uint16_t cur = Hash(pc);
+		uint8_t& counter = map[cur ^ prev];
+
+		counter = static_cast<uint8_t>(counter + 1 + (counter == 0xFF));
+		prev = cur >> 1;
+	}
+};
@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "ForkServer.h"
+#include "Loader.h"
+
+///////////////////////////////////
+////////////FORK SERVER///////////
+/////////////////////////////////
+
+ForkServer::ForkServer()
+	: m_Memory(std::make_unique<Memory>())
+{
+	m_CPM = std::make_unique<CPM>(m_Memory.get());
+	m_CPM->SetConsole(&m_Console);
+
+	m_CPU = std::make_unique<i8080>(m_Memory.get(), m_CPM.get());
+}
+
+bool ForkServer::Boot(const std::vector<std::string>& images, uint16_t bootPC, uint64_t budget, std::string& error)
+{
+	for (const std::string& spec : images) {
+		std::string path;
+		uint16_t address;
+
+		if (!Loader::ParseImageSpec(spec.c_str(), path, address, error) ||
+			!Loader::Load(m_Memory.get(), path.c_str(), address, error))
+			return false;
+	}
+
+	if (m_CPU->GetPC() != bootPC) {
+		m_CPU->SetBreakpoint(bootPC);
+		i8080::StopReason reason = m_CPU->Run(budget);
+		m_CPU->ClearBreakpoint(bootPC);
+
+		if (reason != i8080::StopReason::Breakpoint) {
+			char message[64];
+			snprintf(message, sizeof(message), "Guest never reached 0x%04X", bootPC);
+			error = message;
+			return false;
+		}
+	}
+
+	// Boot output is not any run's
+	m_Output.clear();
+
+	m_Boot = m_CPU->Snapshot();
+	m_Booted = true;
+	return true;
+}
+
+i8080::StopReason ForkServer::Execute(const uint8_t* data, size_t size)
+{
+	if (!m_Booted)
+		return i8080::StopReason::Error;
+
+	m_CPU->Restore(m_Boot);
+	m_Output.clear();
+
+#if I8080_COVERAGE
+	m_CPU->ResetCoverage();
+#endif
+
+	Inject(data, size);
+
+	m_Executions++;
+	return m_CPU->Run(m_Budget);
+}
+
+void ForkServer::Inject(const uint8_t* data, size_t size)
+{
+	switch (m_InputMode)
+	{
+		case InputMode::Console:
+			m_CPM->SetInput(data, size);
+			break;
+
+		case InputMode::CommandTail: {
+			const uint8_t length = static_cast<uint8_t>(std::min<size_t>(size, CPM_COMMAND_TAIL_MAX));
+
+			m_Memory->Load(CPM_COMMAND_TAIL, &length, 1);
+			m_Memory->Load(CPM_COMMAND_TAIL + 1, data, length);
+			m_CPM->SetInput(nullptr, 0);
+			break;
+		}
+
+		case InputMode::Memory:
+			m_Memory->Load(m_InputAddr, data, std::min<size_t>(size, MEMORY_SIZE - m_InputAddr));
+			m_CPM->SetInput(nullptr, 0);
+			break;
+	}
+}
+
+
+///////////////////////////////////
+/////////////LIBFUZZER////////////
+/////////////////////////////////
+
+#if I8080_LIBFUZZER
+
+static ForkServer* s_Server = nullptr;
+static bool s_ErrorsOk = false;
+
+#if I8080_COVERAGE
+// libFuzzer reads and clears counters in this section around every run,
+// alongside its own
+__attribute__((used, section("__libfuzzer_extra_counters")))
+static uint8_t s_Coverage[COVERAGE_MAP_SIZE];
+#endif
+
+// libFuzzer leaves flags starting with "--" alone, so the target takes
+// its own: --image=path[@address] (repeatable), --boot=<hex PC>,
+// --budget=<instructions>, --input=console|tail|<hex address>,
+// --threaded/--blocks/--jit and --errors-ok. Without --errors-ok an
+// invalid opcode or BDOS function aborts, so the fuzzer reports it as a
+// crash.
+extern "C" int LLVMFuzzerInitialize(int* argc, char*** argv)
+{
+	std::vector<std::string> images;
+	uint16_t bootPC = LOADER_DEFAULT_ADDRESS;
+	uint64_t budget = FORK_SERVER_DEFAULT_BUDGET;
+
+	s_Server = new ForkServer();
+
+	for (int i = 1; i < *argc; i++) {
+		const char* arg = (*argv)[i];
+
+		if (strncmp(arg, "--image=", 8) == 0)
+			images.push_back(arg + 8);
+		else if (strncmp(arg, "--boot=", 7) == 0)
+			bootPC = static_cast<uint16_t>(strtoul(arg + 7, nullptr, 16));
+		else if (strncmp(arg, "--budget=", 9) == 0)
+			budget = strtoull(arg + 9, nullptr, 10);
+		else if (strcmp(arg, "--input=console") == 0)
+			s_Server->SetInputMode(ForkServer::InputMode::Console);
+		else if (strcmp(arg, "--input=tail") == 0)
+			s_Server->SetInputMode(ForkServer::InputMode::CommandTail);
+		else if (strncmp(arg, "--input=", 8) == 0)
+			s_Server->SetInputMode(ForkServer::InputMode::Memory, static_cast<uint16_t>(strtoul(arg + 8, nullptr, 16)));
+		else if (strcmp(arg, "--threaded") == 0)
+			s_Server->SetEngine(i8080::Engine::Threaded);
+		else if (strcmp(arg, "--blocks") == 0)
+			s_Server->SetEngine(i8080::Engine::Blocks);
+		else if (strcmp(arg, "--jit") == 0)
+			s_Server->SetEngine(i8080::Engine::Jit);
+		else if (strcmp(arg, "--errors-ok") == 0)
+			s_ErrorsOk = true;
+	}
+
+	if (images.empty()) {
+		fprintf(stderr, "No guest, give one with --image=path[@address]\n");
+		exit(1);
+	}
+
+	// The boot gets the same budget as every run
+	std::string error;
+	if (!s_Server->Boot(images, bootPC, budget, error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		exit(1);
+	}
+
+	s_Server->SetBudget(budget);
+
+#if I8080_COVERAGE
+	s_Server->SetCoverage(s_Coverage);
+#endif
+
+	return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	if (s_Server->Execute(data, size) == i8080::StopReason::Error && !s_ErrorsOk)
+		abort();
+
+	return 0;
+}
+
+#endif
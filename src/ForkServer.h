@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "i8080.h"
+#include "Memory.h"
+#include "CPM.h"
+
+// Build with I8080_LIBFUZZER=1 and -fsanitize=fuzzer, leaving out
+// main.cpp, for LLVMFuzzerInitialize() and LLVMFuzzerTestOneInput()
+#ifndef I8080_LIBFUZZER
+	#define I8080_LIBFUZZER 0
+#endif
+
+// Instructions an execution runs before it is cut off
+#define FORK_SERVER_DEFAULT_BUDGET 1000000
+
+// Where the CP/M command tail lives: its length, then up to 127 bytes
+#define CPM_COMMAND_TAIL 0x0080
+#define CPM_COMMAND_TAIL_MAX 127
+
+// Runs one guest over and over on inputs, as a fuzzer's target. Boot()
+// loads the images and runs to the chosen PC once, then snapshots the
+// machine. Each Execute() restores that snapshot, which copies back only
+// the pages the last run wrote, puts the input in and runs until the
+// program stops or the budget runs out. The same Memory, CPM and i8080
+// serve every run, so nothing is loaded or built after the boot.
+class ForkServer
+{
+public:
+	// How an input reaches the guest: as console input for BDOS functions
+	// 1 and 10, as the command tail at CPM_COMMAND_TAIL, or copied to a
+	// fixed address in memory. Whatever does not fit is dropped.
+	enum class InputMode { Console, CommandTail, Memory };
+
+public:
+	ForkServer();
+
+	// Images are "path[@address]". Runs from 0x100 until PC is bootPC,
+	// within budget instructions, or snapshots at 0x100 if bootPC is
+	// too. Returns false if an image fails to load or the guest stops or
+	// runs out of budget before getting there.
+	bool Boot(const std::vector<std::string>& images, uint16_t bootPC, uint64_t budget, std::string& error);
+
+	void SetEngine(i8080::Engine engine) { m_CPU->SetEngine(engine); }
+	i8080::Engine GetEngine() const { return m_CPU->GetEngine(); }
+	void SetBudget(uint64_t budget) { m_Budget = budget; }
+	void SetInputMode(InputMode mode, uint16_t addr = 0) { m_InputMode = mode; m_InputAddr = addr; }
+
+#if I8080_COVERAGE
+	// Every run counts its edges into the map from a fresh previous block.
+	// Clearing the map between runs is up to the caller.
+	void SetCoverage(uint8_t* map) { m_CPU->SetCoverage(map); }
+#endif
+
+	i8080::StopReason Execute(const uint8_t* data, size_t size);
+
+	// Of the last Execute(), valid until the next
+	const std::string& GetOutput() const { return m_Output; }
+	i8080::State GetState() const { return m_CPU->GetState(); }
+
+	uint64_t GetExecutions() const { return m_Executions; }
+
+private:
+	void Inject(const uint8_t* data, size_t size);
+
+private:
+	std::unique_ptr<Memory> m_Memory;
+	std::unique_ptr<CPM> m_CPM;
+	std::unique_ptr<i8080> m_CPU;
+	i8080::MachineSnapshot m_Boot;
+	bool m_Booted = false;
+
+	uint64_t m_Budget = FORK_SERVER_DEFAULT_BUDGET;
+	InputMode m_InputMode = InputMode::Console;
+	uint16_t m_InputAddr = 0;
+
+	std::string m_Output;
+	BufferConsole m_Console{ &m_Output };
+	uint64_t m_Executions = 0;
+};
@@ -0,0 +1,1083 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_WIN32)
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+#endif
+
+#include "Jit.h"
+
+#if I8080_JIT
+
+// Host calling convention used by the generated calls out
+#if defined(_WIN32)
+	#define JIT_WIN64 1
+#else
+	#define JIT_WIN64 0
+#endif
+
+// Room left for one block before the code buffer is flushed
+#define JIT_BLOCK_RESERVE (64 * 1024)
+
+// Times a block is translated before it is left to its handlers
+#define JIT_TRANSLATION_LIMIT 16
+
+// Granularity of the protection changes
+#define JIT_PAGE_SIZE 4096
+
+// Host register numbers, as they go in the ModRM byte
+#define JIT_EAX 0
+#define JIT_ECX 1
+#define JIT_EDX 2
+
+// Generated code keeps the i8080 pointer in rbx, the remaining
+// instruction budget in r12, the Memory in r13 and the block cache's
+// invalidation flag in r14. All are callee-saved on SysV and Win64, so
+// calls out leave them alone. eax, ecx and edx are scratch and never
+// live from one 8080 instruction to the next.
+
+// Called from generated code for the slow pages
+static uint32_t ReadMemory(Memory* memory, uint32_t addr)
+{
+	return memory->Read(static_cast<uint16_t>(addr));
+}
+
+static void WriteMemory(Memory* memory, uint32_t addr, uint32_t val)
+{
+	memory->Write(static_cast<uint16_t>(addr), static_cast<uint8_t>(val));
+}
+
+void Jit::ResolveFlags(i8080* cpu)
+{
+	cpu->m_flags.get();
+}
+
+Jit::Jit(i8080* cpu, Memory* memory)
+	: m_CPU(cpu), m_Memory(memory), m_Cache(memory), m_Native(65536, nullptr)
+{
+#if defined(_WIN32)
+	m_Code = static_cast<uint8_t*>(VirtualAlloc(nullptr, JIT_CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+#else
+	void* code = mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	m_Code = code == MAP_FAILED ? nullptr : static_cast<uint8_t*>(code);
+#endif
+
+	// i8080::SetEngine() checks Ready() and falls back to the block cache
+	if (!m_Code)
+		return;
+
+	const uint8_t* base = reinterpret_cast<const uint8_t*>(cpu);
+	m_RegistersOffset = static_cast<int32_t>(reinterpret_cast<const uint8_t*>(cpu->registers.bytes) - base);
+	m_PCOffset = static_cast<int32_t>(reinterpret_cast<const uint8_t*>(&cpu->PC) - base);
+	m_SPOffset = static_cast<int32_t>(reinterpret_cast<const uint8_t*>(&cpu->SP) - base);
+	m_CyclesOffset = static_cast<int32_t>(reinterpret_cast<const uint8_t*>(&cpu->m_Cycles) - base);
+	m_FlagsOffset = static_cast<int32_t>(reinterpret_cast<const uint8_t*>(&cpu->m_flags.reg) - base);
+	m_PendingOffset = static_cast<int32_t>(reinterpret_cast<const uint8_t*>(&cpu->m_flags.pending) - base);
+
+	const uint8_t* memoryBase = reinterpret_cast<const uint8_t*>(memory);
+	m_BytesOffset = static_cast<int32_t>(memory->m_Memory - memoryBase);
+	m_SlowReadOffset = static_cast<int32_t>(reinterpret_cast<const uint8_t*>(memory->m_SlowRead) - memoryBase);
+	m_SlowWriteOffset = static_cast<int32_t>(reinterpret_cast<const uint8_t*>(memory->m_SlowWrite) - memoryBase);
+
+	EmitEnterExit();
+	m_CodeStart = m_CodeUsed;
+
+	// A host that refuses executable pages gets the block cache instead
+	if (!SetWritable(false))
+		Release();
+}
+
+Jit::~Jit()
+{
+	Release();
+}
+
+void Jit::Release()
+{
+	if (!m_Code)
+		return;
+
+#if defined(_WIN32)
+	VirtualFree(m_Code, 0, MEM_RELEASE);
+#else
+	munmap(m_Code, JIT_CODE_SIZE);
+#endif
+
+	m_Code = nullptr;
+}
+
+void Jit::Run(uint64_t count)
+{
+	int64_t budget = static_cast<int64_t>(count);
+
+	while (budget > 0 && m_CPU->m_Stop == i8080::StopReason::None) {
+		if (m_Cache.Invalidated()) {
+			Flush();
+			m_Cache.ClearInvalidated();
+		}
+
+		// Generated code can't report each instruction to the profiler
+		if (m_CPU->m_Profiler) {
+			RunHandlers(budget);
+			continue;
+		}
+
+		// Idle loops don't chain to themselves, so every pass comes back here
+		const BlockCache::Block* block = m_Cache.Find(m_CPU->PC);
+
+		if (block && block->idle.kind != BlockCache::IdleLoop::Kind::None) {
+			uint64_t skipped = BlockCache::SkipIdleLoop(m_CPU, *block, static_cast<uint64_t>(budget));
+
+			if (skipped > 0) {
+				budget -= static_cast<int64_t>(skipped);
+				continue;
+			}
+		}
+
+		const uint8_t* code = m_Native[m_CPU->PC];
+		if (!code)
+			code = Compile(m_CPU->PC);
+
+		if (!code) {
+			RunHandlers(budget);
+			continue;
+		}
+
+		SetWritable(false);
+
+		m_PendingLink = nullptr;
+		int64_t left = m_Enter(m_CPU, code, budget);
+
+		// Too little budget left for the block at PC
+		if (left == budget) {
+			m_CPU->Cycle();
+			budget--;
+			continue;
+		}
+
+		budget = left;
+
+		// Left through a link slot whose target was not translated yet
+		if (m_PendingLink && !m_Cache.Invalidated()) {
+			uint8_t* link = m_PendingLink;
+
+			const uint8_t* target = m_Native[m_CPU->PC];
+			if (!target)
+				target = Compile(m_CPU->PC);
+
+			// Compile() may have flushed the block holding the slot
+			if (target && m_PendingLink == link) {
+				SetWritable(true);
+				PatchRel32(link, target);
+			}
+		}
+	}
+}
+
+// Runs the block at PC through its handlers, as RunBlocks() does, for
+// code rewritten too often to be worth translating again, and for all
+// code while profiling. Single steps if there is no block or too little
+// budget for it.
+void Jit::RunHandlers(int64_t& budget)
+{
+	const BlockCache::Block* block = m_Cache.Lookup(m_CPU->PC);
+
+	if (!block || block->instructions.size() > static_cast<uint64_t>(budget)) {
+		if (m_CPU->m_Profiler)
+			m_CPU->ProfiledCycle();
+		else
+			m_CPU->Cycle();
+		budget--;
+		return;
+	}
+
+	if (m_CPU->m_Profiler) {
+		budget -= static_cast<int64_t>(m_Cache.RunProfiled(m_CPU, *block));
+		return;
+	}
+
+	m_CPU->m_Cycles += block->cycles;
+
+	for (size_t i = 0; i < block->instructions.size(); i++) {
+		const BlockCache::Instruction& instr = block->instructions[i];
+
+		m_CPU->PC += instr.length;
+		(m_CPU->*instr.handler)(instr.operand);
+		budget--;
+
+		if (m_Cache.Invalidated()) {
+			for (i++; i < block->instructions.size(); i++)
+				m_CPU->m_Cycles -= block->instructions[i].cycles;
+			break;
+		}
+	}
+}
+
+void Jit::Flush()
+{
+	m_CodeUsed = m_CodeStart;
+	m_PendingLink = nullptr;
+
+	// Self-modifying code flushes often, so only the entries set are cleared
+	for (uint16_t addr : m_Translated)
+		m_Native[addr] = nullptr;
+
+	m_Translated.clear();
+}
+
+// Switches the code written so far between read-write and read-execute.
+// The rest of the buffer stays read-write, so a flush that starts over
+// only pays for the pages it used. Returns false if the host would not.
+bool Jit::SetWritable(bool writable)
+{
+	if (m_Writable == writable)
+		return true;
+
+	// Becoming writable undoes exactly what the last switch protected
+	const size_t size = writable ? m_Protected : (m_CodeUsed + JIT_PAGE_SIZE - 1) & ~static_cast<size_t>(JIT_PAGE_SIZE - 1);
+
+#if defined(_WIN32)
+	DWORD old;
+	if (size > 0 && !VirtualProtect(m_Code, size, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old))
+		return false;
+
+	if (!writable)
+		FlushInstructionCache(GetCurrentProcess(), m_Code, m_CodeUsed);
+#else
+	if (size > 0 && mprotect(m_Code, size, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0)
+		return false;
+#endif
+
+	m_Protected = writable ? 0 : size;
+	m_Writable = writable;
+	return true;
+}
+
+const uint8_t* Jit::Compile(uint16_t addr)
+{
+	// Self-modifying code would flush and translate the same blocks over
+	// and over, past the limit they run through their handlers instead
+	if (m_Translations[addr] >= JIT_TRANSLATION_LIMIT)
+		return nullptr;
+
+	const BlockCache::Block* block = m_Cache.Lookup(addr);
+	if (!block)
+		return nullptr;
+
+	m_Translations[addr]++;
+	SetWritable(true);
+
+	if (JIT_CODE_SIZE - m_CodeUsed < JIT_BLOCK_RESERVE)
+		Flush();
+
+	const uint8_t* start = m_Code + m_CodeUsed;
+	const uint32_t count = static_cast<uint32_t>(block->instructions.size());
+
+	// Leave to the dispatcher if the whole block doesn't fit the budget
+	EmitBytes({ 0x49, 0x81, 0xFC }); Emit32(count);		// cmp r12, count
+	EmitJumpRel32(0x0F, 0x8C, m_Exit);					// jl exit
+	EmitBytes({ 0x49, 0x81, 0xEC }); Emit32(count);		// sub r12, count
+	EmitBytes({ 0x48, 0x81, 0x83 }); Emit32(m_CyclesOffset); Emit32(block->cycles);	// add qword [rbx+cycles], block cycles
+
+	// Whatever ran before may have left flags owed
+	m_FlagsResolved = false;
+	m_Refunds.clear();
+
+	uint32_t cyclesLeft = block->cycles;
+
+	uint16_t pc = block->start;
+	bool pcStored = false;
+
+	for (uint32_t i = 0; i < count; i++) {
+		const BlockCache::Instruction& instr = block->instructions[i];
+		const i8080::OpGroup group = i8080::s_GroupTable[instr.opcode];
+		pc += instr.length;
+		cyclesLeft -= instr.cycles;
+
+		m_Accessed = false;
+
+		if (EmitNative(instr, pc)) {
+			// Control flow leaves PC where it goes
+			const bool branch = BlockCache::EndsBlock(group);
+			pcStored = branch;
+
+			// A slow write, or a device behind a slow read, may have
+			// dropped cached code
+			if (m_Accessed) {
+				EmitBytes({ 0x41, 0x80, 0x3E, 0x00 });		// cmp byte [r14], 0
+				EmitBytes({ 0x0F, 0x85 });					// jne refund
+				m_Refunds.push_back({ m_Code + m_CodeUsed, count - i - 1, cyclesLeft, branch ? -1 : pc });
+				Emit32(0);
+			}
+			continue;
+		}
+
+		// Handlers expect PC to point past the instruction
+		EmitBytes({ 0x66, 0xC7, 0x83 }); Emit32(m_PCOffset); Emit16(pc);	// mov word [rbx+PC], pc
+		EmitCall(i8080::s_JitTable[instr.opcode], instr.operand);
+		pcStored = true;
+
+		// A write into cached code ends the block here
+		EmitBytes({ 0x41, 0x80, 0x3E, 0x00 });		// cmp byte [r14], 0
+		EmitBytes({ 0x0F, 0x85 });					// jne refund
+		m_Refunds.push_back({ m_Code + m_CodeUsed, count - i - 1, cyclesLeft, -1 });
+		Emit32(0);
+	}
+
+	if (!pcStored) {
+		EmitBytes({ 0x66, 0xC7, 0x83 }); Emit32(m_PCOffset); Emit16(pc);	// mov word [rbx+PC], pc
+	}
+
+	// Chain to the static successors, anything else goes back through the dispatcher
+	const BlockCache::Instruction& last = block->instructions.back();
+
+	EmitBytes({ 0x0F, 0xB7, 0x83 }); Emit32(m_PCOffset);	// movzx eax, word [rbx+PC]
+
+	switch (i8080::s_GroupTable[last.opcode])
+	{
+		case i8080::OpGroup::JMP:
+		case i8080::OpGroup::CALL:
+			// WBOOT and BDOS calls may stop the CPU, leave that to the dispatcher
+			if (last.operand == 0x0000 || last.operand == 0x0005)
+				break;
+
+			if (block->idle.kind == BlockCache::IdleLoop::Kind::None)
+				EmitLinkSlot(last.operand);
+
+			EmitLinkSlot(pc);
+			break;
+
+		case i8080::OpGroup::RET:
+		case i8080::OpGroup::PCHL:
+		case i8080::OpGroup::HLT:
+		case i8080::OpGroup::Invalid:
+			break;
+
+		default:
+			EmitLinkSlot(pc);
+	}
+
+	EmitJumpRel32(0xE9, -1, m_Exit);						// jmp exit
+
+	for (const Refund& refund : m_Refunds) {
+		PatchRel32(refund.rel, m_Code + m_CodeUsed);
+
+		if (refund.pc >= 0) {
+			EmitBytes({ 0x66, 0xC7, 0x83 }); Emit32(m_PCOffset); Emit16(static_cast<uint16_t>(refund.pc));	// mov word [rbx+PC], pc
+		}
+
+		if (refund.instructions > 0) {
+			EmitBytes({ 0x49, 0x81, 0xC4 }); Emit32(refund.instructions);							// add r12, n
+			EmitBytes({ 0x48, 0x81, 0xAB }); Emit32(m_CyclesOffset); Emit32(refund.cycles);		// sub qword [rbx+cycles], n
+		}
+
+		EmitJumpRel32(0xE9, -1, m_Exit);							// jmp exit
+	}
+
+	m_Native[addr] = start;
+	m_Translated.push_back(addr);
+	return start;
+}
+
+// Emitted once at the start of the buffer:
+//   int64_t enter(i8080* cpu, const uint8_t* code, int64_t budget)
+// and the shared exit that returns the budget left. Five pushes and the
+// return address keep the stack 16-byte aligned for the calls out.
+void Jit::EmitEnterExit()
+{
+	m_Enter = reinterpret_cast<EnterFunc>(m_Code + m_CodeUsed);
+
+	EmitBytes({ 0x53, 0x55, 0x41, 0x54 });			// push rbx; push rbp; push r12
+	EmitBytes({ 0x41, 0x55, 0x41, 0x56 });			// push r13; push r14
+	EmitBytes({ 0x49, 0xBD }); Emit64(reinterpret_cast<uint64_t>(m_Memory));					// mov r13, memory
+	EmitBytes({ 0x49, 0xBE }); Emit64(reinterpret_cast<uint64_t>(m_Cache.InvalidatedFlag()));	// mov r14, &invalidated
+#if JIT_WIN64
+	EmitBytes({ 0x48, 0x83, 0xEC, 0x20 });			// sub rsp, 32
+	EmitBytes({ 0x48, 0x89, 0xCB });				// mov rbx, rcx
+	EmitBytes({ 0x4D, 0x89, 0xC4 });				// mov r12, r8
+	EmitBytes({ 0xFF, 0xE2 });						// jmp rdx
+#else
+	EmitBytes({ 0x48, 0x89, 0xFB });				// mov rbx, rdi
+	EmitBytes({ 0x49, 0x89, 0xD4 });				// mov r12, rdx
+	EmitBytes({ 0xFF, 0xE6 });						// jmp rsi
+#endif
+
+	m_Exit = m_Code + m_CodeUsed;
+
+	EmitBytes({ 0x4C, 0x89, 0xE0 });				// mov rax, r12
+#if JIT_WIN64
+	EmitBytes({ 0x48, 0x83, 0xC4, 0x20 });			// add rsp, 32
+#endif
+	EmitBytes({ 0x41, 0x5E, 0x41, 0x5D });			// pop r14; pop r13
+	EmitBytes({ 0x41, 0x5C, 0x5D, 0x5B, 0xC3 });	// pop r12; pop rbp; pop rbx; ret
+}
+
+int32_t Jit::RegisterOffset(uint8_t reg) const
+{
+	return m_RegistersOffset + i8080::RegisterFile::Offset(reg);
+}
+
+// BC, DE and HL are native words in the register file
+int32_t Jit::PairOffset(uint8_t rp) const
+{
+	return rp == 0x3 ? m_SPOffset : m_RegistersOffset + rp * 2;
+}
+
+bool Jit::EmitNative(const BlockCache::Instruction& instr, [[maybe_unused]] uint16_t next)
+{
+	const uint8_t opcode = instr.opcode;
+	const uint8_t dst = (opcode & 0x38) >> 3;
+	const uint8_t src = opcode & 0x7;
+	const uint8_t rp = (opcode & 0x30) >> 4;
+
+	switch (i8080::s_GroupTable[opcode])
+	{
+		case i8080::OpGroup::NOP:
+			return true;
+
+		case i8080::OpGroup::MOV:
+			if (src == MEMORY_REF) {
+				EmitLoad16(JIT_EDX, PairOffset(HL));
+				EmitRead();
+				EmitStore8(JIT_ECX, RegisterOffset(dst));
+			}
+			else if (dst == MEMORY_REF) {
+				EmitLoad16(JIT_EDX, PairOffset(HL));
+				EmitLoad8(JIT_ECX, RegisterOffset(src));
+				EmitWrite();
+			}
+			else {
+				EmitLoad8(JIT_EAX, RegisterOffset(src));
+				EmitStore8(JIT_EAX, RegisterOffset(dst));
+			}
+			return true;
+
+		case i8080::OpGroup::MVI:
+			if (dst == MEMORY_REF) {
+				EmitLoad16(JIT_EDX, PairOffset(HL));
+				Emit8(0xB9); Emit32(instr.operand & 0xFF);		// mov ecx, imm
+				EmitWrite();
+			}
+			else {
+				EmitBytes({ 0xC6, 0x83 }); Emit32(RegisterOffset(dst)); Emit8(instr.operand & 0xFF);	// mov byte [rbx+dst], imm8
+			}
+			return true;
+
+		case i8080::OpGroup::LXI:
+			EmitBytes({ 0x66, 0xC7, 0x83 }); Emit32(PairOffset(rp)); Emit16(instr.operand);	// mov word [rbx+rp], imm16
+			return true;
+
+		case i8080::OpGroup::INX:
+		case i8080::OpGroup::DCX: {
+			bool inc = i8080::s_GroupTable[opcode] == i8080::OpGroup::INX;
+
+			EmitBytes({ 0x66, 0x83, static_cast<uint8_t>(inc ? 0x83 : 0xAB) }); Emit32(PairOffset(rp)); Emit8(1);	// add/sub word [rbx+rp], 1
+			return true;
+		}
+
+		case i8080::OpGroup::INR:
+		case i8080::OpGroup::DCR: {
+			bool inc = i8080::s_GroupTable[opcode] == i8080::OpGroup::INR;
+
+			EmitResolveFlags();
+
+			if (dst == MEMORY_REF) {
+				EmitLoad16(JIT_EDX, PairOffset(HL));
+				EmitRead();
+				EmitBytes({ 0x89, 0xC8 });							// mov eax, ecx
+			}
+			else {
+				EmitLoad8(JIT_EAX, RegisterOffset(dst));
+			}
+
+			EmitBytes({ 0xFE, static_cast<uint8_t>(inc ? 0xC0 : 0xC8) });	// inc/dec al
+			Emit8(0x9F);													// lahf
+
+			// CY is left alone, AC is a borrow on the host after DEC
+			EmitMergeFlags(0x2B, 0xD4, !inc, false);
+
+			if (dst == MEMORY_REF) {
+				EmitBytes({ 0x89, 0xC1 });							// mov ecx, eax
+				EmitLoad16(JIT_EDX, PairOffset(HL));
+				EmitWrite();
+			}
+			else {
+				EmitStore8(JIT_EAX, RegisterOffset(dst));
+			}
+			return true;
+		}
+
+		case i8080::OpGroup::RegisterToAcc:
+			// Resolving calls out, so it goes before any load
+			if (src == MEMORY_REF) {
+				EmitResolveFlags();
+				EmitLoad16(JIT_EDX, PairOffset(HL));
+				EmitRead();
+			}
+			else {
+				EmitResolveFlags();
+				EmitLoad8(JIT_ECX, RegisterOffset(src));
+			}
+
+			EmitAlu(dst);
+			return true;
+
+		case i8080::OpGroup::Immediate:
+			EmitResolveFlags();
+			Emit8(0xB9); Emit32(instr.operand & 0xFF);				// mov ecx, imm
+			EmitAlu(dst);
+			return true;
+
+		case i8080::OpGroup::RotateAcc: {
+			static const uint8_t modrm[] = { 0x83, 0x8B, 0x93, 0x9B };	// rol, ror, rcl, rcr
+
+			EmitResolveFlags();
+
+			// RAL and RAR rotate through CY
+			if (opcode & 0x10) {
+				EmitLoad8(JIT_ECX, m_FlagsOffset);
+				EmitBytes({ 0xD1, 0xE9 });							// shr ecx, 1
+			}
+
+			EmitBytes({ 0xD0, modrm[(opcode & 0x18) >> 3] }); Emit32(RegisterOffset(A));	// rotate byte [rbx+A], 1
+			EmitCarryOut();
+			return true;
+		}
+
+		case i8080::OpGroup::DAD:
+			EmitResolveFlags();
+			EmitLoad16(JIT_EAX, PairOffset(rp));
+			EmitBytes({ 0x66, 0x01, 0x83 }); Emit32(PairOffset(HL));	// add word [rbx+HL], ax
+			EmitCarryOut();
+			return true;
+
+		case i8080::OpGroup::STC:
+			EmitResolveFlags();
+			EmitBytes({ 0x80, 0x8B }); Emit32(m_FlagsOffset); Emit8(0x01);	// or byte [rbx+flags], 1
+			return true;
+
+		case i8080::OpGroup::CMC:
+			EmitResolveFlags();
+			EmitBytes({ 0x80, 0xB3 }); Emit32(m_FlagsOffset); Emit8(0x01);	// xor byte [rbx+flags], 1
+			return true;
+
+		case i8080::OpGroup::CMA:
+			EmitBytes({ 0xF6, 0x93 }); Emit32(RegisterOffset(A));			// not byte [rbx+A]
+			return true;
+
+		case i8080::OpGroup::XCHG:
+			EmitLoad16(JIT_EAX, PairOffset(HL));
+			EmitLoad16(JIT_ECX, PairOffset(DE));
+			EmitStore16(JIT_ECX, PairOffset(HL));
+			EmitStore16(JIT_EAX, PairOffset(DE));
+			return true;
+
+		case i8080::OpGroup::SPHL:
+			EmitLoad16(JIT_EAX, PairOffset(HL));
+			EmitStore16(JIT_EAX, m_SPOffset);
+			return true;
+
+		case i8080::OpGroup::AccTransfer:
+			// STAX and LDAX only take BC and DE
+			EmitLoad16(JIT_EDX, PairOffset(rp & 0x1));
+
+			if (opcode & 0x8) {
+				EmitRead();
+				EmitStore8(JIT_ECX, RegisterOffset(A));
+			}
+			else {
+				EmitLoad8(JIT_ECX, RegisterOffset(A));
+				EmitWrite();
+			}
+			return true;
+
+		case i8080::OpGroup::DirectAddressing: {
+			const uint16_t addr = instr.operand;
+
+			// SHLD, LHLD, STA, LDA
+			switch ((opcode & 0x18) >> 3)
+			{
+				case 0x0:
+					Emit8(0xBA); Emit32(addr);							// mov edx, addr
+					EmitLoad8(JIT_ECX, RegisterOffset(L));
+					EmitWrite();
+					Emit8(0xBA); Emit32(static_cast<uint16_t>(addr + 1));
+					EmitLoad8(JIT_ECX, RegisterOffset(H));
+					EmitWrite();
+					break;
+
+				case 0x1:
+					Emit8(0xBA); Emit32(addr);
+					EmitRead();
+					EmitStore8(JIT_ECX, RegisterOffset(L));
+					Emit8(0xBA); Emit32(static_cast<uint16_t>(addr + 1));
+					EmitRead();
+					EmitStore8(JIT_ECX, RegisterOffset(H));
+					break;
+
+				case 0x2:
+					Emit8(0xBA); Emit32(addr);
+					EmitLoad8(JIT_ECX, RegisterOffset(A));
+					EmitWrite();
+					break;
+
+				case 0x3:
+					Emit8(0xBA); Emit32(addr);
+					EmitRead();
+					EmitStore8(JIT_ECX, RegisterOffset(A));
+					break;
+			}
+			return true;
+		}
+
+		case i8080::OpGroup::PUSH:
+			if (rp == 0x3) {
+				EmitResolveFlags();
+				EmitPush(RegisterOffset(A), m_FlagsOffset);
+			}
+			else {
+				EmitPush(RegisterOffset(rp * 2), RegisterOffset(rp * 2 + 1));
+			}
+			return true;
+
+		case i8080::OpGroup::POP:
+			if (rp == 0x3) {
+				// POP PSW replaces the whole flag byte, nothing is owed after it
+				EmitPop(RegisterOffset(A), m_FlagsOffset);
+				EmitBytes({ 0xC6, 0x83 }); Emit32(m_PendingOffset); Emit8(0);	// mov byte [rbx+pending], 0
+				m_FlagsResolved = true;
+			}
+			else {
+				EmitPop(RegisterOffset(rp * 2), RegisterOffset(rp * 2 + 1));
+			}
+			return true;
+
+#if !I8080_COVERAGE
+		// Control flow. With coverage compiled in it goes through the
+		// handlers, which count the edges.
+		case i8080::OpGroup::JMP: {
+			const uint16_t target = instr.operand;
+
+			// WBOOT
+			if (target == 0x0000)
+				return false;
+
+			// As in ProcessJMP(), cc 0 with bit 0 set is JMP
+			const bool always = dst == 0x0 && (opcode & 0x1);
+
+			if (!always) {
+				EmitResolveFlags();
+				EmitBytes({ 0x66, 0xC7, 0x83 }); Emit32(m_PCOffset); Emit16(next);	// mov word [rbx+PC], next
+			}
+
+			uint8_t* skip = always ? nullptr : EmitSkipUnless(dst);
+			EmitBytes({ 0x66, 0xC7, 0x83 }); Emit32(m_PCOffset); Emit16(target);	// mov word [rbx+PC], target
+
+			if (skip)
+				PatchRel32(skip, m_Code + m_CodeUsed);
+			return true;
+		}
+
+		case i8080::OpGroup::CALL: {
+			const uint16_t target = instr.operand;
+
+			// BDOS, trapped whatever the condition
+			if (target == 0x0005)
+				return false;
+
+			// As in ProcessCALL(), cc 1 with bit 0 set is CALL
+			const bool always = dst == 0x1 && (opcode & 0x1);
+			uint8_t* skip = nullptr;
+
+			if (!always) {
+				EmitResolveFlags();
+				EmitBytes({ 0x66, 0xC7, 0x83 }); Emit32(m_PCOffset); Emit16(next);	// mov word [rbx+PC], next
+				skip = EmitSkipUnless(dst);
+			}
+
+			if (opcode != 0xCD) {
+				EmitBytes({ 0x48, 0x83, 0x83 }); Emit32(m_CyclesOffset); Emit8(BRANCH_TAKEN_CYCLES);	// add qword [rbx+cycles], taken
+			}
+
+			EmitPushImmediate(next);
+			EmitBytes({ 0x66, 0xC7, 0x83 }); Emit32(m_PCOffset); Emit16(target);	// mov word [rbx+PC], target
+
+			if (skip)
+				PatchRel32(skip, m_Code + m_CodeUsed);
+			return true;
+		}
+
+		case i8080::OpGroup::RET: {
+			const bool always = dst == 0x1 && (opcode & 0x1);
+			uint8_t* skip = nullptr;
+
+			if (!always) {
+				EmitResolveFlags();
+				EmitBytes({ 0x66, 0xC7, 0x83 }); Emit32(m_PCOffset); Emit16(next);	// mov word [rbx+PC], next
+				skip = EmitSkipUnless(dst);
+			}
+
+			if (opcode != 0xC9) {
+				EmitBytes({ 0x48, 0x83, 0x83 }); Emit32(m_CyclesOffset); Emit8(BRANCH_TAKEN_CYCLES);	// add qword [rbx+cycles], taken
+			}
+
+			EmitPop(m_PCOffset + 1, m_PCOffset);
+
+			if (skip)
+				PatchRel32(skip, m_Code + m_CodeUsed);
+			return true;
+		}
+
+		case i8080::OpGroup::PCHL:
+			EmitLoad16(JIT_EAX, PairOffset(HL));
+			EmitStore16(JIT_EAX, m_PCOffset);
+			return true;
+#endif
+
+		default:
+			return false;
+	}
+}
+
+void Jit::EmitLoad8(uint8_t host, int32_t offset)
+{
+	EmitBytes({ 0x0F, 0xB6, static_cast<uint8_t>(0x83 | host << 3) }); Emit32(offset);	// movzx host, byte [rbx+offset]
+}
+
+void Jit::EmitStore8(uint8_t host, int32_t offset)
+{
+	EmitBytes({ 0x88, static_cast<uint8_t>(0x83 | host << 3) }); Emit32(offset);		// mov byte [rbx+offset], host
+}
+
+void Jit::EmitLoad16(uint8_t host, int32_t offset)
+{
+	EmitBytes({ 0x0F, 0xB7, static_cast<uint8_t>(0x83 | host << 3) }); Emit32(offset);	// movzx host, word [rbx+offset]
+}
+
+void Jit::EmitStore16(uint8_t host, int32_t offset)
+{
+	EmitBytes({ 0x66, 0x89, static_cast<uint8_t>(0x83 | host << 3) }); Emit32(offset);	// mov word [rbx+offset], host
+}
+
+// Reads the byte at the address in edx into ecx, as Memory::Read() does
+void Jit::EmitRead()
+{
+	m_Accessed = true;
+
+	EmitBytes({ 0x89, 0xD0 });									// mov eax, edx
+	EmitBytes({ 0xC1, 0xE8, 0x08 });							// shr eax, 8
+	EmitBytes({ 0x41, 0x80, 0xBC, 0x05 }); Emit32(m_SlowReadOffset); Emit8(0);	// cmp byte [r13+rax+slowRead], 0
+	uint8_t* slow = EmitJumpRel8(0x75);							// jne slow
+	EmitBytes({ 0x41, 0x0F, 0xB6, 0x8C, 0x15 }); Emit32(m_BytesOffset);	// movzx ecx, byte [r13+rdx+bytes]
+	uint8_t* done = EmitJumpRel8(0xEB);							// jmp done
+
+	PatchRel8(slow);
+#if JIT_WIN64
+	EmitBytes({ 0x4C, 0x89, 0xE9 });							// mov rcx, r13
+#else
+	EmitBytes({ 0x4C, 0x89, 0xEF });							// mov rdi, r13
+	EmitBytes({ 0x89, 0xD6 });									// mov esi, edx
+#endif
+	EmitCallHelper(reinterpret_cast<const void*>(&ReadMemory));
+	EmitBytes({ 0x89, 0xC1 });									// mov ecx, eax
+
+	PatchRel8(done);
+}
+
+// Writes cl to the address in edx, as Memory::Write() does
+void Jit::EmitWrite()
+{
+	m_Accessed = true;
+
+	EmitBytes({ 0x89, 0xD0 });									// mov eax, edx
+	EmitBytes({ 0xC1, 0xE8, 0x08 });							// shr eax, 8
+	EmitBytes({ 0x41, 0x80, 0xBC, 0x05 }); Emit32(m_SlowWriteOffset); Emit8(0);	// cmp byte [r13+rax+slowWrite], 0
+	uint8_t* slow = EmitJumpRel8(0x75);							// jne slow
+	EmitBytes({ 0x41, 0x88, 0x8C, 0x15 }); Emit32(m_BytesOffset);	// mov byte [r13+rdx+bytes], cl
+	uint8_t* done = EmitJumpRel8(0xEB);							// jmp done
+
+	PatchRel8(slow);
+#if JIT_WIN64
+	EmitBytes({ 0x41, 0x89, 0xC8 });							// mov r8d, ecx
+	EmitBytes({ 0x4C, 0x89, 0xE9 });							// mov rcx, r13
+#else
+	EmitBytes({ 0x4C, 0x89, 0xEF });							// mov rdi, r13
+	EmitBytes({ 0x89, 0xD6 });									// mov esi, edx
+	EmitBytes({ 0x89, 0xCA });									// mov edx, ecx
+#endif
+	EmitCallHelper(reinterpret_cast<const void*>(&WriteMemory));
+
+	PatchRel8(done);
+}
+
+// Writes the two bytes below SP, high first as PUSH does, then moves SP
+void Jit::EmitPush(int32_t hi, int32_t lo)
+{
+	EmitLoad16(JIT_EDX, m_SPOffset);
+	EmitBytes({ 0x83, 0xEA, 0x01 });				// sub edx, 1
+	EmitBytes({ 0x0F, 0xB7, 0xD2 });				// movzx edx, dx
+	EmitLoad8(JIT_ECX, hi);
+	EmitWrite();
+
+	EmitLoad16(JIT_EDX, m_SPOffset);
+	EmitBytes({ 0x83, 0xEA, 0x02 });				// sub edx, 2
+	EmitBytes({ 0x0F, 0xB7, 0xD2 });				// movzx edx, dx
+	EmitLoad8(JIT_ECX, lo);
+	EmitWrite();
+
+	EmitBytes({ 0x66, 0x83, 0xAB }); Emit32(m_SPOffset); Emit8(2);	// sub word [rbx+SP], 2
+}
+
+void Jit::EmitPushImmediate(uint16_t value)
+{
+	EmitLoad16(JIT_EDX, m_SPOffset);
+	EmitBytes({ 0x83, 0xEA, 0x01 });				// sub edx, 1
+	EmitBytes({ 0x0F, 0xB7, 0xD2 });				// movzx edx, dx
+	Emit8(0xB9); Emit32(value >> 8);				// mov ecx, hi
+	EmitWrite();
+
+	EmitLoad16(JIT_EDX, m_SPOffset);
+	EmitBytes({ 0x83, 0xEA, 0x02 });				// sub edx, 2
+	EmitBytes({ 0x0F, 0xB7, 0xD2 });				// movzx edx, dx
+	Emit8(0xB9); Emit32(value & 0xFF);				// mov ecx, lo
+	EmitWrite();
+
+	EmitBytes({ 0x66, 0x83, 0xAB }); Emit32(m_SPOffset); Emit8(2);	// sub word [rbx+SP], 2
+}
+
+// Reads the two bytes at SP, low first as POP does, then moves SP
+void Jit::EmitPop(int32_t hi, int32_t lo)
+{
+	EmitLoad16(JIT_EDX, m_SPOffset);
+	EmitRead();
+	EmitStore8(JIT_ECX, lo);
+
+	EmitLoad16(JIT_EDX, m_SPOffset);
+	EmitBytes({ 0x83, 0xC2, 0x01 });				// add edx, 1
+	EmitBytes({ 0x0F, 0xB7, 0xD2 });				// movzx edx, dx
+	EmitRead();
+	EmitStore8(JIT_ECX, hi);
+
+	EmitBytes({ 0x66, 0x83, 0x83 }); Emit32(m_SPOffset); Emit8(2);	// add word [rbx+SP], 2
+}
+
+// Settles any flags a handler left owed, so the native code can work on
+// the flag byte directly. Emitted once per block until a handler runs.
+void Jit::EmitResolveFlags()
+{
+	if (m_FlagsResolved)
+		return;
+
+	EmitBytes({ 0x80, 0xBB }); Emit32(m_PendingOffset); Emit8(0);	// cmp byte [rbx+pending], 0
+	uint8_t* done = EmitJumpRel8(0x74);								// je done
+#if JIT_WIN64
+	EmitBytes({ 0x48, 0x89, 0xD9 });								// mov rcx, rbx
+#else
+	EmitBytes({ 0x48, 0x89, 0xDF });								// mov rdi, rbx
+#endif
+	EmitCallHelper(reinterpret_cast<const void*>(&ResolveFlags));
+	PatchRel8(done);
+
+	m_FlagsResolved = true;
+}
+
+// Puts the host flags LAHF left in ah into the flag byte: the defined
+// bits come from ah, the kept ones stay. Clobbers edx.
+void Jit::EmitMergeFlags(uint8_t keep, uint8_t defined, bool invertAC, bool orCh)
+{
+	EmitBytes({ 0x80, 0xE4, defined });					// and ah, defined
+	if (invertAC)
+		EmitBytes({ 0x80, 0xF4, 0x10 });				// xor ah, AC
+	if (orCh)
+		EmitBytes({ 0x08, 0xEC });						// or ah, ch
+
+	EmitLoad8(JIT_EDX, m_FlagsOffset);
+	EmitBytes({ 0x83, 0xE2, keep });					// and edx, keep
+	EmitBytes({ 0x08, 0xE2 });							// or dl, ah
+	EmitStore8(JIT_EDX, m_FlagsOffset);
+}
+
+// A op= cl for ADD, ADC, SUB, SBB, ANA, XRA, ORA or CMP, by the 8080's
+// operation index, with every flag set
+void Jit::EmitAlu(uint8_t op)
+{
+	static const uint8_t opcodes[] = { 0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x38 };
+
+	EmitLoad8(JIT_EAX, RegisterOffset(A));
+
+	// ADC and SBB take CY in
+	if (op == 0x1 || op == 0x3) {
+		EmitLoad8(JIT_EDX, m_FlagsOffset);
+		EmitBytes({ 0xD1, 0xEA });							// shr edx, 1
+	}
+
+	// ANA sets AC to bit 3 of A | operand
+	if (op == 0x4) {
+		EmitBytes({ 0x88, 0xC5 });							// mov ch, al
+		EmitBytes({ 0x08, 0xCD });							// or ch, cl
+		EmitBytes({ 0x80, 0xE5, 0x08 });					// and ch, 8
+		EmitBytes({ 0xD0, 0xE5 });							// shl ch, 1
+	}
+
+	EmitBytes({ opcodes[op], 0xC8 });						// op al, cl
+	Emit8(0x9F);											// lahf
+
+	if (op >= 0x4 && op <= 0x6)
+		EmitMergeFlags(0x2A, 0xC4, false, op == 0x4);		// logic: CY clear, AC as above
+	else
+		EmitMergeFlags(0x2A, 0xD5, op == 0x2 || op == 0x3 || op == 0x7, false);
+
+	if (op != 0x7)
+		EmitStore8(JIT_EAX, RegisterOffset(A));
+}
+
+// CY from the host carry, every other bit left alone
+void Jit::EmitCarryOut()
+{
+	EmitBytes({ 0x0F, 0x92, 0xC1 });										// setc cl
+	EmitBytes({ 0x80, 0xA3 }); Emit32(m_FlagsOffset); Emit8(0xFE);			// and byte [rbx+flags], ~CY
+	EmitBytes({ 0x08, 0x8B }); Emit32(m_FlagsOffset);						// or byte [rbx+flags], cl
+}
+
+// Tests the condition by its cc field and jumps over what follows unless
+// it holds. Returns the rel32 to point past the taken path.
+uint8_t* Jit::EmitSkipUnless(uint8_t code)
+{
+	// NZ/Z, NC/C, PO/PE, P/M
+	static const uint8_t masks[] = { 0x40, 0x01, 0x04, 0x80 };
+
+	EmitBytes({ 0xF6, 0x83 }); Emit32(m_FlagsOffset); Emit8(masks[code >> 1]);	// test byte [rbx+flags], mask
+
+	// Odd codes want the bit set. A push or pop is too long for a rel8.
+	EmitBytes({ 0x0F, static_cast<uint8_t>((code & 0x1) ? 0x84 : 0x85) });	// jz/jnz skip
+	uint8_t* rel = m_Code + m_CodeUsed;
+	Emit32(0);
+	return rel;
+}
+
+void Jit::EmitCall(i8080::JitHandler handler, uint16_t operand)
+{
+#if JIT_WIN64
+	EmitBytes({ 0x48, 0x89, 0xD9 });	// mov rcx, rbx
+	Emit8(0xBA); Emit32(operand);		// mov edx, operand
+#else
+	EmitBytes({ 0x48, 0x89, 0xDF });	// mov rdi, rbx
+	Emit8(0xBE); Emit32(operand);		// mov esi, operand
+#endif
+	EmitCallHelper(reinterpret_cast<const void*>(handler));
+
+	// The handler may have recorded flags lazily
+	m_FlagsResolved = false;
+}
+
+void Jit::EmitCallHelper(const void* helper)
+{
+	EmitBytes({ 0x48, 0xB8 }); Emit64(reinterpret_cast<uint64_t>(helper));	// mov rax, helper
+	EmitBytes({ 0xFF, 0xD0 });												// call rax
+}
+
+// Jumps straight to the translated block at target once it exists.
+// Until then the jump lands on a stub that records which rel32 field to
+// patch and leaves through the exit. Expects PC in eax.
+uint8_t* Jit::EmitLinkSlot(uint16_t target)
+{
+	EmitBytes({ 0x3D }); Emit32(target);		// cmp eax, target
+	EmitBytes({ 0x75, 33 });					// jne past the slot
+
+	Emit8(0xE9);								// jmp rel32
+	uint8_t* rel = m_Code + m_CodeUsed;
+	Emit32(0);
+
+	PatchRel32(rel, m_Code + m_CodeUsed);
+
+	EmitBytes({ 0x48, 0xB9 }); Emit64(reinterpret_cast<uint64_t>(&m_PendingLink));	// mov rcx, &m_PendingLink
+	EmitBytes({ 0x48, 0xB8 }); Emit64(reinterpret_cast<uint64_t>(rel));				// mov rax, rel
+	EmitBytes({ 0x48, 0x89, 0x01 });												// mov [rcx], rax
+	EmitJumpRel32(0xE9, -1, m_Exit);												// jmp exit
+
+	if (m_Native[target])
+		PatchRel32(rel, m_Native[target]);
+
+	return rel;
+}
+
+void Jit::EmitJumpRel32(uint8_t opcode0, int16_t opcode1, const uint8_t* target)
+{
+	Emit8(opcode0);
+	if (opcode1 >= 0)
+		Emit8(static_cast<uint8_t>(opcode1));
+
+	uint8_t* rel = m_Code + m_CodeUsed;
+	Emit32(0);
+	PatchRel32(rel, target);
+}
+
+// A short forward jump, its target set later with PatchRel8()
+uint8_t* Jit::EmitJumpRel8(uint8_t opcode)
+{
+	Emit8(opcode);
+	uint8_t* rel = m_Code + m_CodeUsed;
+	Emit8(0);
+	return rel;
+}
+
+// Points the rel8 at the next byte to be emitted
+void Jit::PatchRel8(uint8_t* rel)
+{
+	*rel = static_cast<uint8_t>(m_Code + m_CodeUsed - (rel + 1));
+}
+
+void Jit::PatchRel32(uint8_t* rel, const uint8_t* target)
+{
+	int32_t offset = static_cast<int32_t>(target - (rel + 4));
+	memcpy(rel, &offset, sizeof(offset));
+}
+
+void Jit::Emit8(uint8_t byte)
+{
+	m_Code[m_CodeUsed++] = byte;
+}
+
+void Jit::Emit16(uint16_t value)
+{
+	memcpy(m_Code + m_CodeUsed, &value, sizeof(value));
+	m_CodeUsed += sizeof(value);
+}
+
+void Jit::Emit32(uint32_t value)
+{
+	memcpy(m_Code + m_CodeUsed, &value, sizeof(value));
+	m_CodeUsed += sizeof(value);
+}
+
+void Jit::Emit64(uint64_t value)
+{
+	memcpy(m_Code + m_CodeUsed, &value, sizeof(value));
+	m_CodeUsed += sizeof(value);
+}
+
+void Jit::EmitBytes(std::initializer_list<uint8_t> bytes)
+{
+	for (uint8_t byte : bytes) {
+		m_Code[m_CodeUsed++] = byte;
+	}
+}
+
+void i8080::RunJit(uint64_t count)
+{
+	m_Jit->Run(count);
+}
+
+#else
+
+Jit::~Jit() {}
+
+void i8080::RunJit(uint64_t count)
+{
+	RunBlocks(count);
+}
+
+#endif
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "i8080.h"
+#include "BlockCache.h"
+#include "Memory.h"
+
+// The JIT emits x86-64 code only. Elsewhere Engine::Jit runs the
+// block cache engine instead.
+#ifndef I8080_JIT
+	#if defined(__x86_64__) || defined(_M_X64)
+		#define I8080_JIT 1
+	#else
+		#define I8080_JIT 0
+	#endif
+#endif
+
+#define JIT_CODE_SIZE (16 * 1024 * 1024)
+
+// Translates the basic blocks from BlockCache into native x86-64 code.
+// Almost every instruction is emitted inline on the i8080 members:
+//
+// - ALU ops, INR/DCR, rotates, DAD, STC/CMC compute their flags with the
+//   host's and store the whole 8080 flag byte. LAHF puts S, Z, AC, P and
+//   CY where the 8080 keeps them, only AC has to be inverted after a
+//   subtraction. Flags still owed by a lazy handler are resolved once,
+//   before the first instruction in a block that touches them.
+// - Memory accesses do the page flag test of Memory::Read() and Write()
+//   inline and only call out for slow pages.
+// - JMP, CALL, RET, PCHL and their conditional forms test the flag byte
+//   and push and pop through the same inline accesses.
+//
+// DAA, XTHL, HLT, the CP/M traps at 0x0000 and 0x0005, and with coverage
+// compiled in all control flow, call their Operate<> handler instead.
+//
+// T-states are added once per block on entry. Taken conditional CALL and
+// RET add their extra cost where they branch.
+//
+// A block's exits compare PC against its static targets and jump
+// straight into the target block once it has been translated. Any write
+// that invalidates cached code flushes all native code before the next
+// block runs. A block translated JIT_TRANSLATION_LIMIT times runs through
+// its handlers from then on, so self-modifying code doesn't spend its
+// time in the translator. Idle loops (see BlockCache::IdleLoop) don't
+// link back to themselves, so the dispatcher gets to skip them.
+//
+// The code buffer is never writable and executable at once: the part in
+// use is made writable to translate or link a block and executable again
+// before the dispatcher enters it.
+class Jit
+{
+public:
+	Jit(i8080* cpu, Memory* memory);
+	~Jit();
+
+	// False if the code buffer could not be allocated
+	bool Ready() const { return m_Code != nullptr; }
+
+	void Run(uint64_t count);
+
+private:
+	using EnterFunc = int64_t (*)(i8080* cpu, const uint8_t* code, int64_t budget);
+
+	// An exit taken when a memory access dropped cached code: the rel32
+	// field of its jne, the instructions and T-states charged but not run,
+	// and the PC to leave with, or -1 if the instruction stored it
+	struct Refund {
+		uint8_t* rel;
+		uint32_t instructions;
+		uint32_t cycles;
+		int32_t pc;
+	};
+
+	const uint8_t* Compile(uint16_t addr);
+	void RunHandlers(int64_t& budget);
+	void Flush();
+	void Release();
+	bool SetWritable(bool writable);
+
+	void EmitEnterExit();
+
+	void Emit8(uint8_t byte);
+	void Emit16(uint16_t value);
+	void Emit32(uint32_t value);
+	void Emit64(uint64_t value);
+	void EmitBytes(std::initializer_list<uint8_t> bytes);
+
+	void EmitCall(i8080::JitHandler handler, uint16_t operand);
+	void EmitCallHelper(const void* helper);
+	void EmitJumpRel32(uint8_t opcode0, int16_t opcode1, const uint8_t* target);
+	uint8_t* EmitJumpRel8(uint8_t opcode);
+	void PatchRel8(uint8_t* rel);
+	uint8_t* EmitLinkSlot(uint16_t target);
+	void PatchRel32(uint8_t* rel, const uint8_t* target);
+
+	bool EmitNative(const BlockCache::Instruction& instr, uint16_t next);
+
+	// Host registers by number: eax 0, ecx 1, edx 2
+	void EmitLoad8(uint8_t host, int32_t offset);
+	void EmitStore8(uint8_t host, int32_t offset);
+	void EmitLoad16(uint8_t host, int32_t offset);
+	void EmitStore16(uint8_t host, int32_t offset);
+
+	void EmitRead();
+	void EmitWrite();
+	void EmitPush(int32_t hi, int32_t lo);
+	void EmitPushImmediate(uint16_t value);
+	void EmitPop(int32_t hi, int32_t lo);
+
+	void EmitResolveFlags();
+	void EmitMergeFlags(uint8_t keep, uint8_t defined, bool invertAC, bool orCh);
+	void EmitAlu(uint8_t op);
+	void EmitCarryOut();
+	uint8_t* EmitSkipUnless(uint8_t code);
+
+	// Called from generated code when a handler left flags owed
+	static void ResolveFlags(i8080* cpu);
+
+	int32_t RegisterOffset(uint8_t reg) const;
+	int32_t PairOffset(uint8_t rp) const;
+
+private:
+	i8080* m_CPU;
+	Memory* m_Memory;
+	BlockCache m_Cache;
+
+	uint8_t* m_Code = nullptr;
+	size_t m_CodeUsed = 0;
+	size_t m_CodeStart = 0;		// first byte after the enter/exit stubs
+	bool m_Writable = true;
+	size_t m_Protected = 0;		// bytes from m_Code currently read-execute
+
+	EnterFunc m_Enter = nullptr;
+	const uint8_t* m_Exit = nullptr;
+
+	std::vector<const uint8_t*> m_Native;
+	std::vector<uint16_t> m_Translated;		// addresses set in m_Native
+	uint8_t m_Translations[65536]{};		// per block start, up to JIT_TRANSLATION_LIMIT
+
+	// Written by a link slot on its way out: the rel32 field of the jump
+	// to patch once the block at the new PC has been translated
+	uint8_t* m_PendingLink = nullptr;
+
+	// While translating: whether the flag byte is known to be up to date,
+	// whether the last instruction went to memory, and the early exits
+	bool m_FlagsResolved = false;
+	bool m_Accessed = false;
+	std::vector<Refund> m_Refunds;
+
+	// Offsets of the i8080 members the native code touches
+	int32_t m_RegistersOffset = 0;
+	int32_t m_PCOffset = 0;
+	int32_t m_SPOffset = 0;
+	int32_t m_CyclesOffset = 0;
+	int32_t m_FlagsOffset = 0;
+	int32_t m_PendingOffset = 0;
+
+	// and of the Memory ones
+	int32_t m_BytesOffset = 0;
+	int32_t m_SlowReadOffset = 0;
+	int32_t m_SlowWriteOffset = 0;
+};
@@ -0,0 +1,317 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_WIN32)
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+#include "Loader.h"
+
+// Intel HEX record types
+#define HEX_DATA 0x00
+#define HEX_EOF 0x01
+#define HEX_EXTENDED_SEGMENT 0x02
+#define HEX_START_SEGMENT 0x03
+#define HEX_EXTENDED_LINEAR 0x04
+#define HEX_START_LINEAR 0x05
+
+
+///////////////////////////////////
+////////////MAPPED FILE///////////
+/////////////////////////////////
+
+bool MappedFile::Open(const char* path, std::string& error)
+{
+	Close();
+
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		error = std::string("Cannot open ") + path;
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		CloseHandle(file);
+		error = std::string("Cannot read the size of ") + path;
+		return false;
+	}
+
+	m_File = file;
+	m_Size = static_cast<size_t>(size.QuadPart);
+
+	if (m_Size == 0)
+		return true;
+
+	m_Mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (m_Mapping)
+		m_Data = static_cast<const uint8_t*>(MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		error = std::string("Cannot open ") + path;
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		error = std::string("Cannot read the size of ") + path;
+		return false;
+	}
+
+	m_Size = static_cast<size_t>(st.st_size);
+
+	if (m_Size == 0) {
+		close(fd);
+		return true;
+	}
+
+	// The mapping keeps its own reference to the file
+	void* data = mmap(nullptr, m_Size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data != MAP_FAILED)
+		m_Data = static_cast<const uint8_t*>(data);
+#endif
+
+	if (!m_Data) {
+		Close();
+		error = std::string("Cannot map ") + path;
+		return false;
+	}
+
+	return true;
+}
+
+void MappedFile::Close()
+{
+#if defined(_WIN32)
+	if (m_Data)
+		UnmapViewOfFile(m_Data);
+	if (m_Mapping)
+		CloseHandle(m_Mapping);
+	if (m_File)
+		CloseHandle(m_File);
+
+	m_Mapping = nullptr;
+	m_File = nullptr;
+#else
+	if (m_Data)
+		munmap(const_cast<uint8_t*>(m_Data), m_Size);
+#endif
+
+	m_Data = nullptr;
+	m_Size = 0;
+}
+
+
+///////////////////////////////////
+//////////////LOADER//////////////
+/////////////////////////////////
+
+bool Loader::Load(Memory* memory, const char* path, uint16_t address, std::string& error, Format format)
+{
+	if (format == Format::Auto) {
+		const char* ext = strrchr(path, '.');
+		bool hex = ext && (strcmp(ext, ".hex") == 0 || strcmp(ext, ".HEX") == 0 || strcmp(ext, ".ihx") == 0);
+
+		format = hex ? Format::IntelHex : Format::Binary;
+	}
+
+	MappedFile file;
+	if (!file.Open(path, error))
+		return false;
+
+	std::vector<uint8_t> bytes;
+	std::vector<Segment> segments;
+
+	if (format == Format::IntelHex) {
+		if (!ParseHex(file.Data(), file.Size(), bytes, segments, error)) {
+			error = std::string(path) + ": " + error;
+			return false;
+		}
+	}
+	else {
+		segments.push_back({ address, file.Data(), file.Size() });
+	}
+
+	// Check every segment before any of them is written
+	for (const Segment& segment : segments) {
+		if (segment.address + segment.size > MEMORY_SIZE) {
+			char text[96];
+			snprintf(text, sizeof(text), ": %zu bytes at 0x%04X run past the end of memory", segment.size, segment.address);
+			error = path + std::string(text);
+			return false;
+		}
+	}
+
+	for (const Segment& segment : segments)
+		memory->Load(segment.address, segment.data, segment.size);
+
+	return true;
+}
+
+bool Loader::ParseImageSpec(const char* spec, std::string& path, uint16_t& address, std::string& error)
+{
+	const char* at = strrchr(spec, '@');
+
+	if (!at) {
+		path = spec;
+		address = LOADER_DEFAULT_ADDRESS;
+		return true;
+	}
+
+	char* end = nullptr;
+	unsigned long value = strtoul(at + 1, &end, 16);
+
+	if (end == at + 1 || *end != '\0' || value >= MEMORY_SIZE) {
+		error = std::string("Bad load address in ") + spec;
+		return false;
+	}
+
+	path.assign(spec, at);
+	address = static_cast<uint16_t>(value);
+	return true;
+}
+
+static int HexDigit(uint8_t c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+bool Loader::ParseHex(const uint8_t* text, size_t size, std::vector<uint8_t>& bytes, std::vector<Segment>& segments, std::string& error)
+{
+	// Offsets into bytes until it stops growing
+	struct Run {
+		uint32_t address;
+		size_t offset;
+		size_t size;
+	};
+
+	std::vector<Run> runs;
+	std::vector<uint8_t> record;
+	size_t pos = 0;
+	uint32_t line = 0;
+	bool eof = false;
+
+	while (pos < size && !eof) {
+		size_t lineEnd = pos;
+		while (lineEnd < size && text[lineEnd] != '\n')
+			lineEnd++;
+
+		line++;
+
+		size_t end = lineEnd;
+		while (end > pos && (text[end - 1] == '\r' || text[end - 1] == ' ' || text[end - 1] == '\t'))
+			end--;
+
+		const size_t start = pos;
+		pos = lineEnd + 1;
+
+		if (end == start)
+			continue;
+
+		char where[32];
+		snprintf(where, sizeof(where), "line %u: ", line);
+
+		if (text[start] != ':' || (end - start) % 2 == 0 || end - start < 11) {
+			error = std::string(where) + "not an Intel HEX record";
+			return false;
+		}
+
+		record.clear();
+		for (size_t i = start + 1; i < end; i += 2) {
+			int hi = HexDigit(text[i]);
+			int lo = HexDigit(text[i + 1]);
+
+			if (hi < 0 || lo < 0) {
+				error = std::string(where) + "bad hex digit";
+				return false;
+			}
+
+			record.push_back(static_cast<uint8_t>(hi << 4 | lo));
+		}
+
+		const size_t length = record[0];
+		if (record.size() != length + 5) {
+			error = std::string(where) + "record length does not match its data";
+			return false;
+		}
+
+		uint8_t sum = 0;
+		for (uint8_t byte : record)
+			sum += byte;
+
+		if (sum != 0) {
+			error = std::string(where) + "bad checksum";
+			return false;
+		}
+
+		const uint32_t address = record[1] << 8 | record[2];
+		const uint8_t* data = record.data() + 4;
+
+		switch (record[3])
+		{
+			case HEX_DATA:
+				if (!runs.empty() && runs.back().address + runs.back().size == address) {
+					runs.back().size += length;
+				}
+				else {
+					runs.push_back({ address, bytes.size(), length });
+				}
+				bytes.insert(bytes.end(), data, data + length);
+				break;
+
+			case HEX_EOF:
+				eof = true;
+				break;
+
+			// Only a base of zero is meaningful with 64 KB
+			case HEX_EXTENDED_SEGMENT:
+			case HEX_EXTENDED_LINEAR:
+				if (length != 2 || data[0] != 0 || data[1] != 0) {
+					error = std::string(where) + "address is above 64 KB";
+					return false;
+				}
+				break;
+
+			// The CPU starts at PROGRAM_START, start addresses are not used
+			case HEX_START_SEGMENT:
+			case HEX_START_LINEAR:
+				break;
+
+			default:
+				error = std::string(where) + "unknown record type";
+				return false;
+		}
+	}
+
+	if (!eof) {
+		error = "missing end of file record";
+		return false;
+	}
+
+	for (const Run& run : runs) {
+		if (run.address + run.size > MEMORY_SIZE) {
+			char text[96];
+			snprintf(text, sizeof(text), "%zu bytes at 0x%04X run past the end of memory", run.size, run.address);
+			error = text;
+			return false;
+		}
+
+		segments.push_back({ static_cast<uint16_t>(run.address), bytes.data() + run.offset, run.size });
+	}
+
+	return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Memory.h"
+
+// Where CP/M loads a .COM program
+#define LOADER_DEFAULT_ADDRESS 0x100
+
+// A file mapped read-only into the host address space, unmapped when the
+// object goes away. Empty files map to no data at all.
+class MappedFile
+{
+public:
+	MappedFile() {}
+	~MappedFile() { Close(); }
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool Open(const char* path, std::string& error);
+	void Close();
+
+	const uint8_t* Data() const { return m_Data; }
+	size_t Size() const { return m_Size; }
+
+private:
+	const uint8_t* m_Data = nullptr;
+	size_t m_Size = 0;
+
+#if defined(_WIN32)
+	void* m_File = nullptr;
+	void* m_Mapping = nullptr;
+#endif
+};
+
+// Puts program images into Memory. .COM and .BIN files are flat images
+// copied in one block to the load address. Intel HEX files carry their
+// own addresses, so the load address is ignored for them, and each run
+// of contiguous records becomes one block.
+//
+// Nothing is written unless the whole image is valid and fits below
+// 64 KB. Errors come back as false with a message naming the file.
+class Loader
+{
+public:
+	enum class Format { Auto, Binary, IntelHex };
+
+	// One contiguous block of an image, pointing into the mapped file for
+	// binaries and into the decoded bytes for HEX
+	struct Segment {
+		uint16_t address;
+		const uint8_t* data;
+		size_t size;
+	};
+
+public:
+	// Format::Auto picks Intel HEX for a .hex extension, binary otherwise
+	static bool Load(Memory* memory, const char* path, uint16_t address, std::string& error, Format format = Format::Auto);
+
+	// Splits "path@address" with a hex address, as given on the command
+	// line. Without "@" the address is LOADER_DEFAULT_ADDRESS.
+	static bool ParseImageSpec(const char* spec, std::string& path, uint16_t& address, std::string& error);
+
+private:
+	static bool ParseHex(const uint8_t* text, size_t size, std::vector<uint8_t>& bytes, std::vector<Segment>& segments, std::string& error);
+};
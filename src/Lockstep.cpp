@@ -0,0 +1,944 @@
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#include "Lockstep.h"
+#include "AluTables.h"
+
+// LOCKSTEP_SIMD comes from Lockstep.h
+#if LOCKSTEP_SIMD
+	#include <immintrin.h>
+#endif
+
+///////////////////////////////////
+//////////////VECTORS/////////////
+/////////////////////////////////
+
+// One native vector of lanes, one byte each. ShiftRight() shifts 16-bit
+// pairs, so only the low 8 - N bits of each byte are its own, the rest
+// come from its neighbour. MoveMask() gives the top bit of every byte.
+#if LOCKSTEP_SIMD == 2
+	#define VEC_BYTES 32
+
+	using Vec = __m256i;
+
+	static inline Vec Load(const uint8_t* p)		{ return _mm256_load_si256(reinterpret_cast<const __m256i*>(p)); }
+	static inline void Store(uint8_t* p, Vec v)		{ _mm256_store_si256(reinterpret_cast<__m256i*>(p), v); }
+	static inline Vec Splat(uint8_t x)				{ return _mm256_set1_epi8(static_cast<char>(x)); }
+	static inline Vec Add(Vec a, Vec b)				{ return _mm256_add_epi8(a, b); }
+	static inline Vec Sub(Vec a, Vec b)				{ return _mm256_sub_epi8(a, b); }
+	static inline Vec And(Vec a, Vec b)				{ return _mm256_and_si256(a, b); }
+	static inline Vec Or(Vec a, Vec b)				{ return _mm256_or_si256(a, b); }
+	static inline Vec Xor(Vec a, Vec b)				{ return _mm256_xor_si256(a, b); }
+	static inline Vec AndNot(Vec a, Vec b)			{ return _mm256_andnot_si256(a, b); }
+	static inline Vec Equal(Vec a, Vec b)			{ return _mm256_cmpeq_epi8(a, b); }
+	static inline Vec SubSat(Vec a, Vec b)			{ return _mm256_subs_epu8(a, b); }
+	template<int N> static inline Vec ShiftRight(Vec a)	{ return _mm256_srli_epi16(a, N); }
+	static inline uint32_t MoveMask(Vec a)			{ return static_cast<uint32_t>(_mm256_movemask_epi8(a)); }
+#elif LOCKSTEP_SIMD == 1
+	#define VEC_BYTES 16
+
+	using Vec = __m128i;
+
+	static inline Vec Load(const uint8_t* p)		{ return _mm_load_si128(reinterpret_cast<const __m128i*>(p)); }
+	static inline void Store(uint8_t* p, Vec v)		{ _mm_store_si128(reinterpret_cast<__m128i*>(p), v); }
+	static inline Vec Splat(uint8_t x)				{ return _mm_set1_epi8(static_cast<char>(x)); }
+	static inline Vec Add(Vec a, Vec b)				{ return _mm_add_epi8(a, b); }
+	static inline Vec Sub(Vec a, Vec b)				{ return _mm_sub_epi8(a, b); }
+	static inline Vec And(Vec a, Vec b)				{ return _mm_and_si128(a, b); }
+	static inline Vec Or(Vec a, Vec b)				{ return _mm_or_si128(a, b); }
+	static inline Vec Xor(Vec a, Vec b)				{ return _mm_xor_si128(a, b); }
+	static inline Vec AndNot(Vec a, Vec b)			{ return _mm_andnot_si128(a, b); }
+	static inline Vec Equal(Vec a, Vec b)			{ return _mm_cmpeq_epi8(a, b); }
+	static inline Vec SubSat(Vec a, Vec b)			{ return _mm_subs_epu8(a, b); }
+	template<int N> static inline Vec ShiftRight(Vec a)	{ return _mm_srli_epi16(a, N); }
+	static inline uint32_t MoveMask(Vec a)			{ return static_cast<uint32_t>(_mm_movemask_epi8(a)); }
+#else
+	#define VEC_BYTES 1
+
+	using Vec = uint8_t;
+
+	static inline Vec Load(const uint8_t* p)		{ return *p; }
+	static inline void Store(uint8_t* p, Vec v)		{ *p = v; }
+	static inline Vec Splat(uint8_t x)				{ return x; }
+	static inline Vec Add(Vec a, Vec b)				{ return static_cast<Vec>(a + b); }
+	static inline Vec Sub(Vec a, Vec b)				{ return static_cast<Vec>(a - b); }
+	static inline Vec And(Vec a, Vec b)				{ return a & b; }
+	static inline Vec Or(Vec a, Vec b)				{ return a | b; }
+	static inline Vec Xor(Vec a, Vec b)				{ return a ^ b; }
+	static inline Vec AndNot(Vec a, Vec b)			{ return static_cast<Vec>(~a & b); }
+	static inline Vec Equal(Vec a, Vec b)			{ return a == b ? 0xFF : 0x00; }
+	static inline Vec SubSat(Vec a, Vec b)			{ return a > b ? static_cast<Vec>(a - b) : 0; }
+	template<int N> static inline Vec ShiftRight(Vec a)	{ return static_cast<Vec>(a >> N); }
+	static inline uint32_t MoveMask(Vec a)			{ return a >> 7; }
+#endif
+
+static_assert(LOCKSTEP_LANES % VEC_BYTES == 0, "lanes must fill whole vectors");
+static_assert(LOCKSTEP_LANES <= 32, "lanes are kept in a 32-bit mask");
+
+template<typename F>
+static inline void ForEachVec(F f)
+{
+	for (uint32_t i = 0; i < LOCKSTEP_LANES; i += VEC_BYTES)
+		f(i);
+}
+
+template<typename F>
+static inline void ForEachLane(uint32_t lanes, F f)
+{
+	for (; lanes; lanes &= lanes - 1)
+		f(static_cast<uint32_t>(std::countr_zero(lanes)));
+}
+
+static inline Vec Zero() { return Splat(0); }
+
+// 1 where the top bit of the byte is set, else 0
+static inline Vec TopBit(Vec a) { return And(ShiftRight<7>(a), Splat(0x01)); }
+
+// The 8080 flag bits, as i8080::flags holds them
+#define LANE_CY 0x01
+#define LANE_P 0x04
+#define LANE_AC 0x10
+#define LANE_Z 0x40
+#define LANE_S 0x80
+#define LANE_ALL (LANE_CY | LANE_P | LANE_AC | LANE_Z | LANE_S)
+
+// Z, S and P of each result, as AluTables::ZSP has them. Parity folds
+// the byte onto its low bit, which only ever needs the byte's own bits.
+static inline Vec ZSP(Vec res)
+{
+	Vec parity = Xor(res, ShiftRight<4>(res));
+	parity = Xor(parity, ShiftRight<2>(parity));
+	parity = Xor(parity, ShiftRight<1>(parity));
+
+	Vec z = And(Equal(res, Zero()), Splat(LANE_Z));
+	Vec s = And(res, Splat(LANE_S));
+	Vec p = And(Equal(And(parity, Splat(0x01)), Zero()), Splat(LANE_P));
+
+	return Or(Or(z, s), p);
+}
+
+// a + b + carry, with the flag byte AluTables::Add has for it. CY is the
+// carry out of bit 7, AC the carry into bit 4.
+static inline Vec AddFlags(Vec a, Vec b, Vec carry, Vec& res)
+{
+	res = Add(Add(a, b), carry);
+
+	Vec out = Or(And(a, b), AndNot(res, Or(a, b)));
+	Vec ac = And(Xor(Xor(a, b), res), Splat(LANE_AC));
+
+	return Or(Or(ZSP(res), TopBit(out)), ac);
+}
+
+// a - b - borrow, as AluTables::Subtract: the sum a + ~b + !borrow, with
+// CY its inverted carry out and AC its carry into bit 4
+static inline Vec SubFlags(Vec a, Vec b, Vec borrow, Vec& res)
+{
+	res = Sub(Sub(a, b), borrow);
+
+	Vec nb = Xor(b, Splat(0xFF));
+	Vec out = Or(And(a, nb), AndNot(res, Or(a, nb)));
+	Vec ac = And(Xor(Xor(a, nb), res), Splat(LANE_AC));
+
+	return Or(Or(ZSP(res), Xor(TopBit(out), Splat(0x01))), ac);
+}
+
+// The bits of f outside mask, with those of flags inside it
+static inline Vec Merge(Vec f, Vec flags, uint8_t mask)
+{
+	return Or(AndNot(Splat(mask), f), And(flags, Splat(mask)));
+}
+
+
+///////////////////////////////////
+/////////////LOCKSTEP/////////////
+/////////////////////////////////
+
+Lockstep::Lockstep(uint32_t lanes)
+	: m_LaneCount(std::clamp<uint32_t>(lanes, 1, LOCKSTEP_LANES)),
+	  m_MinConvoy(std::clamp<uint32_t>(LOCKSTEP_MIN_CONVOY, 2, std::max<uint32_t>(m_LaneCount, 2)))
+{
+	for (uint32_t i = 0; i < m_LaneCount; i++) {
+		Lane& lane = m_Lanes[i];
+
+		lane.memory = std::make_unique<Memory>();
+		lane.cpm = std::make_unique<CPM>(lane.memory.get());
+		lane.cpu = std::make_unique<i8080>(lane.memory.get(), lane.cpm.get());
+
+		lane.memory->SetWriteListener(this);
+	}
+}
+
+Lockstep::~Lockstep()
+{
+	for (uint32_t i = 0; i < m_LaneCount; i++)
+		m_Lanes[i].memory->SetWriteListener(nullptr);
+}
+
+uint32_t Lockstep::Run(uint64_t instructions)
+{
+	for (uint32_t i = 0; i < m_LaneCount; i++)
+		m_Lanes[i].left = instructions;
+
+	while (1) {
+		// The lowest PC of the lanes still to run, and the next one up
+		uint32_t lowest = MEMORY_SIZE;
+		uint32_t next = MEMORY_SIZE;
+		uint32_t there = 0;
+
+		auto consider = [&](uint32_t pc, uint32_t lanes) {
+			if (pc < lowest) {
+				next = lowest;
+				lowest = pc;
+				there = lanes;
+			}
+			else if (pc == lowest) {
+				there |= lanes;
+			}
+			else if (pc < next) {
+				next = pc;
+			}
+		};
+
+		if (m_Convoy)
+			consider(m_ConvoyPC, 0);
+
+		for (uint32_t i = 0; i < m_LaneCount; i++) {
+			const i8080* cpu = m_Lanes[i].cpu.get();
+
+			if (!(m_Convoy & (1u << i)) && m_Lanes[i].left > 0 && cpu->m_Stop == i8080::StopReason::None)
+				consider(cpu->PC, 1u << i);
+		}
+
+		if (lowest == MEMORY_SIZE)
+			break;
+
+		if (m_Convoy && m_ConvoyPC == lowest) {
+			ForEachLane(there, [this](uint32_t lane) { Join(lane); });
+			RunConvoy(static_cast<uint16_t>(std::min<uint32_t>(next, 0xFFFF)), next == MEMORY_SIZE);
+
+			// Too few lanes left to be worth a vector step each
+			if (m_Convoy && static_cast<uint32_t>(std::popcount(m_Convoy)) < m_MinConvoy) {
+				ForEachLane(m_Convoy, [this](uint32_t lane) { Leave(lane, m_ConvoyPC); });
+				m_Stats.disbanded++;
+			}
+			continue;
+		}
+
+		// The convoy is ahead and waits on the lanes' own cores while the
+		// lanes here gather into a new one
+		if (static_cast<uint32_t>(std::popcount(there)) >= m_MinConvoy) {
+			ForEachLane(m_Convoy, [this](uint32_t lane) { Leave(lane, m_ConvoyPC); });
+
+			m_ConvoyPC = static_cast<uint16_t>(lowest);
+			ForEachLane(there, [this](uint32_t lane) { Join(lane); });
+			m_Stats.convoys++;
+			continue;
+		}
+
+		// Lanes too few for a convoy run on their own cores up to the next
+		// lane, where they may meet enough others to form one
+		ForEachLane(there, [&](uint32_t i) {
+			Lane& lane = m_Lanes[i];
+			i8080* cpu = lane.cpu.get();
+
+			while (lane.left > 0 && cpu->m_Stop == i8080::StopReason::None && cpu->PC < next) {
+				cpu->Cycle();
+				lane.left--;
+				m_Stats.scalarSteps++;
+			}
+		});
+	}
+
+	// Between runs every lane lives on its own core
+	ForEachLane(m_Convoy, [this](uint32_t lane) { Leave(lane, m_ConvoyPC); });
+
+	uint32_t running = 0;
+	for (uint32_t i = 0; i < m_LaneCount; i++)
+		running += m_Lanes[i].cpu->m_Stop == i8080::StopReason::None;
+
+	return running;
+}
+
+void Lockstep::Join(uint32_t lane)
+{
+	const i8080::State state = m_Lanes[lane].cpu->GetState();
+
+	for (uint32_t r = 0; r < 8; r++)
+		m_Registers[r][lane] = state.registers[r];
+
+	m_Flags[lane] = state.flags;
+	m_SP[lane] = state.SP;
+	m_Cycles[lane] = state.cycles - m_ConvoyCycles;
+
+	m_Convoy |= 1u << lane;
+	m_Stats.joins++;
+}
+
+void Lockstep::Leave(uint32_t lane, uint16_t pc, i8080::StopReason stop, i8080::Fault fault)
+{
+	i8080::State state;
+
+	for (uint32_t r = 0; r < 8; r++)
+		state.registers[r] = m_Registers[r][lane];
+
+	state.flags = m_Flags[lane];
+	state.PC = pc;
+	state.SP = m_SP[lane];
+	state.cycles = m_Cycles[lane] + m_ConvoyCycles;
+	state.stop = stop;
+	state.fault = fault;
+
+	m_Lanes[lane].cpu->SetState(state);
+	m_Convoy &= ~(1u << lane);
+}
+
+uint64_t Lockstep::RunConvoy(uint16_t limit, bool unlimited)
+{
+	uint32_t lanes = m_Convoy;
+
+	uint64_t budget = UINT64_MAX;
+	ForEachLane(lanes, [&](uint32_t lane) { budget = std::min(budget, m_Lanes[lane].left); });
+
+	uint64_t steps = 0;
+
+	while (steps < budget && (unlimited || m_ConvoyPC < limit)) {
+		// Lanes split off here have not run the instruction
+		const uint32_t split = CheckCode(m_ConvoyPC);
+		ForEachLane(split, [&](uint32_t lane) { m_Lanes[lane].left -= steps; });
+		lanes &= ~split;
+
+		m_Stats.laneSteps += std::popcount(m_Convoy);
+		steps++;
+
+		if (!Step())
+			break;
+	}
+
+	m_Stats.vectorSteps += steps;
+
+	// Lanes that left on the last step ran it too
+	ForEachLane(lanes, [&](uint32_t lane) { m_Lanes[lane].left -= steps; });
+	ForEachLane(m_Convoy, [this](uint32_t lane) {
+		if (m_Lanes[lane].left == 0)
+			Leave(lane, m_ConvoyPC);
+	});
+
+	return steps;
+}
+
+// Convoy lanes whose bytes at the instruction differ from the first
+// lane's leave before it runs. Bytes found the same in every lane are
+// remembered until one of them is written. Returns the lanes that left.
+uint32_t Lockstep::CheckCode(uint16_t pc)
+{
+	const uint32_t before = m_Convoy;
+	const uint32_t first = std::countr_zero(m_Convoy);
+	const Memory* lead = m_Lanes[first].memory.get();
+	const uint8_t length = i8080::s_LengthTable[lead->Fetch(pc)];
+
+	bool verified = true;
+	for (uint8_t i = 0; i < length; i++)
+		verified &= m_Verified[static_cast<uint16_t>(pc + i)];
+
+	if (verified)
+		return 0;
+
+	for (uint8_t i = 0; i < length; i++) {
+		const uint16_t addr = static_cast<uint16_t>(pc + i);
+		const uint8_t byte = lead->Fetch(addr);
+		bool same = true;
+
+		for (uint32_t lane = 0; lane < m_LaneCount; lane++) {
+			if (m_Lanes[lane].memory->Fetch(addr) == byte)
+				continue;
+
+			same = false;
+
+			if (m_Convoy & (1u << lane)) {
+				Leave(lane, pc);
+				m_Stats.splits++;
+			}
+		}
+
+		// Watched first, so the next write to the byte clears it
+		if (same) {
+			if (!m_Watched[addr >> 8]) {
+				for (uint32_t lane = 0; lane < m_LaneCount; lane++)
+					m_Lanes[lane].memory->WatchPage(addr >> 8, true);
+
+				m_Watched[addr >> 8] = true;
+			}
+
+			m_Verified[addr] = true;
+		}
+	}
+
+	return before & ~m_Convoy;
+}
+
+bool Lockstep::Step()
+{
+	const uint16_t pc = m_ConvoyPC;
+	const uint32_t before = m_Convoy;
+
+	const Memory* lead = m_Lanes[std::countr_zero(m_Convoy)].memory.get();
+	const uint8_t opcode = lead->Fetch(pc);
+	const uint8_t length = i8080::s_LengthTable[opcode];
+
+	uint16_t operand = 0;
+	if (length == 2)
+		operand = lead->Fetch(static_cast<uint16_t>(pc + 1));
+	else if (length == 3)
+		operand = lead->Fetch(static_cast<uint16_t>(pc + 1)) | lead->Fetch(static_cast<uint16_t>(pc + 2)) << 8;
+
+	const uint16_t next = static_cast<uint16_t>(pc + length);
+	const uint8_t dst = (opcode & 0x38) >> 3;
+	const uint8_t src = opcode & 0x7;
+	const uint8_t rp = (opcode & 0x30) >> 4;
+
+	uint8_t* const a = m_Registers[A];
+
+	m_ConvoyCycles += i8080::s_CycleTable[opcode];
+	m_ConvoyPC = next;
+
+	switch (i8080::s_GroupTable[opcode])
+	{
+		case i8080::OpGroup::NOP:
+			break;
+
+		case i8080::OpGroup::HLT:
+			Stop(m_Convoy, next, i8080::StopReason::Halted);
+			break;
+
+		case i8080::OpGroup::CMA:
+			ForEachVec([&](uint32_t i) { Store(a + i, Xor(Load(a + i), Splat(0xFF))); });
+			break;
+
+		case i8080::OpGroup::DAA:
+			ExecuteDAA();
+			break;
+
+		case i8080::OpGroup::STC:
+			ForEachVec([&](uint32_t i) { Store(m_Flags + i, Or(Load(m_Flags + i), Splat(LANE_CY))); });
+			break;
+
+		case i8080::OpGroup::CMC:
+			ForEachVec([&](uint32_t i) { Store(m_Flags + i, Xor(Load(m_Flags + i), Splat(LANE_CY))); });
+			break;
+
+		case i8080::OpGroup::PCHL:
+			ForEachLane(m_Convoy, [&](uint32_t lane) { m_PC[lane] = Pair(HL, lane); });
+			Regroup();
+			break;
+
+		case i8080::OpGroup::XTHL:
+			ForEachLane(m_Convoy, [&](uint32_t lane) {
+				Memory* memory = m_Lanes[lane].memory.get();
+				const uint16_t sp = m_SP[lane];
+
+				uint8_t temp = m_Registers[L][lane];
+				m_Registers[L][lane] = memory->Read(sp);
+				memory->Write(sp, temp);
+
+				temp = m_Registers[H][lane];
+				m_Registers[H][lane] = memory->Read(static_cast<uint16_t>(sp + 1));
+				memory->Write(static_cast<uint16_t>(sp + 1), temp);
+			});
+			break;
+
+		case i8080::OpGroup::XCHG:
+			ForEachVec([&](uint32_t i) {
+				Vec d = Load(m_Registers[D] + i), e = Load(m_Registers[E] + i);
+				Store(m_Registers[D] + i, Load(m_Registers[H] + i));
+				Store(m_Registers[E] + i, Load(m_Registers[L] + i));
+				Store(m_Registers[H] + i, d);
+				Store(m_Registers[L] + i, e);
+			});
+			break;
+
+		case i8080::OpGroup::SPHL:
+			ForEachLane(m_Convoy, [&](uint32_t lane) { m_SP[lane] = Pair(HL, lane); });
+			break;
+
+		case i8080::OpGroup::INR:
+		case i8080::OpGroup::DCR: {
+			const bool increment = i8080::s_GroupTable[opcode] == i8080::OpGroup::INR;
+			uint8_t* value = dst == MEMORY_REF ? ReadM() : m_Registers[dst];
+
+			ExecuteIncDec(value, increment);
+
+			if (dst == MEMORY_REF)
+				WriteM(value);
+			break;
+		}
+
+		case i8080::OpGroup::INX:
+		case i8080::OpGroup::DCX:
+			ExecuteIncDecPair(rp, i8080::s_GroupTable[opcode] == i8080::OpGroup::INX);
+			break;
+
+		case i8080::OpGroup::MOV:
+			if (dst == MEMORY_REF)
+				WriteM(m_Registers[src]);
+			else
+				memcpy(m_Registers[dst], src == MEMORY_REF ? ReadM() : m_Registers[src], LOCKSTEP_LANES);
+			break;
+
+		case i8080::OpGroup::DAD:
+			ExecuteDAD(rp);
+			break;
+
+		case i8080::OpGroup::LXI:
+			if (rp == 0x3) {
+				std::fill(m_SP, m_SP + LOCKSTEP_LANES, operand);
+			}
+			else {
+				memset(m_Registers[rp * 2], operand >> 8, LOCKSTEP_LANES);
+				memset(m_Registers[rp * 2 + 1], operand & 0xFF, LOCKSTEP_LANES);
+			}
+			break;
+
+		case i8080::OpGroup::MVI:
+			if (dst == MEMORY_REF) {
+				memset(m_M, operand, LOCKSTEP_LANES);
+				WriteM(m_M);
+			}
+			else {
+				memset(m_Registers[dst], operand, LOCKSTEP_LANES);
+			}
+			break;
+
+		case i8080::OpGroup::RotateAcc:
+			ExecuteRotate(opcode);
+			break;
+
+		// LDAX/STAX through BC or DE
+		case i8080::OpGroup::AccTransfer: {
+			const uint8_t pair = (opcode & 0x10) >> 4;
+			const bool load = opcode & 0x8;
+
+			ForEachLane(m_Convoy, [&](uint32_t lane) {
+				Memory* memory = m_Lanes[lane].memory.get();
+				const uint16_t addr = Pair(pair, lane);
+
+				if (load)
+					a[lane] = memory->Read(addr);
+				else
+					memory->Write(addr, a[lane]);
+			});
+			break;
+		}
+
+		// SHLD, LHLD, STA, LDA
+		case i8080::OpGroup::DirectAddressing: {
+			const uint8_t operation = (opcode & 0x18) >> 3;
+			const uint16_t high = static_cast<uint16_t>(operand + 1);
+
+			ForEachLane(m_Convoy, [&](uint32_t lane) {
+				Memory* memory = m_Lanes[lane].memory.get();
+
+				switch (operation)
+				{
+					case 0x0:
+						memory->Write(operand, m_Registers[L][lane]);
+						memory->Write(high, m_Registers[H][lane]);
+						break;
+
+					case 0x1:
+						m_Registers[L][lane] = memory->Read(operand);
+						m_Registers[H][lane] = memory->Read(high);
+						break;
+
+					case 0x2: memory->Write(operand, a[lane]);	break;
+					case 0x3: a[lane] = memory->Read(operand);	break;
+				}
+			});
+			break;
+		}
+
+		case i8080::OpGroup::Immediate:
+			memset(m_M, operand, LOCKSTEP_LANES);
+			ExecuteALU(dst, m_M);
+			break;
+
+		case i8080::OpGroup::RegisterToAcc:
+			ExecuteALU(dst, src == MEMORY_REF ? ReadM() : m_Registers[src]);
+			break;
+
+		case i8080::OpGroup::PUSH:
+			ForEachLane(m_Convoy, [&](uint32_t lane) {
+				Memory* memory = m_Lanes[lane].memory.get();
+				uint16_t sp = m_SP[lane];
+
+				// PSW pushes A then the flags
+				const uint8_t hi = rp == 0x3 ? a[lane] : m_Registers[rp * 2][lane];
+				const uint8_t lo = rp == 0x3 ? m_Flags[lane] : m_Registers[rp * 2 + 1][lane];
+
+				memory->Write(--sp, hi);
+				memory->Write(--sp, lo);
+				m_SP[lane] = sp;
+			});
+			break;
+
+		case i8080::OpGroup::POP:
+			ForEachLane(m_Convoy, [&](uint32_t lane) {
+				Memory* memory = m_Lanes[lane].memory.get();
+				uint16_t sp = m_SP[lane];
+
+				const uint8_t lo = memory->Read(sp++);
+				const uint8_t hi = memory->Read(sp++);
+
+				if (rp == 0x3) {
+					m_Flags[lane] = lo;
+					a[lane] = hi;
+				}
+				else {
+					m_Registers[rp * 2][lane] = hi;
+					m_Registers[rp * 2 + 1][lane] = lo;
+				}
+
+				m_SP[lane] = sp;
+			});
+			break;
+
+		case i8080::OpGroup::JMP: {
+			const uint32_t taken = dst == 0x0 && (opcode & 0x1) ? m_Convoy : Condition(dst) & m_Convoy;
+
+			if (taken == 0)
+				break;
+
+			if (operand == 0x0) {
+				ForEachLane(taken, [this](uint32_t lane) { m_Lanes[lane].cpm->WBOOT(); });
+				Stop(taken, 0x0, i8080::StopReason::Exit);
+				break;
+			}
+
+			if (taken == m_Convoy) {
+				m_ConvoyPC = operand;
+				break;
+			}
+
+			ForEachLane(m_Convoy, [&](uint32_t lane) { m_PC[lane] = taken & (1u << lane) ? operand : next; });
+			Regroup();
+			break;
+		}
+
+		case i8080::OpGroup::CALL: {
+			// BDOS calls trap on the target whatever the condition, as in
+			// i8080::CALL()
+			if (operand == 0x0005) {
+				uint32_t exited = 0, failed = 0;
+
+				ForEachLane(m_Convoy, [&](uint32_t lane) {
+					CPM* cpm = m_Lanes[lane].cpm.get();
+					uint8_t result;
+					if (cpm->Call(m_Registers[C][lane], Pair(DE, lane), result)) {
+						m_Registers[A][lane] = result;
+						m_Registers[L][lane] = result;
+					}
+
+					if (cpm->Exited())
+						exited |= 1u << lane;
+					else if (cpm->Failed())
+						failed |= 1u << lane;
+				});
+
+				Stop(exited, next, i8080::StopReason::Exit);
+
+				// Each lane asked for its own function
+				ForEachLane(failed, [&](uint32_t lane) {
+					Leave(lane, next, i8080::StopReason::Error, { i8080::Fault::Kind::BDOS, m_Registers[C][lane], pc });
+				});
+				break;
+			}
+
+			const uint32_t taken = dst == 0x1 && (opcode & 0x1) ? m_Convoy : Condition(dst) & m_Convoy;
+			const uint8_t takenCycles = opcode == 0xCD ? 0 : BRANCH_TAKEN_CYCLES;
+
+			ForEachLane(taken, [&](uint32_t lane) {
+				Memory* memory = m_Lanes[lane].memory.get();
+				uint16_t sp = m_SP[lane];
+
+				memory->Write(--sp, next >> 8);
+				memory->Write(--sp, next & 0xFF);
+
+				m_SP[lane] = sp;
+				m_Cycles[lane] += takenCycles;
+			});
+
+			if (taken == m_Convoy) {
+				m_ConvoyPC = operand;
+			}
+			else if (taken != 0) {
+				ForEachLane(m_Convoy, [&](uint32_t lane) { m_PC[lane] = taken & (1u << lane) ? operand : next; });
+				Regroup();
+			}
+			break;
+		}
+
+		case i8080::OpGroup::RET: {
+			const uint32_t taken = dst == 0x1 && (opcode & 0x1) ? m_Convoy : Condition(dst) & m_Convoy;
+			const uint8_t takenCycles = opcode == 0xC9 ? 0 : BRANCH_TAKEN_CYCLES;
+
+			if (taken == 0)
+				break;
+
+			ForEachLane(m_Convoy, [&](uint32_t lane) {
+				if (!(taken & (1u << lane))) {
+					m_PC[lane] = next;
+					return;
+				}
+
+				Memory* memory = m_Lanes[lane].memory.get();
+				uint16_t sp = m_SP[lane];
+
+				const uint8_t lo = memory->Read(sp++);
+				const uint8_t hi = memory->Read(sp++);
+
+				m_PC[lane] = lo | hi << 8;
+				m_SP[lane] = sp;
+				m_Cycles[lane] += takenCycles;
+			});
+
+			Regroup();
+			break;
+		}
+
+		default:
+			Stop(m_Convoy, next, i8080::StopReason::Error, { i8080::Fault::Kind::Opcode, opcode, pc });
+	}
+
+	return m_Convoy == before;
+}
+
+uint16_t Lockstep::Pair(uint8_t rp, uint32_t lane) const
+{
+	return m_Registers[rp * 2][lane] << 8 | m_Registers[rp * 2 + 1][lane];
+}
+
+uint32_t Lockstep::Condition(uint8_t code) const
+{
+	static constexpr uint8_t s_Bits[4] = { LANE_Z, LANE_CY, LANE_P, LANE_S };
+
+	const uint8_t bit = s_Bits[code >> 1];
+	const Vec want = Splat(code & 0x1 ? bit : 0);
+
+	uint32_t lanes = 0;
+	ForEachVec([&](uint32_t i) {
+		lanes |= MoveMask(Equal(And(Load(m_Flags + i), Splat(bit)), want)) << i;
+	});
+
+	return lanes;
+}
+
+void Lockstep::Regroup()
+{
+	uint16_t lowest = 0xFFFF;
+	ForEachLane(m_Convoy, [&](uint32_t lane) { lowest = std::min(lowest, m_PC[lane]); });
+
+	ForEachLane(m_Convoy, [&](uint32_t lane) {
+		if (m_PC[lane] != lowest) {
+			Leave(lane, m_PC[lane]);
+			m_Stats.splits++;
+		}
+	});
+
+	m_ConvoyPC = lowest;
+}
+
+void Lockstep::Stop(uint32_t lanes, uint16_t pc, i8080::StopReason reason, i8080::Fault fault)
+{
+	ForEachLane(lanes, [&](uint32_t lane) { Leave(lane, pc, reason, fault); });
+}
+
+uint8_t* Lockstep::ReadM()
+{
+	ForEachLane(m_Convoy, [this](uint32_t lane) { m_M[lane] = m_Lanes[lane].memory->Read(Pair(HL, lane)); });
+	return m_M;
+}
+
+void Lockstep::WriteM(const uint8_t* values)
+{
+	ForEachLane(m_Convoy, [&](uint32_t lane) { m_Lanes[lane].memory->Write(Pair(HL, lane), values[lane]); });
+}
+
+// ADD, ADC, SUB, SBB, ANA, XRA, ORA, CMP and their immediates
+void Lockstep::ExecuteALU(uint8_t operation, const uint8_t* operand)
+{
+	uint8_t* const a = m_Registers[A];
+
+	ForEachVec([&](uint32_t i) {
+		const Vec acc = Load(a + i);
+		const Vec value = Load(operand + i);
+		const Vec f = Load(m_Flags + i);
+		const Vec carry = And(f, Splat(LANE_CY));
+
+		Vec res, flags;
+
+		switch (operation)
+		{
+			case 0x0: flags = AddFlags(acc, value, Zero(), res);	break;
+			case 0x1: flags = AddFlags(acc, value, carry, res);		break;
+			case 0x2: flags = SubFlags(acc, value, Zero(), res);	break;
+			case 0x3: flags = SubFlags(acc, value, carry, res);		break;
+
+			// ANA sets AC from bit 3 of either operand
+			case 0x4:
+				res = And(acc, value);
+				flags = Or(ZSP(res), And(Add(Or(acc, value), Or(acc, value)), Splat(LANE_AC)));
+				break;
+
+			case 0x5: res = Xor(acc, value); flags = ZSP(res);	break;
+			case 0x6: res = Or(acc, value); flags = ZSP(res);	break;
+
+			default:
+				flags = SubFlags(acc, value, Zero(), res);
+				res = acc;
+		}
+
+		Store(a + i, res);
+		Store(m_Flags + i, Merge(f, flags, LANE_ALL));
+	});
+}
+
+void Lockstep::ExecuteRotate(uint8_t opcode)
+{
+	uint8_t* const a = m_Registers[A];
+	const uint8_t operation = (opcode & 0x18) >> 3;
+
+	ForEachVec([&](uint32_t i) {
+		const Vec acc = Load(a + i);
+		const Vec f = Load(m_Flags + i);
+
+		Vec res, carry;
+
+		switch (operation)
+		{
+			// RLC, then RAL through the old carry
+			case 0x0:
+			case 0x2:
+				carry = TopBit(acc);
+				res = Or(Add(acc, acc), operation == 0x0 ? carry : And(f, Splat(LANE_CY)));
+				break;
+
+			// RRC, then RAR through the old carry
+			default:
+				carry = And(acc, Splat(0x01));
+				res = Or(And(ShiftRight<1>(acc), Splat(0x7F)),
+					And(Sub(Zero(), operation == 0x1 ? carry : And(f, Splat(LANE_CY))), Splat(0x80)));
+		}
+
+		Store(a + i, res);
+		Store(m_Flags + i, Merge(f, carry, LANE_CY));
+	});
+}
+
+// Lane by lane, as i8080::flags::daa(). Flags as for adding the correction,
+// except that CY is only ever set.
+void Lockstep::ExecuteDAA()
+{
+	uint8_t* const a = m_Registers[A];
+
+	ForEachLane(m_Convoy, [&](uint32_t lane) {
+		const uint8_t acc = a[lane];
+		const uint8_t accLo = acc & 0x0F;
+		const uint8_t accHi = acc >> 4;
+		uint8_t carry = m_Flags[lane] & LANE_CY;
+		uint8_t correction = 0;
+
+		if (accLo > 0x9 || (m_Flags[lane] & LANE_AC))
+			correction |= 0x06;
+
+		if (accHi > 0x9 || carry || (accHi >= 0x9 && accLo > 0x9)) {
+			correction |= 0x60;
+			carry = 1;
+		}
+
+		const uint8_t flags = AluTables::Add[AluTables::Index(0, acc, correction)];
+
+		a[lane] = acc + correction;
+		m_Flags[lane] = (m_Flags[lane] & ~LANE_ALL) | (flags & ~LANE_CY & LANE_ALL) | carry;
+	});
+}
+
+// INR and DCR leave CY alone
+void Lockstep::ExecuteIncDec(uint8_t* value, bool increment)
+{
+	ForEachVec([&](uint32_t i) {
+		const Vec v = Load(value + i);
+		const Vec f = Load(m_Flags + i);
+
+		Vec res;
+		Vec flags = increment ? AddFlags(v, Splat(1), Zero(), res) : SubFlags(v, Splat(1), Zero(), res);
+
+		Store(value + i, res);
+		Store(m_Flags + i, Merge(f, flags, LANE_ALL & ~LANE_CY));
+	});
+}
+
+// INX and DCX carry from the low register into the high one. SP is a
+// word per lane.
+void Lockstep::ExecuteIncDecPair(uint8_t rp, bool increment)
+{
+	if (rp == 0x3) {
+		for (uint32_t lane = 0; lane < LOCKSTEP_LANES; lane++)
+			m_SP[lane] += increment ? 1 : -1;
+		return;
+	}
+
+	uint8_t* const hi = m_Registers[rp * 2];
+	uint8_t* const lo = m_Registers[rp * 2 + 1];
+
+	ForEachVec([&](uint32_t i) {
+		const Vec h = Load(hi + i);
+		const Vec l = Load(lo + i);
+
+		// Equal() is 0xFF, minus one, where the low byte wraps
+		if (increment) {
+			const Vec res = Add(l, Splat(1));
+			Store(lo + i, res);
+			Store(hi + i, Sub(h, Equal(res, Zero())));
+		}
+		else {
+			Store(lo + i, Sub(l, Splat(1)));
+			Store(hi + i, Add(h, Equal(l, Zero())));
+		}
+	});
+}
+
+// HL += rp, CY from bit 15
+void Lockstep::ExecuteDAD(uint8_t rp)
+{
+	uint8_t* const h = m_Registers[H];
+	uint8_t* const l = m_Registers[L];
+
+	if (rp == 0x3) {
+		ForEachLane(m_Convoy, [&](uint32_t lane) {
+			const uint32_t res = Pair(HL, lane) + m_SP[lane];
+
+			h[lane] = static_cast<uint8_t>(res >> 8);
+			l[lane] = static_cast<uint8_t>(res);
+			m_Flags[lane] = (m_Flags[lane] & ~LANE_CY) | (res >> 16);
+		});
+		return;
+	}
+
+	const uint8_t* const hi = m_Registers[rp * 2];
+	const uint8_t* const lo = m_Registers[rp * 2 + 1];
+
+	ForEachVec([&](uint32_t i) {
+		const Vec lv = Load(l + i), hv = Load(h + i);
+		const Vec lr = Load(lo + i), hr = Load(hi + i);
+
+		const Vec low = Add(lv, lr);
+		const Vec lowCarry = TopBit(Or(And(lv, lr), AndNot(low, Or(lv, lr))));
+
+		const Vec high = Add(Add(hv, hr), lowCarry);
+		const Vec highCarry = TopBit(Or(And(hv, hr), AndNot(high, Or(hv, hr))));
+
+		Store(l + i, low);
+		Store(h + i, high);
+		Store(m_Flags + i, Merge(Load(m_Flags + i), highCarry, LANE_CY));
+	});
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <bitset>
+#include <cstdint>
+#include <memory>
+
+#include "i8080.h"
+#include "Memory.h"
+#include "CPM.h"
+
+// Machines run side by side, one per lane
+#define LOCKSTEP_LANES 32
+
+// Fewest lanes a convoy forms with or keeps running with. Below it the
+// fixed cost of a vector step and of gathering and scattering lane state
+// is more than running the lanes on their own cores.
+#define LOCKSTEP_MIN_CONVOY 8
+
+// Vector unit the lockstep engine is built for: 2 for AVX2, 1 for SSE2,
+// 0 for plain loops over the lanes. Picked from the compiler's target
+// unless given.
+#ifndef LOCKSTEP_SIMD
+	#if defined(__AVX2__)
+		#define LOCKSTEP_SIMD 2
+	#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+		#define LOCKSTEP_SIMD 1
+	#else
+		#define LOCKSTEP_SIMD 0
+	#endif
+#endif
+
+// Many copies of one program, each with its own Memory, CPM and inputs,
+// run in lockstep. The lanes that share a PC form the convoy. Its
+// registers and flags are kept as structure-of-arrays, one byte per lane
+// per register, so an instruction runs once for the whole convoy: ALU,
+// register and flag work on whole vectors, memory accesses go lane by
+// lane to each lane's own Memory. Flags are computed eagerly, to the same
+// bytes i8080 ends up with lazily.
+//
+// A branch the lanes disagree on, or a RET or PCHL to different places,
+// splits the convoy. Lanes that leave it drop to a scalar i8080 of their
+// own. The lanes at the lowest PC always run next: the convoy if it is
+// there, else the lanes there are gathered into a new convoy if there
+// are at least LOCKSTEP_MIN_CONVOY of them, or run on their scalar cores.
+// Lanes ahead wait, so lanes that left at a branch meet the convoy again
+// at the join and rejoin it. A convoy split below LOCKSTEP_MIN_CONVOY
+// lanes hands them all back to their scalar cores. Lanes share nothing,
+// so each ends exactly as if run alone.
+//
+// The bytes of each instruction are compared across the lanes' memories
+// the first time the convoy runs it, and their pages watched after, so
+// lanes whose code differs are split off instead of running the wrong
+// instruction.
+//
+// Lanes run as the interpreter does with nothing attached: breakpoints,
+// watchpoints, traces and profilers set on a lane's i8080 are ignored.
+class Lockstep : public WriteListener
+{
+public:
+	struct Stats {
+		uint64_t vectorSteps = 0;	// instructions run by the convoy
+		uint64_t laneSteps = 0;		// the same, counted per convoy lane
+		uint64_t scalarSteps = 0;	// instructions run by lanes on their own
+		uint64_t splits = 0;		// lanes that left the convoy
+		uint64_t joins = 0;			// lanes that joined it
+		uint64_t convoys = 0;		// convoys gathered from lanes at one PC
+		uint64_t disbanded = 0;		// convoys handed back below LOCKSTEP_MIN_CONVOY
+
+		// Average lanes per convoy step
+		double Occupancy() const { return vectorSteps ? static_cast<double>(laneSteps) / vectorSteps : 0.0; }
+	};
+
+public:
+	// At most LOCKSTEP_LANES lanes. Every lane starts as a fresh i8080.
+	explicit Lockstep(uint32_t lanes = LOCKSTEP_LANES);
+	~Lockstep();
+
+	uint32_t GetLaneCount() const { return m_LaneCount; }
+
+	// Load each lane's program and inputs here between runs. Writes must
+	// go through Memory::Write() or Load() for the code checks to see them.
+	Memory* GetMemory(uint32_t lane) { return m_Lanes[lane].memory.get(); }
+	CPM* GetCPM(uint32_t lane) { return m_Lanes[lane].cpm.get(); }
+
+	i8080::State GetState(uint32_t lane) const { return m_Lanes[lane].cpu->GetState(); }
+	void SetState(uint32_t lane, const i8080::State& state) { m_Lanes[lane].cpu->SetState(state); }
+
+	// Runs each lane for up to instructions instructions, as i8080::Run()
+	// on the interpreter would. Returns the number of lanes that have not
+	// stopped.
+	uint32_t Run(uint64_t instructions);
+
+	const Stats& GetStats() const { return m_Stats; }
+
+	// A write to a byte the convoy has checked sends it back for checking
+	void OnWrite(uint16_t addr) override { m_Verified[addr] = false; }
+
+private:
+	struct Lane {
+		std::unique_ptr<Memory> memory;
+		std::unique_ptr<CPM> cpm;
+		std::unique_ptr<i8080> cpu;	// the lane's own core while it is out of the convoy
+		uint64_t left = 0;			// instructions left in this Run()
+	};
+
+	void Join(uint32_t lane);
+	void Leave(uint32_t lane, uint16_t pc, i8080::StopReason stop = i8080::StopReason::None, i8080::Fault fault = {});
+
+	// Runs the convoy until its PC reaches limit (or for good if
+	// unlimited), it changes or a lane runs out of budget. Returns the
+	// instructions run.
+	uint64_t RunConvoy(uint16_t limit, bool unlimited);
+
+	// One instruction for every convoy lane. Returns false if a lane left
+	// the convoy.
+	bool Step();
+
+	// Splits off the lanes whose code at pc differs from the first convoy
+	// lane's, and returns them
+	uint32_t CheckCode(uint16_t pc);
+
+	// Lanes whose condition code (bits 3-5 of a branch opcode) holds
+	uint32_t Condition(uint8_t code) const;
+
+	// Ends a step with every convoy lane at its own m_PC, keeping the lanes
+	// at the lowest PC and sending the rest out
+	void Regroup();
+	void Stop(uint32_t lanes, uint16_t pc, i8080::StopReason reason, i8080::Fault fault = {});
+
+	uint16_t Pair(uint8_t rp, uint32_t lane) const;
+
+	// Gathers (HL) of every convoy lane into m_M, one byte per lane
+	uint8_t* ReadM();
+	void WriteM(const uint8_t* values);
+
+	void ExecuteALU(uint8_t operation, const uint8_t* operand);
+	void ExecuteRotate(uint8_t opcode);
+	void ExecuteDAA();
+	void ExecuteIncDec(uint8_t* value, bool increment);
+	void ExecuteIncDecPair(uint8_t rp, bool increment);
+	void ExecuteDAD(uint8_t rp);
+
+private:
+	uint32_t m_LaneCount;
+	uint32_t m_MinConvoy;		// LOCKSTEP_MIN_CONVOY, at most the lane count
+	Lane m_Lanes[LOCKSTEP_LANES];
+
+	// The convoy, one bit per lane, all at m_ConvoyPC
+	uint32_t m_Convoy = 0;
+	uint16_t m_ConvoyPC = 0;
+
+	// Structure-of-arrays state of the convoy lanes. The bytes of lanes
+	// outside it are stale and only ever computed on, never read back.
+	alignas(32) uint8_t m_Registers[8][LOCKSTEP_LANES]{};	// in opcode order, B to A
+	alignas(32) uint8_t m_Flags[LOCKSTEP_LANES]{};
+	alignas(32) uint8_t m_M[LOCKSTEP_LANES]{};				// (HL) gathered by ReadM()
+	uint16_t m_PC[LOCKSTEP_LANES]{};						// per lane while a step splits
+	uint16_t m_SP[LOCKSTEP_LANES]{};
+
+	// A lane's cycles are its m_Cycles plus m_ConvoyCycles, which every
+	// step adds its cost to once for the whole convoy
+	uint64_t m_Cycles[LOCKSTEP_LANES]{};
+	uint64_t m_ConvoyCycles = 0;
+
+	// Instruction bytes found the same in every lane, on watched pages
+	std::bitset<MEMORY_SIZE> m_Verified;
+	bool m_Watched[MEMORY_PAGES]{};
+
+	Stats m_Stats;
+};
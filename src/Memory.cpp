@@ -0,0 +1,42 @@
+#include "Memory.h"
+
+// ROM, MMIO, watched pages, watchpoints, and the first write to a page
+// since a snapshot or ClearDirtyPages()
+uint8_t Memory::SlowRead(uint16_t addr) const
+{
+	const Page& p = m_Pages[addr >> 8];
+	const uint8_t val = p.type == PageType::MMIO ? p.device->Read(addr) : m_Memory[addr];
+
+	if (m_ReadWatchpoints[addr])
+		RecordWatchHit(addr, val, WATCH_READ);
+
+	return val;
+}
+
+void Memory::SlowWrite(uint16_t addr, uint8_t val)
+{
+	const Page& p = m_Pages[addr >> 8];
+
+	switch (p.type)
+	{
+		case PageType::RAM:
+			Touch(addr >> 8);
+			m_Memory[addr] = val;
+			break;
+
+		case PageType::ROM:
+			if (p.device)
+				p.device->Write(addr, val);
+			break;
+
+		case PageType::MMIO:
+			p.device->Write(addr, val);
+			break;
+	}
+
+	if (p.watched)
+		m_Listener->OnWrite(addr);
+
+	if (m_WriteWatchpoints[addr])
+		RecordWatchHit(addr, val, WATCH_WRITE);
+}
@@ -1,37 +1,441 @@
 #pragma once
 
+#include <array>
+#include <bitset>
+#include <cstddef>
 #include <cstdint>
-#include <fstream>
+#include <cstring>
+#include <memory>
 #include <vector>
 
+#define MEMORY_SIZE 65536
+#define MEMORY_PAGE_SIZE 256
+#define MEMORY_PAGES (MEMORY_SIZE / MEMORY_PAGE_SIZE)
+
+// Accesses a watchpoint stops on, combined with |
+#define WATCH_READ 0x1
+#define WATCH_WRITE 0x2
+
+// Notified when a write lands in a page marked with WatchPage()
+class WriteListener
+{
+public:
+	virtual ~WriteListener() {}
+
+	virtual void OnWrite(uint16_t addr) = 0;
+};
+
+// A device mapped into the address space with MapMMIO(). It sees every
+// read and write to its pages, with the full address.
+class MemoryDevice
+{
+public:
+	virtual ~MemoryDevice() {}
+
+	virtual uint8_t Read(uint16_t addr) = 0;
+	virtual void Write(uint16_t addr, uint8_t val) = 0;
+};
+
+// 64 KB address space split into 256-byte pages. Each page is RAM, ROM
+// or MMIO. All pages start as RAM.
+//
+// m_Memory holds the bytes of every RAM and ROM page, so the common case
+// is one indexed access behind a per-page flag test. Pages that need more
+// are flagged in m_SlowRead and m_SlowWrite: MMIO reads and writes go to
+// the device, ROM writes are dropped or passed to the trap device given
+// to MapROM(), and watched pages tell the WriteListener.
+//
+// Fetch() reads code and skips the flag test. Code never runs from MMIO,
+// so it reads the backing bytes directly.
+//
+// Pages written since the last ClearDirtyPages() are set in the dirty
+// bitmap. A clean page is flagged slow until its first write marks it,
+// so the bitmap costs one slow write per page per clear. All pages start
+// dirty.
+//
+// Watchpoints are kept in 64K-bit read and write bitmaps. Only the pages
+// holding a watched address are flagged slow, and only the slow path
+// looks at the bitmaps, so memory without watchpoints runs as before.
+// A hit is recorded for the CPU to stop on, see i8080::Run().
+//
+// Snapshots share pages copy-on-write. TakeSnapshot() copies only the
+// pages written since the last one and shares the rest, Restore() copies
+// back only the pages that differ. Until its first write after a
+// snapshot a page is flagged slow, so steady-state writes stay fast.
+// Devices keep their own state, only the backing bytes are captured.
+//
+// A run of pages can be banked with MapBanks(). The selected bank sits in
+// m_Memory like any other page, so nothing that reads memory changes. The
+// other banks are kept as shared page copies, the same as snapshots keep
+// them: SelectBank() shares the outgoing pages, copying only those
+// written since they were last shared, and copies the incoming ones in.
+// Snapshots capture the bank selection and every bank.
 class Memory
 {
+public:
+	enum class PageType : uint8_t { RAM, ROM, MMIO };
+
+	using PageData = std::array<uint8_t, MEMORY_PAGE_SIZE>;
+
+	// Every bank of the banked run, bank by bank. The selected bank's
+	// entries are out of date, its pages are the ones in m_Memory.
+	struct Banks {
+		uint32_t selected = 0;
+		std::vector<std::shared_ptr<const PageData>> pages;
+	};
+
+	struct Snapshot {
+		std::shared_ptr<const PageData> pages[MEMORY_PAGES];
+		Banks banks;
+	};
+
 public:
 	Memory() {}
 
-	void LoadROM(const char* filename)
+	// Copies size bytes to addr in one block, straight into the backing
+	// bytes whatever the page types. Returns false, writing nothing, if
+	// they would run past the end of memory. Bytes on watched pages are
+	// reported to the WriteListener.
+	bool Load(uint16_t addr, const uint8_t* data, size_t size)
 	{
-		std::ifstream file(filename, std::ifstream::binary | std::ifstream::ate);
-		auto filesize = file.tellg();
-		file.seekg(std::ifstream::beg);
+		if (addr + size > MEMORY_SIZE)
+			return false;
 
-		std::vector<char> buf(filesize);
+		if (size == 0)
+			return true;
 
-		file.read(buf.data(), filesize);
+		memcpy(m_Memory + addr, data, size);
 
-		if (filesize > 65536) {
-			fprintf(stderr, "File is too large");
-			exit(1);
+		for (uint32_t page = addr >> 8; page <= (addr + size - 1) >> 8; page++)
+			Touch(page);
+
+		for (uint32_t a = addr; a < addr + size; a++) {
+			if (m_Pages[a >> 8].watched)
+				m_Listener->OnWrite(static_cast<uint16_t>(a));
 		}
 
-		for (unsigned int i = 0; i < filesize; i++) {
-			m_Memory[i + 0x100] = buf[i];
+		return true;
+	}
+
+	uint8_t Fetch(uint16_t addr) const { return m_Memory[addr]; }
+
+	uint8_t Read(uint16_t addr) const
+	{
+		if (m_SlowRead[addr >> 8])
+			return SlowRead(addr);
+
+		return m_Memory[addr];
+	}
+
+	void Write(uint16_t addr, uint8_t val)
+	{
+		if (m_SlowWrite[addr >> 8])
+			SlowWrite(addr, val);
+		else
+			m_Memory[addr] = val;
+	}
+
+	// Bytes from addr that Read() would take straight from m_Memory, up to
+	// the first page it has to go the slow way for or the end of memory
+	size_t GetFastReadRun(uint16_t addr) const
+	{
+		uint32_t page = addr >> 8;
+
+		while (page < MEMORY_PAGES && !m_SlowRead[page])
+			page++;
+
+		return page * MEMORY_PAGE_SIZE > addr ? page * MEMORY_PAGE_SIZE - addr : 0;
+	}
+
+	// Each call maps whole pages, from first up to first + count - 1
+	void MapRAM(uint8_t first, uint32_t count) { Map(first, count, PageType::RAM, nullptr); }
+	void MapROM(uint8_t first, uint32_t count, MemoryDevice* trap = nullptr) { Map(first, count, PageType::ROM, trap); }
+	void MapMMIO(uint8_t first, uint32_t count, MemoryDevice* device) { Map(first, count, PageType::MMIO, device); }
+
+	PageType GetPageType(uint8_t page) const { return m_Pages[page].type; }
+
+	void SetWriteListener(WriteListener* listener) { m_Listener = listener; }
+
+	void WatchPage(uint8_t page, bool watch)
+	{
+		m_Pages[page].watched = watch;
+		UpdatePage(page);
+	}
+
+	const std::bitset<MEMORY_PAGES>& GetDirtyPages() const { return m_Dirty; }
+
+	void ClearDirtyPages()
+	{
+		m_Dirty.reset();
+
+		for (uint32_t page = 0; page < MEMORY_PAGES; page++)
+			UpdatePage(page);
+	}
+
+	// Fetch() is not a read here, instructions are not watched
+	void SetWatchpoint(uint16_t addr, uint8_t access)
+	{
+		ClearWatchpoint(addr);
+
+		Page& p = m_Pages[addr >> 8];
+
+		if (access & WATCH_READ) {
+			m_ReadWatchpoints[addr] = true;
+			p.readWatchpoints++;
+		}
+		if (access & WATCH_WRITE) {
+			m_WriteWatchpoints[addr] = true;
+			p.writeWatchpoints++;
+		}
+
+		m_WatchpointCount += m_ReadWatchpoints[addr] || m_WriteWatchpoints[addr];
+		UpdatePage(addr >> 8);
+	}
+
+	void ClearWatchpoint(uint16_t addr)
+	{
+		Page& p = m_Pages[addr >> 8];
+
+		m_WatchpointCount -= m_ReadWatchpoints[addr] || m_WriteWatchpoints[addr];
+
+		if (m_ReadWatchpoints[addr]) {
+			m_ReadWatchpoints[addr] = false;
+			p.readWatchpoints--;
 		}
+		if (m_WriteWatchpoints[addr]) {
+			m_WriteWatchpoints[addr] = false;
+			p.writeWatchpoints--;
+		}
+
+		UpdatePage(addr >> 8);
+	}
+
+	size_t GetWatchpointCount() const { return m_WatchpointCount; }
+
+	// The first access to a watched address since ClearWatchHit()
+	struct WatchHit {
+		uint16_t addr;
+		uint8_t value;		// read or written
+		uint8_t access;		// WATCH_READ or WATCH_WRITE
+	};
+
+	bool HasWatchHit() const { return m_HasWatchHit; }
+	const WatchHit& GetWatchHit() const { return m_WatchHit; }
+	void ClearWatchHit() { m_HasWatchHit = false; }
+
+	Snapshot TakeSnapshot()
+	{
+		Snapshot snapshot;
+
+		for (uint32_t page = 0; page < MEMORY_PAGES; page++)
+			snapshot.pages[page] = SharePage(page);
+
+		snapshot.banks = m_Banks;
+		return snapshot;
 	}
 
-	uint8_t Read(uint16_t addr) const { return m_Memory[addr]; }
-	void Write(uint16_t addr, uint8_t val) { m_Memory[addr] = val; }
+	// Watched pages report each byte that changes to the WriteListener,
+	// so cached code over them is dropped as for any other write
+	void Restore(const Snapshot& snapshot)
+	{
+		for (uint32_t page = 0; page < MEMORY_PAGES; page++)
+			RestorePage(page, snapshot.pages[page]);
+
+		SetBanks(snapshot.banks);
+	}
+
+	// Banks pages first to first + count - 1 into banks copies, bank 0
+	// selected and holding what memory holds, the others zeroed. Returns
+	// false, changing nothing, if the run is empty or past the end of
+	// memory, there are no banks, or a run is banked already.
+	bool MapBanks(uint8_t first, uint32_t count, uint32_t banks)
+	{
+		if (count == 0 || first + count > MEMORY_PAGES || banks == 0 || m_BankCount > 0)
+			return false;
+
+		static const std::shared_ptr<const PageData> zero = std::make_shared<PageData>();
+
+		m_BankFirst = first;
+		m_BankPages = count;
+		m_BankCount = banks;
+		m_Banks.selected = 0;
+		m_Banks.pages.assign(static_cast<size_t>(banks) * count, zero);
+		return true;
+	}
+
+	// Memory keeps the selected bank, the others are gone
+	void UnmapBanks()
+	{
+		m_BankCount = 0;
+		m_Banks = {};
+	}
+
+	// Numbers past the last bank wrap around. Costs a copy of each page
+	// of the incoming bank and of each outgoing page written since it was
+	// last shared.
+	void SelectBank(uint32_t bank)
+	{
+		if (m_BankCount == 0)
+			return;
+
+		bank %= m_BankCount;
+
+		if (bank == m_Banks.selected)
+			return;
+
+		auto outgoing = m_Banks.pages.begin() + static_cast<size_t>(m_Banks.selected) * m_BankPages;
+		auto incoming = m_Banks.pages.begin() + static_cast<size_t>(bank) * m_BankPages;
+
+		for (uint32_t i = 0; i < m_BankPages; i++) {
+			outgoing[i] = SharePage(m_BankFirst + i);
+			RestorePage(m_BankFirst + i, incoming[i]);
+		}
+
+		m_Banks.selected = bank;
+	}
+
+	uint32_t GetBank() const { return m_Banks.selected; }
+	uint32_t GetBankCount() const { return m_BankCount; }
+
+	// The banks as they are, and back again. SetBanks() leaves m_Memory
+	// alone, the caller puts back the selected bank's pages along with
+	// the rest, and returns false, changing nothing, if the banks are not
+	// laid out as MapBanks() laid out these.
+	const Banks& GetBanks() const { return m_Banks; }
+
+	bool SetBanks(const Banks& banks)
+	{
+		if (banks.pages.size() != m_Banks.pages.size() || (m_BankCount > 0 && banks.selected >= m_BankCount))
+			return false;
+
+		m_Banks = banks;
+		return true;
+	}
+
+private:
+	struct Page {
+		PageType type = PageType::RAM;
+		bool watched = false;
+		uint16_t readWatchpoints = 0;
+		uint16_t writeWatchpoints = 0;
+		MemoryDevice* device = nullptr;		// MMIO handler, or ROM write trap
+	};
+
+	void Map(uint8_t first, uint32_t count, PageType type, MemoryDevice* device)
+	{
+		for (uint32_t page = first; page < first + count && page < MEMORY_PAGES; page++) {
+			m_Pages[page].type = type;
+			m_Pages[page].device = device;
+			UpdatePage(page);
+		}
+	}
+
+	// Only writes to dirty plain RAM that no snapshot shares, and reads
+	// from RAM or ROM, stay on the fast path, unless the page holds a
+	// watchpoint
+	void UpdatePage(uint32_t page)
+	{
+		const Page& p = m_Pages[page];
+
+		m_SlowRead[page] = p.type == PageType::MMIO || p.readWatchpoints;
+		m_SlowWrite[page] = p.type != PageType::RAM || p.watched || p.writeWatchpoints || m_Shared[page] || !m_Dirty[page];
+	}
+
+	// The page is about to differ from its snapshot copy and from the
+	// last ClearDirtyPages()
+	void Touch(uint32_t page)
+	{
+		if (m_Shared[page] || !m_Dirty[page]) {
+			m_Shared[page].reset();
+			m_Dirty.set(page);
+			UpdatePage(page);
+		}
+	}
+
+	// A copy of the page that stays as it is, made only if the page was
+	// written since the last one
+	const std::shared_ptr<const PageData>& SharePage(uint32_t page)
+	{
+		if (!m_Shared[page]) {
+			auto copy = std::make_shared<PageData>();
+			memcpy(copy->data(), m_Memory + page * MEMORY_PAGE_SIZE, MEMORY_PAGE_SIZE);
+
+			m_Shared[page] = std::move(copy);
+			UpdatePage(page);
+		}
+
+		return m_Shared[page];
+	}
+
+	// Puts a shared copy back, unless the page still matches it
+	void RestorePage(uint32_t page, const std::shared_ptr<const PageData>& saved)
+	{
+		if (m_Shared[page] == saved || !saved)
+			return;
+
+		uint8_t* base = m_Memory + page * MEMORY_PAGE_SIZE;
+
+		if (m_Pages[page].watched) {
+			for (uint32_t i = 0; i < MEMORY_PAGE_SIZE; i++) {
+				if (base[i] != (*saved)[i]) {
+					base[i] = (*saved)[i];
+					m_Listener->OnWrite(static_cast<uint16_t>(page * MEMORY_PAGE_SIZE + i));
+				}
+			}
+		}
+		else {
+			memcpy(base, saved->data(), MEMORY_PAGE_SIZE);
+		}
+
+		m_Shared[page] = saved;
+		m_Dirty.set(page);
+		UpdatePage(page);
+	}
+
+	// Out of line in Memory.cpp, so Read() and Write() inline to the
+	// flag test and the access alone
+	uint8_t SlowRead(uint16_t addr) const;
+	void SlowWrite(uint16_t addr, uint8_t val);
+
+	// Reads are const, so the hit is mutable
+	void RecordWatchHit(uint16_t addr, uint8_t val, uint8_t access) const
+	{
+		if (!m_HasWatchHit) {
+			m_WatchHit = { addr, val, access };
+			m_HasWatchHit = true;
+		}
+	}
 
 public:
-	uint8_t m_Memory[655356]{};
-};
\ No newline at end of file
+	// Free to read. Writes go through Write() or Load(), or snapshots
+	// sharing the page miss them.
+	uint8_t m_Memory[MEMORY_SIZE]{};
+
+private:
+	// Generated code does the page flag test of Read() and Write() inline
+	friend class Jit;
+
+	bool m_SlowRead[MEMORY_PAGES]{};
+	bool m_SlowWrite[MEMORY_PAGES]{};
+	Page m_Pages[MEMORY_PAGES]{};
+
+	// The snapshot copy each page still matches, if any
+	std::shared_ptr<const PageData> m_Shared[MEMORY_PAGES];
+
+	std::bitset<MEMORY_PAGES> m_Dirty = std::bitset<MEMORY_PAGES>().set();
+
+	std::bitset<MEMORY_SIZE> m_ReadWatchpoints;
+	std::bitset<MEMORY_SIZE> m_WriteWatchpoints;
+	size_t m_WatchpointCount = 0;
+
+	// The banked run, none while m_BankCount is 0
+	uint32_t m_BankFirst = 0;
+	uint32_t m_BankPages = 0;
+	uint32_t m_BankCount = 0;
+	Banks m_Banks;
+
+	mutable WatchHit m_WatchHit{};
+	mutable bool m_HasWatchHit = false;
+
+	WriteListener* m_Listener = nullptr;
+};
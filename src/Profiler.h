@@ -0,0 +1,228 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "i8080.h"
+#include "Memory.h"
+
+// T-states between two samples of the shadow call stack
+#define PROFILE_SAMPLE_CYCLES 1000
+
+// Calls deeper than this are still counted, but share the deepest frame
+#define PROFILE_MAX_DEPTH 256
+
+// Execution counts and T-states per address and per opcode, plus
+// caller to callee counts and a sampled call stack for flame graphs.
+// Attach with i8080::SetProfiler(). The CPU reports each instruction
+// once it has run, with the T-states it actually took.
+//
+// The call stack is a shadow of CALL and RET as they execute, so code
+// that adjusts SP or returns with PCHL can leave it out of step. Each
+// frame is the address a CALL went to, the bottom one is the first
+// address profiled.
+//
+// Stacks are interned: each distinct stack is a node holding its top
+// frame and the id of the stack below it, so a call or return moves the
+// current id and a sample is one increment indexed by it.
+class Profiler
+{
+public:
+	struct Counter {
+		uint64_t count = 0;
+		uint64_t cycles = 0;
+	};
+
+public:
+	Profiler(uint64_t samplePeriod = PROFILE_SAMPLE_CYCLES)
+		: m_SamplePeriod(samplePeriod), m_NextSample(samplePeriod)
+	{
+	}
+
+	void Count(uint16_t pc, uint8_t opcode, uint32_t cycles)
+	{
+		m_PC[pc].count++;
+		m_PC[pc].cycles += cycles;
+		m_Opcode[opcode].count++;
+		m_Opcode[opcode].cycles += cycles;
+
+		m_Cycles += cycles;
+
+		if (m_Stack == 0 || m_Cycles >= m_NextSample) [[unlikely]]
+			Sample(pc);
+	}
+
+	void OnCall(uint16_t target)
+	{
+		uint16_t caller = m_Stack == 0 ? target : m_Frames[m_Stack].pc;
+		m_Edges[(static_cast<uint32_t>(caller) << 16) | target]++;
+
+		if (m_Frames[m_Stack].depth < PROFILE_MAX_DEPTH)
+			m_Stack = Push(m_Stack, target);
+		else
+			m_Overflow++;
+	}
+
+	void OnReturn()
+	{
+		if (m_Overflow > 0)
+			m_Overflow--;
+		else if (m_Frames[m_Stack].depth > 1)
+			m_Stack = m_Frames[m_Stack].parent;
+	}
+
+	const Counter& GetPC(uint16_t pc) const { return m_PC[pc]; }
+	const Counter& GetOpcode(uint8_t opcode) const { return m_Opcode[opcode]; }
+	uint64_t GetCycles() const { return m_Cycles; }
+
+	// One line per distinct sampled stack, root first, as read by
+	// flamegraph.pl and speedscope: "0x0100;0x0234;0x0456 17"
+	bool SaveFolded(const char* path) const
+	{
+		FILE* file = fopen(path, "w");
+		if (!file)
+			return false;
+
+		std::vector<uint16_t> stack;
+
+		for (uint32_t id = 1; id < m_Frames.size(); id++) {
+			if (!m_Frames[id].samples)
+				continue;
+
+			stack.clear();
+			for (uint32_t frame = id; frame != 0; frame = m_Frames[frame].parent)
+				stack.push_back(m_Frames[frame].pc);
+
+			for (size_t i = stack.size(); i > 0; i--)
+				fprintf(file, "%s0x%04X", i < stack.size() ? ";" : "", stack[i - 1]);
+
+			fprintf(file, " %llu\n", (unsigned long long)m_Frames[id].samples);
+		}
+
+		return fclose(file) == 0;
+	}
+
+	// The hottest addresses and opcodes by T-states, and the most frequent
+	// calls. Operands for the disassembly are read from memory as it is now.
+	void PrintReport(FILE* out, const Memory* memory, size_t top) const
+	{
+		const double total = m_Cycles ? static_cast<double>(m_Cycles) : 1.0;
+		char text[32];
+
+		std::vector<uint32_t> order;
+		for (uint32_t pc = 0; pc < 65536; pc++) {
+			if (m_PC[pc].count)
+				order.push_back(pc);
+		}
+		SortByCycles(order, m_PC.data());
+
+		fprintf(out, "%llu T-states profiled\n\nHot addresses:\n", (unsigned long long)m_Cycles);
+		fprintf(out, "  ADDR    %-14s %14s %14s %7s\n", "INSTRUCTION", "COUNT", "T-STATES", "%");
+
+		for (size_t i = 0; i < order.size() && i < top; i++) {
+			uint16_t pc = static_cast<uint16_t>(order[i]);
+			uint8_t opcode = memory->Read(pc);
+			uint16_t operand = memory->Read(pc + 1) | (memory->Read(pc + 2) << 8);
+
+			i8080::Disassemble(opcode, operand, text, sizeof(text));
+
+			fprintf(out, "  0x%04X  %-14s %14llu %14llu %6.2f%%\n", pc, text,
+				(unsigned long long)m_PC[pc].count, (unsigned long long)m_PC[pc].cycles, 100.0 * m_PC[pc].cycles / total);
+		}
+
+		order.clear();
+		for (uint32_t opcode = 0; opcode < 256; opcode++) {
+			if (m_Opcode[opcode].count)
+				order.push_back(opcode);
+		}
+		SortByCycles(order, m_Opcode.data());
+
+		fprintf(out, "\nHot opcodes:\n");
+		fprintf(out, "  OP    %-14s %14s %14s %7s\n", "INSTRUCTION", "COUNT", "T-STATES", "%");
+
+		for (size_t i = 0; i < order.size() && i < top; i++) {
+			uint8_t opcode = static_cast<uint8_t>(order[i]);
+
+			// Operands differ from one use to the next, keep the mnemonic
+			i8080::Disassemble(opcode, 0, text, sizeof(text));
+			if (char* operand = strstr(text, "0x"))
+				operand[-1] = '\0';
+
+			fprintf(out, "  0x%02X  %-14s %14llu %14llu %6.2f%%\n", opcode, text,
+				(unsigned long long)m_Opcode[opcode].count, (unsigned long long)m_Opcode[opcode].cycles, 100.0 * m_Opcode[opcode].cycles / total);
+		}
+
+		std::vector<std::pair<uint32_t, uint64_t>> edges(m_Edges.begin(), m_Edges.end());
+		std::sort(edges.begin(), edges.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+
+		fprintf(out, "\nCalls:\n");
+		fprintf(out, "  CALLER  CALLEE  %14s\n", "COUNT");
+
+		for (size_t i = 0; i < edges.size() && i < top; i++) {
+			fprintf(out, "  0x%04X  0x%04X  %14llu\n", edges[i].first >> 16, edges[i].first & 0xFFFF,
+				(unsigned long long)edges[i].second);
+		}
+	}
+
+private:
+	// One interned stack: pc on top of the stack parent. Id 0 is the empty
+	// stack before the first instruction.
+	struct Frame {
+		uint32_t parent;
+		uint16_t pc;
+		uint16_t depth;
+		uint64_t samples;
+	};
+
+	// Kept out of Count(), so it stays small enough to inline into the
+	// engines. The first address counted is the bottom of the stack.
+	void Sample(uint16_t pc)
+	{
+		if (m_Stack == 0)
+			m_Stack = Push(0, pc);
+
+		while (m_Cycles >= m_NextSample) {
+			m_Frames[m_Stack].samples++;
+			m_NextSample += m_SamplePeriod;
+		}
+	}
+
+	// The id of parent with pc pushed, made on first use
+	uint32_t Push(uint32_t parent, uint16_t pc)
+	{
+		auto [it, added] = m_Children.try_emplace((static_cast<uint64_t>(parent) << 16) | pc, static_cast<uint32_t>(m_Frames.size()));
+
+		if (added)
+			m_Frames.push_back({ parent, pc, static_cast<uint16_t>(m_Frames[parent].depth + 1), 0 });
+
+		return it->second;
+	}
+
+	static void SortByCycles(std::vector<uint32_t>& order, const Counter* counters)
+	{
+		std::sort(order.begin(), order.end(), [counters](uint32_t a, uint32_t b) {
+			return counters[a].cycles > counters[b].cycles;
+		});
+	}
+
+private:
+	std::array<Counter, 65536> m_PC{};
+	std::array<Counter, 256> m_Opcode{};
+	uint64_t m_Cycles = 0;
+
+	// Keyed by caller << 16 | callee, both routine entry addresses
+	std::unordered_map<uint32_t, uint64_t> m_Edges;
+
+	std::vector<Frame> m_Frames{ Frame{} };
+	std::unordered_map<uint64_t, uint32_t> m_Children;		// parent << 16 | pc to id
+	uint32_t m_Stack = 0;
+	size_t m_Overflow = 0;
+
+	uint64_t m_SamplePeriod;
+	uint64_t m_NextSample;
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool of worker threads. Each worker has its own deque:
+// it takes its newest task from the back, and when it runs dry it steals
+// the oldest task from the front of the others'. Tasks submitted from
+// outside the pool are dealt round-robin, those submitted by a task go
+// to its own worker's deque. Uneven tasks even out without a shared
+// queue every worker contends on.
+//
+// Idle workers sleep until a task is submitted. Wait() blocks until every
+// task submitted so far has finished.
+class ThreadPool
+{
+public:
+	using Task = std::function<void()>;
+
+	// Zero threads means one per hardware thread
+	explicit ThreadPool(unsigned threads = 0)
+	{
+		if (threads == 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+
+		for (unsigned i = 0; i < threads; i++)
+			m_Queues.push_back(std::make_unique<Queue>());
+
+		for (unsigned i = 0; i < threads; i++)
+			m_Threads.emplace_back([this, i] { Work(i); });
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_Stopping = true;
+		}
+		m_Wake.notify_all();
+
+		for (std::thread& thread : m_Threads)
+			thread.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned GetThreadCount() const { return static_cast<unsigned>(m_Threads.size()); }
+
+	void Submit(Task task)
+	{
+		const size_t index = s_Pool == this ? s_Worker : m_Next++ % m_Queues.size();
+
+		m_Pending++;
+		m_Queued++;
+
+		{
+			std::lock_guard<std::mutex> lock(m_Queues[index]->mutex);
+			m_Queues[index]->tasks.push_back(std::move(task));
+		}
+
+		// Taken so a worker between its last look and its wait can't miss it
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+		}
+		m_Wake.notify_one();
+	}
+
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		m_Done.wait(lock, [this] { return m_Pending == 0; });
+	}
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	bool Take(size_t self, Task& task)
+	{
+		{
+			Queue& own = *m_Queues[self];
+			std::lock_guard<std::mutex> lock(own.mutex);
+
+			if (!own.tasks.empty()) {
+				task = std::move(own.tasks.back());
+				own.tasks.pop_back();
+				return true;
+			}
+		}
+
+		for (size_t n = 1; n < m_Queues.size(); n++) {
+			Queue& victim = *m_Queues[(self + n) % m_Queues.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+
+			if (!victim.tasks.empty()) {
+				task = std::move(victim.tasks.front());
+				victim.tasks.pop_front();
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void Work(size_t self)
+	{
+		s_Pool = this;
+		s_Worker = self;
+
+		while (1) {
+			Task task;
+
+			if (Take(self, task)) {
+				m_Queued--;
+				task();
+
+				if (--m_Pending == 0) {
+					std::lock_guard<std::mutex> lock(m_Mutex);
+					m_Done.notify_all();
+				}
+				continue;
+			}
+
+			// m_Queued goes up before the task is pushed, so a worker may
+			// wake and find nothing yet, and just looks again
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_Wake.wait(lock, [this] { return m_Stopping || m_Queued > 0; });
+
+			if (m_Stopping && m_Queued == 0)
+				return;
+		}
+	}
+
+private:
+	std::vector<std::unique_ptr<Queue>> m_Queues;
+	std::vector<std::thread> m_Threads;
+
+	std::atomic<size_t> m_Next{ 0 };
+	std::atomic<size_t> m_Pending{ 0 };	// submitted and not yet finished
+	std::atomic<size_t> m_Queued{ 0 };	// submitted and not yet taken
+
+	std::mutex m_Mutex;
+	std::condition_variable m_Wake;
+	std::condition_variable m_Done;
+	bool m_Stopping = false;
+
+	// The pool and deque of the worker running on this thread
+	static inline thread_local ThreadPool* s_Pool = nullptr;
+	static inline thread_local size_t s_Worker = 0;
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+// Instruction tracing is compiled in for debug builds only. Define
+// I8080_TRACE=1 to keep it in other builds as well. With 0 the hooks and
+// the i8080 members behind them are gone entirely.
+#ifndef I8080_TRACE
+	#if _DEBUG
+		#define I8080_TRACE 1
+	#else
+		#define I8080_TRACE 0
+	#endif
+#endif
+
+// Records kept by default, the last 4M instructions
+#define TRACE_DEFAULT_RECORDS (1 << 22)
+
+#define TRACE_FILE_MAGIC "I8080TRC"
+#define TRACE_FILE_VERSION 1
+
+// One executed instruction, captured before it runs
+struct TraceRecord {
+	uint64_t cycles;	// T-states before the instruction
+	uint16_t PC;
+	uint16_t operand;	// immediate byte or word, 0 if there is none
+	uint8_t opcode;
+	uint8_t accumulator;
+	uint8_t flags;
+	uint8_t reserved;
+};
+
+static_assert(sizeof(TraceRecord) == 16, "TraceRecord is part of the trace file format");
+
+// Fixed-size ring of the most recent TraceRecords. There is one writer,
+// the CPU that owns it, and it never waits: Push() stores the record and
+// publishes the new head. Snapshot() may run on any thread and drops the
+// records the writer may have overwritten while they were being copied,
+// including the slot a Push() in progress is writing into.
+class TraceBuffer
+{
+public:
+	TraceBuffer(size_t records = TRACE_DEFAULT_RECORDS)
+	{
+		size_t capacity = 1;
+		while (capacity < records)
+			capacity <<= 1;
+
+		m_Records = std::make_unique<TraceRecord[]>(capacity);
+		m_Mask = capacity - 1;
+	}
+
+	void Push(const TraceRecord& record)
+	{
+		uint64_t head = m_Head.load(std::memory_order_relaxed);
+		m_Records[head & m_Mask] = record;
+		m_Head.store(head + 1, std::memory_order_release);
+	}
+
+	size_t Capacity() const { return m_Mask + 1; }
+
+	// Total pushed since construction, including records since overwritten
+	uint64_t Pushed() const { return m_Head.load(std::memory_order_acquire); }
+
+	// Copies the records still held, oldest first. Once the ring has
+	// wrapped that is at most Capacity() - 1 of them.
+	std::vector<TraceRecord> Snapshot() const
+	{
+		const uint64_t capacity = Capacity();
+
+		uint64_t end = m_Head.load(std::memory_order_acquire);
+		uint64_t begin = end > capacity ? end - capacity : 0;
+
+		std::vector<TraceRecord> records;
+		records.reserve(static_cast<size_t>(end - begin));
+
+		for (uint64_t i = begin; i < end; i++)
+			records.push_back(m_Records[i & m_Mask]);
+
+		// A Push() for head after may be writing over record after - capacity
+		uint64_t after = m_Head.load(std::memory_order_acquire);
+		uint64_t valid = after >= capacity ? after - capacity + 1 : 0;
+
+		if (valid > begin) {
+			size_t stale = static_cast<size_t>(std::min(valid - begin, end - begin));
+			records.erase(records.begin(), records.begin() + stale);
+		}
+
+		return records;
+	}
+
+	// Binary trace file: header, then the records oldest first
+	bool Save(const char* path) const
+	{
+		std::vector<TraceRecord> records = Snapshot();
+
+		FILE* file = fopen(path, "wb");
+		if (!file)
+			return false;
+
+		FileHeader header{};
+		memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+		header.version = TRACE_FILE_VERSION;
+		header.recordSize = sizeof(TraceRecord);
+		header.count = records.size();
+
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+			fwrite(records.data(), sizeof(TraceRecord), records.size(), file) == records.size();
+
+		fclose(file);
+		return ok;
+	}
+
+	static bool Load(const char* path, std::vector<TraceRecord>& records)
+	{
+		FILE* file = fopen(path, "rb");
+		if (!file)
+			return false;
+
+		FileHeader header{};
+		bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+			memcmp(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+			header.version == TRACE_FILE_VERSION &&
+			header.recordSize == sizeof(TraceRecord);
+
+		if (ok) {
+			records.resize(static_cast<size_t>(header.count));
+			ok = fread(records.data(), sizeof(TraceRecord), records.size(), file) == records.size();
+		}
+
+		fclose(file);
+		return ok;
+	}
+
+private:
+	struct FileHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t recordSize;
+		uint64_t count;
+	};
+
+	std::unique_ptr<TraceRecord[]> m_Records;
+	uint64_t m_Mask = 0;
+
+	std::atomic<uint64_t> m_Head{0};
+};
@@ -1,15 +1,17 @@
+#include <cstring>
 #include <fstream>
 #include <vector>
 
 #include "i8080.h"
+#include "AluTables.h"
+#include "BlockCache.h"
+#include "Jit.h"
+#include "Profiler.h"
 
 #define PROGRAM_START 0x100
 
-#if _DEBUG
-	#define DEBUG_PRINT(s, ...) printf(s, __VA_ARGS__)
-#else
-	#define DEBUG_PRINT(s, ...)
-#endif
+// XTHL, the slowest instruction
+#define MAX_INSTRUCTION_CYCLES 18
 
 
 i8080::i8080(Memory* _memory, CPM* CPM)
@@ -28,6 +30,250 @@ i8080::~i8080()
 }
 
 
+i8080::StopReason i8080::Run(uint64_t instructions)
+{
+	if (m_Stop != StopReason::None)
+		return m_Stop;
+
+	if (m_Memory->GetWatchpointCount() > 0) {
+		m_Memory->ClearWatchHit();
+
+		StopReason reason = RunUntil(instructions, [](const i8080& cpu) {
+			return cpu.m_Memory->HasWatchHit() || cpu.m_Breakpoints[cpu.PC];
+		});
+
+		return reason == StopReason::Breakpoint && m_Memory->HasWatchHit() ? StopReason::Watchpoint : reason;
+	}
+
+	if (m_BreakpointCount > 0)
+		return RunUntil(instructions, [](const i8080& cpu) { return cpu.m_Breakpoints[cpu.PC]; });
+
+	if (m_Profiler && m_Engine == Engine::Interpreter)
+		return RunProfiled(instructions);
+
+#if I8080_TRACE
+	// Only Execute<> records, so a traced run stays on the interpreter
+	if (m_Trace)
+		return RunUntil(instructions, [](const i8080&) { return false; });
+#endif
+
+	switch (m_Engine)
+	{
+		case Engine::Threaded:	RunThreaded(instructions);	break;
+		case Engine::Blocks:	RunBlocks(instructions);	break;
+		case Engine::Jit:		RunJit(instructions);		break;
+
+		default:
+			if (m_Fuse) {
+				RunFused(instructions);
+				break;
+			}
+
+			for (uint64_t i = 0; i < instructions; i++) {
+				Cycle();
+
+				if (m_Stop != StopReason::None)
+					break;
+			}
+	}
+
+	return m_Stop != StopReason::None ? m_Stop : StopReason::Budget;
+}
+
+// Interpreter loop with fusion, Cycle() through s_FusedTable
+void i8080::RunFused(uint64_t instructions)
+{
+	for (uint64_t i = 0; i < instructions; ) {
+		uint8_t opcode = LoadByte();
+
+		i += (this->*s_FusedTable[opcode])(instructions - i);
+
+		if (m_Stop != StopReason::None)
+			break;
+	}
+}
+
+// Interpreter loop for a profiled run. The other engines profile on
+// their own and step through ProfiledCycle() where they would Cycle().
+i8080::StopReason i8080::RunProfiled(uint64_t instructions)
+{
+	for (uint64_t i = 0; i < instructions; i++) {
+		ProfiledCycle();
+
+		if (m_Stop != StopReason::None)
+			return m_Stop;
+	}
+
+	return StopReason::Budget;
+}
+
+// Cycle() that reports the instruction to the profiler with the T-states
+// it took, taken branches included
+void i8080::ProfiledCycle()
+{
+	const uint16_t pc = PC;
+	const uint16_t sp = SP;
+	const uint64_t cycles = m_Cycles;
+	const uint8_t opcode = m_Memory->Fetch(pc);
+
+	Cycle();
+
+	m_Profiler->Count(pc, opcode, static_cast<uint32_t>(m_Cycles - cycles));
+	ProfileStack(pc, opcode, sp);
+}
+
+// Follows the instruction at pc, which has run and was counted, on the
+// profiler's call stack. sp is SP before it ran. A CALL or RET was taken
+// when it moved SP. BDOS calls are counted as a call and return.
+void i8080::ProfileStack(uint16_t pc, uint8_t opcode, uint16_t sp)
+{
+	switch (s_GroupTable[opcode])
+	{
+		case OpGroup::CALL: {
+			uint16_t target = m_Memory->Fetch(pc + 1) | (m_Memory->Fetch(pc + 2) << 8);
+
+			if (target == 0x0005) {
+				m_Profiler->OnCall(target);
+				m_Profiler->OnReturn();
+			}
+			else if (SP == uint16_t(sp - 2)) {
+				m_Profiler->OnCall(target);
+			}
+			break;
+		}
+
+		case OpGroup::RET:
+			if (SP == uint16_t(sp + 2))
+				m_Profiler->OnReturn();
+			break;
+
+		default:
+			break;
+	}
+}
+
+// Runs until at least the given number of T-states have gone by. No
+// instruction takes more than MAX_INSTRUCTION_CYCLES, so each Run() gets
+// an instruction budget that can't overshoot, and the last few
+// instructions go one at a time. The overshoot is below one instruction.
+i8080::StopReason i8080::RunCycles(uint64_t cycles)
+{
+	const uint64_t target = m_Cycles + cycles;
+
+	while (m_Cycles < target) {
+		uint64_t instructions = (target - m_Cycles) / MAX_INSTRUCTION_CYCLES;
+		StopReason reason = Run(instructions > 0 ? instructions : 1);
+
+		if (reason != StopReason::Budget)
+			return reason;
+	}
+
+	return StopReason::Budget;
+}
+
+void i8080::SetBreakpoint(uint16_t addr)
+{
+	if (!m_Breakpoints[addr]) {
+		m_Breakpoints[addr] = true;
+		m_BreakpointCount++;
+	}
+}
+
+void i8080::ClearBreakpoint(uint16_t addr)
+{
+	if (m_Breakpoints[addr]) {
+		m_Breakpoints[addr] = false;
+		m_BreakpointCount--;
+	}
+}
+
+void i8080::SetEngine(Engine engine)
+{
+#if !I8080_JIT
+	if (engine == Engine::Jit)
+		engine = Engine::Blocks;
+#endif
+
+	// Both caches listen for writes to code pages, so only one may exist
+	m_BlockCache.reset();
+	m_Jit.reset();
+
+	m_Engine = engine;
+
+	if (engine == Engine::Blocks)
+		m_BlockCache = std::make_unique<BlockCache>(m_Memory);
+#if I8080_JIT
+	else if (engine == Engine::Jit) {
+		m_Jit = std::make_unique<Jit>(this, m_Memory);
+
+		if (!m_Jit->Ready()) {
+			m_Jit.reset();
+			m_Engine = Engine::Blocks;
+			m_BlockCache = std::make_unique<BlockCache>(m_Memory);
+		}
+	}
+#endif
+}
+
+i8080::MachineSnapshot i8080::Snapshot()
+{
+	MachineSnapshot snapshot;
+
+	snapshot.registers = registers;
+	snapshot.cpuFlags = m_flags;
+	snapshot.PC = PC;
+	snapshot.SP = SP;
+	snapshot.cycles = m_Cycles;
+	snapshot.stop = m_Stop;
+	snapshot.fault = m_Fault;
+	snapshot.memory = m_Memory->TakeSnapshot();
+	snapshot.cpm = m_CPM->GetState();
+
+	return snapshot;
+}
+
+void i8080::Restore(const MachineSnapshot& snapshot)
+{
+	registers = snapshot.registers;
+	m_flags = snapshot.cpuFlags;
+	PC = snapshot.PC;
+	SP = snapshot.SP;
+	m_Cycles = snapshot.cycles;
+	m_Stop = snapshot.stop;
+	m_Fault = snapshot.fault;
+	m_Memory->Restore(snapshot.memory);
+	m_CPM->SetState(snapshot.cpm);
+}
+
+i8080::State i8080::GetState() const
+{
+	State state;
+
+	for (uint8_t i = 0; i < 8; i++)
+		state.registers[i] = registers[i];
+	state.flags = m_flags.get();
+	state.PC = PC;
+	state.SP = SP;
+	state.cycles = m_Cycles;
+	state.stop = m_Stop;
+	state.fault = m_Fault;
+
+	return state;
+}
+
+void i8080::SetState(const State& state)
+{
+	for (uint8_t i = 0; i < 8; i++)
+		registers[i] = state.registers[i];
+	m_flags.set(state.flags);
+	PC = state.PC;
+	SP = state.SP;
+	m_Cycles = state.cycles;
+	m_Stop = state.stop;
+	m_Fault = state.fault;
+}
+
+
 ///////////////////////////////////
 //////////////UTILS///////////////
 /////////////////////////////////
@@ -47,85 +293,146 @@ static char GetRegisterFromIndex(uint8_t index)
 		case 0x6: return 'M';
 	}
 
-	fprintf(stderr, "Invalid register access 0x%02X", index);
-	exit(1);
+	// The index is three bits, this is never reached
+	return '?';
 }
 
-
-uint16_t i8080::add(const uint8_t v1, const uint8_t v2)
+static const char* GetRegisterPairName(uint8_t rpIdx, bool psw)
 {
-	uint16_t res = v1 + v2;
-	
-	setZSP(res);
-	m_flags.setCY((res >> 8) & 0x1);
-	m_flags.setAC(((v1 ^ v2 ^ res) & 0x10) >> 4);
+	static const char* names[] = { "B", "D", "H", "SP" };
 
-	return res;
+	return rpIdx == 0x3 && psw ? "PSW" : names[rpIdx];
 }
 
-uint16_t i8080::subtract(const uint8_t v1, const uint8_t v2)
+// Condition suffix by the cc field (opcode bits 3-5)
+static const char* GetConditionName(uint8_t code)
 {
-	uint8_t tc = (~v2) + 1;
-	uint16_t res = v1 + tc;
-
-	setZSP(res);
-	m_flags.setCY(!((res >> 8) & 0x1));
-	m_flags.setAC(((v1 ^ v2 ^ res) & 0x10) >> 4);
+	static const char* names[] = { "NZ", "Z", "NC", "C", "PO", "PE", "P", "M" };
 
-	return res;
+	return names[code];
 }
 
-uint8_t i8080::compare(const uint8_t value)
+// Names follow the decoding Operate<> uses, so opcodes the 8080 leaves
+// undocumented come out as whatever the CPU actually runs for them.
+void i8080::Disassemble(uint8_t opcode, uint16_t operand, char* out, size_t size)
 {
-	uint8_t tc = (~value) + 1;
-	uint16_t res = registers[A] + tc;
+	static const char* rotates[] = { "RLC", "RRC", "RAL", "RAR" };
+	static const char* direct[] = { "SHLD", "LHLD", "STA", "LDA" };
+	static const char* immediates[] = { "ADI", "ACI", "SUI", "SBI", "ANI", "XRI", "ORI", "CPI" };
+	static const char* accumulator[] = { "ADD", "ADC", "SUB", "SBB", "ANA", "XRA", "ORA", "CMP" };
 
-	if (value < registers[A]) {
-		m_flags.setCY(((res >> 8) & 0x1));
-	}
-	else {
-		m_flags.setCY(!((res >> 8) & 0x1));
-	}
+	const uint8_t dst = (opcode & 0x38) >> 3;
+	const uint8_t src = opcode & 0x7;
+	const uint8_t rp = (opcode & 0x30) >> 4;
 
-	setZSP(res);
-	setACF(registers[A], value, res);
+	// Unconditional forms share the cc field with JNZ, CZ and RZ
+	const bool always = opcode & 0x1;
 
-	return res;
+	switch (s_GroupTable[opcode])
+	{
+		case OpGroup::NOP:		snprintf(out, size, "NOP");		break;
+		case OpGroup::HLT:		snprintf(out, size, "HLT");		break;
+		case OpGroup::CMA:		snprintf(out, size, "CMA");		break;
+		case OpGroup::DAA:		snprintf(out, size, "DAA");		break;
+		case OpGroup::STC:		snprintf(out, size, "STC");		break;
+		case OpGroup::CMC:		snprintf(out, size, "CMC");		break;
+		case OpGroup::PCHL:		snprintf(out, size, "PCHL");	break;
+		case OpGroup::XTHL:		snprintf(out, size, "XTHL");	break;
+		case OpGroup::XCHG:		snprintf(out, size, "XCHG");	break;
+		case OpGroup::SPHL:		snprintf(out, size, "SPHL");	break;
+
+		case OpGroup::INR:	snprintf(out, size, "INR %c", GetRegisterFromIndex(dst));							break;
+		case OpGroup::DCR:	snprintf(out, size, "DCR %c", GetRegisterFromIndex(dst));							break;
+		case OpGroup::INX:	snprintf(out, size, "INX %s", GetRegisterPairName(rp, false));						break;
+		case OpGroup::DCX:	snprintf(out, size, "DCX %s", GetRegisterPairName(rp, false));						break;
+		case OpGroup::DAD:	snprintf(out, size, "DAD %s", GetRegisterPairName(rp, false));						break;
+		case OpGroup::PUSH:	snprintf(out, size, "PUSH %s", GetRegisterPairName(rp, true));						break;
+		case OpGroup::POP:	snprintf(out, size, "POP %s", GetRegisterPairName(rp, true));						break;
+		case OpGroup::MOV:	snprintf(out, size, "MOV %c,%c", GetRegisterFromIndex(dst), GetRegisterFromIndex(src));	break;
+		case OpGroup::LXI:	snprintf(out, size, "LXI %s,0x%04X", GetRegisterPairName(rp, false), operand);		break;
+		case OpGroup::MVI:	snprintf(out, size, "MVI %c,0x%02X", GetRegisterFromIndex(dst), operand & 0xFF);			break;
+
+		case OpGroup::RotateAcc:		snprintf(out, size, "%s", rotates[(opcode & 0x18) >> 3]);						break;
+		case OpGroup::AccTransfer:		snprintf(out, size, "%s %s", (opcode & 0x8) ? "LDAX" : "STAX", GetRegisterPairName(rp, false));	break;
+		case OpGroup::DirectAddressing:	snprintf(out, size, "%s 0x%04X", direct[(opcode & 0x18) >> 3], operand);		break;
+		case OpGroup::Immediate:		snprintf(out, size, "%s 0x%02X", immediates[dst], operand & 0xFF);						break;
+		case OpGroup::RegisterToAcc:	snprintf(out, size, "%s %c", accumulator[dst], GetRegisterFromIndex(src));		break;
+
+		case OpGroup::JMP:
+			if (dst == 0x0 && always)
+				snprintf(out, size, "JMP 0x%04X", operand);
+			else
+				snprintf(out, size, "J%s 0x%04X", GetConditionName(dst), operand);
+			break;
+
+		case OpGroup::CALL:
+			if (dst == 0x1 && always)
+				snprintf(out, size, "CALL 0x%04X", operand);
+			else
+				snprintf(out, size, "C%s 0x%04X", GetConditionName(dst), operand);
+			break;
+
+		case OpGroup::RET:
+			if (dst == 0x1 && always)
+				snprintf(out, size, "RET");
+			else
+				snprintf(out, size, "R%s", GetConditionName(dst));
+			break;
+
+		default:
+			snprintf(out, size, "DB 0x%02X", opcode);
+	}
 }
 
-void i8080::setACF(uint8_t v1, uint8_t v2, uint8_t v3)
+
+void i8080::flags::materialize() const
 {
-	uint8_t res = ((v1 ^ v2 ^ v3) & 0x1) >> 4;
-	m_flags.setAC(res);
+	uint8_t f;
+
+	switch (lazyOp) {
+		case LazyOp::Add:		f = AluTables::Add[AluTables::Index(lazyCarry, lazyV1, lazyV2)];		break;
+		case LazyOp::Subtract:	f = AluTables::Subtract[AluTables::Index(lazyCarry, lazyV1, lazyV2)];	break;
+		case LazyOp::Logic:		f = AluTables::ZSP[lazyV1];												break;
+		default:				f = reg;																break;
+	}
+
+	reg = (reg & ~pending) | (f & pending);
+	pending = 0;
 }
 
-void i8080::setZSP(const uint8_t value)
+uint8_t i8080::flags::daa(const uint8_t acc)
 {
-	m_flags.setZ(value == 0x00);
-	m_flags.setS((value >> 7) & 0x1);
-	
-	uint8_t count = 0;
+	uint8_t accLo = acc & 0x0F;
+	uint8_t accHi = acc >> 4;
+	uint8_t carry = cy();
+	uint8_t correction = 0;
+
+	if ((accLo > 0x9) || ac() == 0x1)
+		correction |= 0x06;
 
-	for (uint8_t i{ 0 }; i < 8; i++) {
-		count += (value >> i);
+	if ((accHi > 0x9) || carry == 0x1 || (accHi >= 0x9 && accLo > 0x9)) {
+		correction |= 0x60;
+		carry = 1;
 	}
 
-	m_flags.setP(count % 2 == 0);
+	// Flags as for ADD, except that CY is only ever set, never cleared.
+	uint8_t res = add(acc, correction);
+	setCY(carry);
+
+	return res;
 }
 
 uint8_t i8080::LoadByte()
 {
-	return m_Memory->Read(PC++);
+	return m_Memory->Fetch(PC++);
 }
 
 uint16_t i8080::LoadWord()
 {
-	return m_Memory->Read(PC++) | (m_Memory->Read(PC++) << 8);
-}
+	uint8_t lo = m_Memory->Fetch(PC++);
+	uint8_t hi = m_Memory->Fetch(PC++);
 
-uint16_t i8080::LoadRegisterPair(uint8_t rhIdx, uint8_t rlIdx)
-{
-	return (registers[rhIdx] << 8) | registers[rlIdx];
+	return lo | (hi << 8);
 }
 
 
@@ -134,314 +441,440 @@ uint16_t i8080::LoadRegisterPair(uint8_t rhIdx, uint8_t rlIdx)
 /////////////////////////////////
 void i8080::Cycle()
 {
-	DEBUG_PRINT("0x%04X - ", PC);
-
 	uint8_t opcode = LoadByte();
 
-	DEBUG_PRINT("0x%02X ", opcode);
+	(this->*s_DispatchTable[opcode])();
+}
 
+// Opcode groups are matched in the same order the old cascaded
+// mask tests in Cycle() used, so every opcode keeps its handler.
+constexpr i8080::OpGroup i8080::Decode(uint8_t opcode)
+{
 	switch (opcode)
 	{
-		case 0x00: DEBUG_PRINT("NOOP\n");	break;
+		case 0x00: return OpGroup::NOP;
+		// Would be MOV M,M in the MOV block
+		case 0x76: return OpGroup::HLT;
 
-		case 0x2F: CMA();	break;
+		case 0x2F: return OpGroup::CMA;
 
-		case 0x27: DAA();	break;
-		case 0x37: STC();	break;
-		case 0x3F: CMC();	break;
+		case 0x27: return OpGroup::DAA;
+		case 0x37: return OpGroup::STC;
+		case 0x3F: return OpGroup::CMC;
 
-		case 0xE9: PCHL();  break;
+		case 0xE9: return OpGroup::PCHL;
 
-		case 0xE3: XTHL();	break;
-		case 0xEB: XCHG();	break;
-		case 0xF9: SPHL();	break;
+		case 0xE3: return OpGroup::XTHL;
+		case 0xEB: return OpGroup::XCHG;
+		case 0xF9: return OpGroup::SPHL;
+	}
 
-		default: {
-			if (((opcode ^ 0xFB) & 0xC7) == 0xC7) {
-				INR(opcode);
-				return;
-			}
+	if (((opcode ^ 0xFB) & 0xC7) == 0xC7) return OpGroup::INR;
+	if (((opcode ^ 0xFC) & 0xCF) == 0xCF) return OpGroup::INX;
+	if (((opcode ^ 0xF4) & 0xCF) == 0xCF) return OpGroup::DCX;
+	if (((opcode ^ 0xFA) & 0xC7) == 0xC7) return OpGroup::DCR;
+	if (((opcode ^ 0xBF) & 0xC0) == 0xC0) return OpGroup::MOV;
+	if (((opcode ^ 0xF6) & 0xCF) == 0xCF) return OpGroup::DAD;
+	if (((opcode ^ 0xFE) & 0xCF) == 0xCF) return OpGroup::LXI;
+	if (((opcode ^ 0xF9) & 0xC7) == 0xC7) return OpGroup::MVI;
+	if (((opcode ^ 0xF8) & 0xE7) == 0xE7) return OpGroup::RotateAcc;
+	// LDAX/STAX
+	if (((opcode ^ 0xFD) & 0xE7) == 0xE7) return OpGroup::AccTransfer;
+	if (((opcode ^ 0xDD) & 0xE7) == 0xE7) return OpGroup::DirectAddressing;
+	if (((opcode ^ 0x39) & 0xC7) == 0xC7) return OpGroup::Immediate;
+	if (((opcode ^ 0x7F) & 0xC0) == 0xC0) return OpGroup::RegisterToAcc;
+	if (((opcode ^ 0x3A) & 0xCF) == 0xCF) return OpGroup::PUSH;
+	if (((opcode ^ 0x3E) & 0xCF) == 0xCF) return OpGroup::POP;
+	if (((opcode ^ 0x3D) & 0xC6) == 0xC6) return OpGroup::JMP;
+	if (((opcode ^ 0x3B) & 0xC6) == 0xC6) return OpGroup::CALL;
+	if (((opcode ^ 0x3F) & 0xC6) == 0xC6) return OpGroup::RET;
+
+	return OpGroup::Invalid;
+}
+
+constexpr uint8_t i8080::InstructionLength(OpGroup group)
+{
+	switch (group)
+	{
+		case OpGroup::MVI:
+		case OpGroup::Immediate:
+			return 2;
 
-			if (((opcode ^ 0xFC) & 0xCF) == 0xCF) {
-				INX(opcode);
-				return;
-			}
+		case OpGroup::LXI:
+		case OpGroup::DirectAddressing:
+		case OpGroup::JMP:
+		case OpGroup::CALL:
+			return 3;
 
-			if (((opcode ^ 0xF4) & 0xCF) == 0xCF) {
-				DCX(opcode);
-				return;
-			}
+		default:
+			return 1;
+	}
+}
 
-			if (((opcode ^ 0xFA) & 0xC7) == 0xC7) {
-				DCR(opcode);
-				return;
-			}
+// T-states per opcode. Conditional CALL and RET are listed with their
+// not-taken cost, BRANCH_TAKEN_CYCLES is added when they are taken.
+constexpr uint8_t i8080::InstructionCycles(uint8_t opcode)
+{
+	const uint8_t dst = (opcode & 0x38) >> 3;
+	const uint8_t src = opcode & 0x7;
 
-			if (((opcode ^ 0xBF) & 0xC0) == 0xC0) {
-				MOV(opcode);
-				return;
-			}
+	switch (Decode(opcode))
+	{
+		case OpGroup::HLT:				return 7;
+		case OpGroup::PCHL:				return 5;
+		case OpGroup::SPHL:				return 5;
+		case OpGroup::XTHL:				return 18;
+		case OpGroup::INX:				return 5;
+		case OpGroup::DCX:				return 5;
+		case OpGroup::DAD:				return 10;
+		case OpGroup::LXI:				return 10;
+		case OpGroup::AccTransfer:		return 7;
+		case OpGroup::Immediate:		return 7;
+		case OpGroup::PUSH:				return 11;
+		case OpGroup::POP:				return 10;
+		case OpGroup::JMP:				return 10;
+
+		case OpGroup::INR:
+		case OpGroup::DCR:				return dst == MEMORY_REF ? 10 : 5;
+		case OpGroup::MVI:				return dst == MEMORY_REF ? 10 : 7;
+		case OpGroup::MOV:				return dst == MEMORY_REF || src == MEMORY_REF ? 7 : 5;
+		case OpGroup::RegisterToAcc:	return src == MEMORY_REF ? 7 : 4;
+
+		// SHLD/LHLD, STA/LDA
+		case OpGroup::DirectAddressing:	return (opcode & 0x10) ? 13 : 16;
+
+		case OpGroup::CALL:				return opcode == 0xCD ? 17 : 11;
+		case OpGroup::RET:				return opcode == 0xC9 ? 10 : 5;
+
+		// NOP, CMA, DAA, STC, CMC, XCHG, rotates
+		default:						return 4;
+	}
+}
 
-			if (((opcode ^ 0xF6) & 0xCF) == 0xCF) {
-				DAD(opcode);
-				return;
-			}
+template<uint8_t OP>
+void i8080::Execute()
+{
+	constexpr uint8_t length = InstructionLength(Decode(OP));
 
-			if (((opcode ^ 0xFE) & 0xCF) == 0xCF) {
-				LXI(opcode);
-				return;
-			}
+	uint16_t operand{};
 
-			if (((opcode ^ 0xF9) & 0xC7) == 0xC7) {
-				MVI(opcode);
-				return;
-			}
+	if constexpr (length == 2)
+		operand = LoadByte();
+	else if constexpr (length == 3)
+		operand = LoadWord();
 
-			if (((opcode ^ 0xF8) & 0xE7) == 0xE7) {
-				ProcessRotateAcc(opcode);
-				return;
-			}
+#if I8080_TRACE
+	if (m_Trace)
+		m_Trace->Push({ m_Cycles, uint16_t(PC - length), operand, OP, registers[A], m_flags.get(), 0 });
+#endif
 
-			// LDAX/STAX
-			if (((opcode ^ 0xFD) & 0xE7) == 0xE7) {
-				ProcessAccTransfer(opcode);
-				return;
-			}
+	m_Cycles += InstructionCycles(OP);
 
-			if (((opcode ^ 0xDD) & 0xE7) == 0xE7) {
-				ProcessDirectAddressing(opcode);
-				return;
-			}
+	Operate<OP>(operand);
+}
 
-			if (((opcode ^ 0x39) & 0xC7) == 0xC7) {
-				ProcessImmediate(opcode);
-				return;
-			}
+// The instruction fused onto the opcode, -1 for none. Counted loops,
+// scans and copies through HL, copies through LDAX/STAX and compare and
+// branch. No first instruction here can stop the CPU, and the partner
+// is fetched after it ran, so stores into the pair are seen as usual.
+constexpr int i8080::FusedPartner(uint8_t opcode)
+{
+	switch (opcode)
+	{
+		// DCR r; JNZ
+		case 0x05: case 0x0D: case 0x15: case 0x1D:
+		case 0x25: case 0x2D: case 0x3D:
+			return 0xC2;
+
+		case 0x23: return 0x7E;		// INX H; MOV A,M
+		case 0x77: return 0x23;		// MOV M,A; INX H
+		case 0x1A: return 0x02;		// LDAX D; STAX B
+		case 0x0A: return 0x12;		// LDAX B; STAX D
+		case 0xFE: return 0xCA;		// CPI; JZ
+
+		default: return -1;
+	}
+}
 
-			if (((opcode ^ 0x7F) & 0xC0) == 0xC0) {
-				ProcessRegisterToAcc(opcode);
-				return;
-			}
+template<uint8_t OP>
+uint32_t i8080::ExecuteFused(uint64_t budget)
+{
+	constexpr int partner = FusedPartner(OP);
 
-			if (((opcode ^ 0x3A) & 0xCF) == 0xCF) {
-				ProcessPUSH(opcode);
-				return;
-			}
+	Execute<OP>();
 
-			if (((opcode ^ 0x3E) & 0xCF) == 0xCF) {
-				ProcessPOP(opcode);
-				return;
-			}
+	if constexpr (partner >= 0) {
+		if (budget > 1 && m_Memory->Fetch(PC) == partner) {
+			PC++;
+			Execute<partner>();
+			return 2;
+		}
+	}
 
-			if (((opcode ^ 0x3D) & 0xC6) == 0xC6) {
-				ProcessJMP(opcode);
-				return;
-			}
+	return 1;
+}
 
-			if (((opcode ^ 0x3B) & 0xC6) == 0xC6) {
-				ProcessCALL(opcode);
-				return;
-			}
+template<uint8_t OP>
+void i8080::Operate(uint16_t operand)
+{
+	constexpr OpGroup group = Decode(OP);
 
-			if (((opcode ^ 0x3F) & 0xC6) == 0xC6) {
-				ProcessRET(opcode);
-				return;
-			}
+	constexpr uint8_t dst = (OP & 0x38) >> 3;
+	constexpr uint8_t src = OP & 0x7;
+	constexpr uint8_t rp  = (OP & 0x30) >> 4;
 
-			fprintf(stderr, "INVALID OPERATION\nExiting...\n");
-			exit(1);
-		}
-	}
+	if constexpr (group == OpGroup::NOP)					NOP();
+	else if constexpr (group == OpGroup::HLT)				HLT();
+	else if constexpr (group == OpGroup::CMA)				CMA();
+	else if constexpr (group == OpGroup::DAA)				DAA();
+	else if constexpr (group == OpGroup::STC)				STC();
+	else if constexpr (group == OpGroup::CMC)				CMC();
+	else if constexpr (group == OpGroup::PCHL)				PCHL();
+	else if constexpr (group == OpGroup::XTHL)				XTHL();
+	else if constexpr (group == OpGroup::XCHG)				XCHG();
+	else if constexpr (group == OpGroup::SPHL)				SPHL();
+	else if constexpr (group == OpGroup::INR)				INR<dst>();
+	else if constexpr (group == OpGroup::INX)				INX<rp>();
+	else if constexpr (group == OpGroup::DCX)				DCX<rp>();
+	else if constexpr (group == OpGroup::DCR)				DCR<dst>();
+	else if constexpr (group == OpGroup::MOV)				MOV<dst, src>();
+	else if constexpr (group == OpGroup::DAD)				DAD<rp>();
+	else if constexpr (group == OpGroup::LXI)				LXI<rp>(operand);
+	else if constexpr (group == OpGroup::MVI)				MVI<dst>(operand);
+	else if constexpr (group == OpGroup::RotateAcc)			ProcessRotateAcc(OP);
+	else if constexpr (group == OpGroup::AccTransfer)		ProcessAccTransfer(OP);
+	else if constexpr (group == OpGroup::DirectAddressing)	ProcessDirectAddressing(OP, operand);
+	else if constexpr (group == OpGroup::Immediate)			ProcessImmediate(OP, operand);
+	else if constexpr (group == OpGroup::RegisterToAcc)		ProcessRegisterToAcc<OP>();
+	else if constexpr (group == OpGroup::PUSH)				ProcessPUSH(OP);
+	else if constexpr (group == OpGroup::POP)				ProcessPOP(OP);
+	else if constexpr (group == OpGroup::JMP)				ProcessJMP(OP, operand);
+	else if constexpr (group == OpGroup::CALL)				ProcessCALL(OP, operand);
+	else if constexpr (group == OpGroup::RET)				ProcessRET(OP);
+	else													Invalid();
+}
 
+template<size_t... OPS>
+constexpr std::array<i8080::OpHandler, 256> i8080::BuildDispatchTable(std::index_sequence<OPS...>)
+{
+	return { &i8080::Execute<OPS>... };
+}
+
+template<size_t... OPS>
+constexpr std::array<i8080::FusedHandler, 256> i8080::BuildFusedTable(std::index_sequence<OPS...>)
+{
+	return { &i8080::ExecuteFused<OPS>... };
+}
+
+template<size_t... OPS>
+constexpr std::array<i8080::OperandHandler, 256> i8080::BuildOperandTable(std::index_sequence<OPS...>)
+{
+	return { &i8080::Operate<OPS>... };
+}
+
+template<size_t... OPS>
+constexpr std::array<uint8_t, 256> i8080::BuildLengthTable(std::index_sequence<OPS...>)
+{
+	return { InstructionLength(Decode(OPS))... };
+}
+
+template<size_t... OPS>
+constexpr std::array<uint8_t, 256> i8080::BuildCycleTable(std::index_sequence<OPS...>)
+{
+	return { InstructionCycles(OPS)... };
+}
+
+template<size_t... OPS>
+constexpr std::array<i8080::OpGroup, 256> i8080::BuildGroupTable(std::index_sequence<OPS...>)
+{
+	return { Decode(OPS)... };
+}
+
+template<size_t... OPS>
+constexpr std::array<i8080::JitHandler, 256> i8080::BuildJitTable(std::index_sequence<OPS...>)
+{
+	return { &i8080::JitOperate<OPS>... };
+}
+
+const std::array<i8080::OpHandler, 256> i8080::s_DispatchTable = i8080::BuildDispatchTable(std::make_index_sequence<256>());
+const std::array<i8080::OperandHandler, 256> i8080::s_OperandTable = i8080::BuildOperandTable(std::make_index_sequence<256>());
+const std::array<uint8_t, 256> i8080::s_LengthTable = i8080::BuildLengthTable(std::make_index_sequence<256>());
+const std::array<uint8_t, 256> i8080::s_CycleTable = i8080::BuildCycleTable(std::make_index_sequence<256>());
+const std::array<i8080::OpGroup, 256> i8080::s_GroupTable = i8080::BuildGroupTable(std::make_index_sequence<256>());
+const std::array<i8080::JitHandler, 256> i8080::s_JitTable = i8080::BuildJitTable(std::make_index_sequence<256>());
+const std::array<i8080::FusedHandler, 256> i8080::s_FusedTable = i8080::BuildFusedTable(std::make_index_sequence<256>());
+
+// Stops this CPU only, the host and any other machines carry on
+void i8080::Invalid()
+{
+	const uint16_t pc = static_cast<uint16_t>(PC - 1);
+
+	m_Fault = { Fault::Kind::Opcode, m_Memory->Fetch(pc), pc };
+	m_Stop = StopReason::Error;
 }
 
 
 ///////////////////////////////////////
 //////////////OPERATIONS//////////////
 /////////////////////////////////////
-void i8080::RET(bool cond)
+void i8080::RET(bool cond, uint8_t takenCycles)
 {
 	if (cond) {
-		uint16_t addr = m_Memory->Read(SP++) | (m_Memory->Read(SP++) << 8);
-		PC = addr;
+		m_Cycles += takenCycles;
 
-		DEBUG_PRINT(" 0x%04X\n", addr);
-		return;
+		uint8_t lo = m_Memory->Read(SP++);
+		uint8_t hi = m_Memory->Read(SP++);
+
+		uint16_t addr = lo | (hi << 8);
+		PC = addr;
 	}
 
-	DEBUG_PRINT(" -- NO RET\n");
+#if I8080_COVERAGE
+	CoverEdge(PC);
+#endif
 }
 
-void i8080::JMP(bool cond)
+void i8080::JMP(bool cond, uint16_t addr)
 {
-	uint16_t addr = LoadWord();
-
 	if (cond) {
-		DEBUG_PRINT(" 0x%04X\n", addr);
-
 		if (addr == 0x0) {
 			m_CPM->WBOOT();
+			m_Stop = StopReason::Exit;
 		}
 
 		PC = addr;
-		return;
 	}
 
-	DEBUG_PRINT(" -- NO JMP\n");
+#if I8080_COVERAGE
+	CoverEdge(PC);
+#endif
 }
 
-void i8080::CALL(bool cond)
+void i8080::CALL(bool cond, uint16_t addr, uint8_t takenCycles)
 {
-	uint16_t addr = LoadWord();
-
 	// Make CPM BDOS function call
 	// C = Function code
 	// DE = data address
 	if (addr == 0x0005) {
-		DEBUG_PRINT(" 0x%04X\n", addr);
+		uint8_t result;
+		if (m_CPM->Call(registers[C], registers.pairs[DE], result)) {
+			registers[A] = result;
+			registers[L] = result;
+		}
 
-		m_CPM->Call(registers[C],
-					LoadRegisterPair(D, E));
+		if (m_CPM->Exited()) {
+			m_Stop = StopReason::Exit;
+		}
+		else if (m_CPM->Failed()) {
+			m_Fault = { Fault::Kind::BDOS, registers[C], static_cast<uint16_t>(PC - 3) };
+			m_Stop = StopReason::Error;
+		}
 		return;
 	}
 
 	if (cond) {
+		m_Cycles += takenCycles;
+
 		m_Memory->Write(--SP, (PC & 0xFF00) >> 8);
 		m_Memory->Write(--SP, PC & 0x00FF);
 
 		PC = addr;
-
-		DEBUG_PRINT(" PC -> 0x%04X\n", PC);
-		return;
 	}
 
-	DEBUG_PRINT(" -- NO CALL\n");
+#if I8080_COVERAGE
+	CoverEdge(PC);
+#endif
 }
 
 void i8080::PCHL()
 {
-	PC = LoadRegisterPair(H, L);
+	PC = registers.pairs[HL];
 
-	DEBUG_PRINT("PCHL PC -> 0x%04X\n", PC);
+#if I8080_COVERAGE
+	CoverEdge(PC);
+#endif
 }
 
-void i8080::POP(uint8_t rhIdx, uint8_t rlIdx)
+void i8080::POP(uint8_t rpIdx)
 {
-	registers[rlIdx] = m_Memory->Read(SP++);
-	registers[rhIdx] = m_Memory->Read(SP++);
+	uint8_t lo = m_Memory->Read(SP++);
+	uint8_t hi = m_Memory->Read(SP++);
 
-	DEBUG_PRINT("POP 0x%02X(%c), 0x%02X(%c)\n",
-		registers[rhIdx], GetRegisterFromIndex(rhIdx),
-		registers[rlIdx], GetRegisterFromIndex(rlIdx));
+	registers.pairs[rpIdx] = lo | (hi << 8);
 }
 
 void i8080::POP_PSW()
 {
 	uint8_t data = m_Memory->Read(SP);
 
-	m_flags.reg = data;
+	m_flags.set(data);
 
 	registers[A] = m_Memory->Read(++SP);
 	SP++;
-
-	DEBUG_PRINT("POP PSW\n\tFLAGS = 0x%02X\n\tA = 0x%02X\n", data, m_Memory->Read(SP-2));
 }
 
-void i8080::PUSH(uint8_t rhIdx, uint8_t rlIdx)
+void i8080::PUSH(uint8_t rpIdx)
 {
-	m_Memory->Write(--SP, registers[rhIdx]);
-	m_Memory->Write(--SP, registers[rlIdx]);
+	uint16_t data = registers.pairs[rpIdx];
 
-	DEBUG_PRINT("PUSH - 0x%02X(%c), 0x%02X(%c)\n",
-		registers[rhIdx], GetRegisterFromIndex(rhIdx),
-		registers[rlIdx], GetRegisterFromIndex(rlIdx));
+	m_Memory->Write(--SP, data >> 8);
+	m_Memory->Write(--SP, data & 0xFF);
 }
 
 void i8080::PUSH_PSW()
 {
 	m_Memory->Write(--SP, registers[A]);
-	m_Memory->Write(--SP, m_flags.reg);
+	m_Memory->Write(--SP, m_flags.get());
+}
+
+void i8080::NOP()
+{
+}
 
-	DEBUG_PRINT("PUSH_PSW\n");
+// There are no interrupts to resume from, so HLT stops the CPU for good
+void i8080::HLT()
+{
+	m_Stop = StopReason::Halted;
 }
 
 void i8080::STC()
 {
 	m_flags.setCY(0x1);
-	DEBUG_PRINT("STC\n");
 }
 
 void i8080::CMC()
 {
 	uint8_t val = !m_flags.cy();
 	m_flags.setCY(val);
-
-	DEBUG_PRINT("CMC cy = %d\n", val);
 }
 
-void i8080::MVI(uint8_t opcode)
+template<uint8_t REG>
+void i8080::MVI(uint8_t byte)
 {
-	uint8_t regIdx = (opcode & 0x38) >> 3;
-
-	uint8_t byte = LoadByte();
-
-	if (regIdx == MEMORY_REF)
-		m_Memory->Write(LoadRegisterPair(H, L), byte);
+	if constexpr (REG == MEMORY_REF)
+		m_Memory->Write(registers.pairs[HL], byte);
 	else
-		registers[regIdx] = byte;
-
-	DEBUG_PRINT("MVI 0x%02X -> %c\n", byte, GetRegisterFromIndex(regIdx));
+		registers[REG] = byte;
 }
 
-void i8080::MOV(uint8_t opcode)
+template<uint8_t DST, uint8_t SRC>
+void i8080::MOV()
 {
-	uint8_t dstIndex = (opcode & 0x38) >> 3;
-	uint8_t srcIndex = opcode & 0x7;
-
-	if (dstIndex == MEMORY_REF) {
-		uint16_t addr = LoadRegisterPair(H, L);
-		m_Memory->Write(addr, registers[srcIndex]);
-
-		DEBUG_PRINT("MOV 0x%02X(%c) -> 0x%04X(M)\n",
-			registers[srcIndex], GetRegisterFromIndex(srcIndex), addr);
-
-		return;
+	if constexpr (DST == MEMORY_REF) {
+		m_Memory->Write(registers.pairs[HL], registers[SRC]);
 	}
-	else if (srcIndex == MEMORY_REF) {
-		uint16_t addr = LoadRegisterPair(H, L);
-		uint8_t byte = m_Memory->Read(addr);
-		registers[dstIndex] = byte;
-
-		DEBUG_PRINT("MOV 0x%02X(M) -> %c\n",
-			byte, GetRegisterFromIndex(dstIndex));
-
-		return;
+	else if constexpr (SRC == MEMORY_REF) {
+		registers[DST] = m_Memory->Read(registers.pairs[HL]);
+	}
+	else {
+		registers[DST] = registers[SRC];
 	}
-
-	uint8_t dstReg = registers[dstIndex];
-	uint8_t srcReg = registers[srcIndex];
-
-	registers[dstIndex] = registers[srcIndex];
-
-	DEBUG_PRINT("MOV 0x%02X(%c) -> 0x%02X(%c)\n",
-		srcReg, GetRegisterFromIndex(srcIndex),
-		dstReg, GetRegisterFromIndex(dstIndex));
 }
 
 // Exchange HL with DE
 void i8080::XCHG()
 {
-	uint8_t tmp = registers[H];
-	registers[H] = registers[D];
-	registers[D] = tmp;
-
-	tmp = registers[L];
-	registers[L] = registers[E];
-	registers[E] = tmp;
-
-	DEBUG_PRINT("XCHG 0x%02X(H) <-> 0x%02X(D) - 0x%02X(L) <-> 0x%02X(E)\n",
-		registers[D], registers[H],
-		registers[E], registers[L]);
+	std::swap(registers.pairs[HL], registers.pairs[DE]);
 }
 
 void i8080::XTHL()
@@ -453,40 +886,28 @@ void i8080::XTHL()
 	temp = registers[H];
 	registers[H] = m_Memory->Read(SP + 1);
 	m_Memory->Write(SP + 1, temp);
-
-	DEBUG_PRINT("XTHL H(0x%02X), L(0x%02X)\n", registers[H], registers[L]);
 }
 
 void i8080::SPHL()
 {
-	uint16_t data = LoadRegisterPair(H, L);
-	SP = data;
-
-	DEBUG_PRINT("SPHL 0x%04X(HL) -> SP\n", data);
+	SP = registers.pairs[HL];
 }
 
 void i8080::STAX(uint16_t addr)
 {
 	m_Memory->Write(addr, registers[A]);
-
-	DEBUG_PRINT("STAX 0x%02X(A) -> 0x%04X(M)\n", registers[A], addr);
-
 }
 
 void i8080::LDAX(uint16_t addr)
 {
 	uint8_t data = m_Memory->Read(addr);
 	registers[A] = data;
-
-	DEBUG_PRINT("LDAX 0x%02X(0x%04X) -> A\n", data, addr);
 }
 
 void i8080::SHLD(uint16_t addr)
 {
 	m_Memory->Write(addr, registers[L]);
 	m_Memory->Write(addr+1, registers[H]);
-
-	DEBUG_PRINT("SHLD 0x%02X(L) -> 0x%04X, 0x%02X(H) -> 0x%04X\n", registers[L], addr, registers[H], addr+1);
 }
 
 void i8080::LHLD(uint16_t addr)
@@ -494,241 +915,116 @@ void i8080::LHLD(uint16_t addr)
 	uint8_t loByte = m_Memory->Read(addr);
 	uint8_t hiByte = m_Memory->Read(addr + 1);
 
-	registers[L] = loByte;
-	registers[H] = hiByte;
-
-	DEBUG_PRINT("LHLD 0x%02X(0x%04X) -> L, 0x%02X(0X%04X) -> H\n", loByte, addr, hiByte, addr+1);
+	registers.pairs[HL] = loByte | (hiByte << 8);
 }
 
 void i8080::LDA(uint16_t addr)
 {
 	uint8_t data = m_Memory->Read(addr);
 	registers[A] = data;
-
-	DEBUG_PRINT("LDA 0x%02X(0x%04X) -> A\n", data, addr);
 }
 
 void i8080::STA(uint16_t addr)
 {
 	m_Memory->Write(addr, registers[A]);
-
-	DEBUG_PRINT("STA 0x%02X(A) -> 0x%04X(M)\n", registers[A], addr);
 }
 
-void i8080::DAD(uint8_t opcode)
+template<uint8_t RP>
+void i8080::DAD()
 {
-	uint8_t rpIdx = (opcode & 0x30) >> 4;
-
 	uint16_t rpValue{};
 
-	switch (rpIdx) {
-		case 0x0: rpValue = LoadRegisterPair(B, C); break;
-		case 0x1: rpValue = LoadRegisterPair(D, E); break;
-		case 0x2: rpValue = LoadRegisterPair(H, L); break;
-		case 0x3: rpValue = SP;
-	}
-
-	uint16_t HLValue = LoadRegisterPair(H, L);
+	if constexpr (RP == 0x3)
+		rpValue = SP;
+	else
+		rpValue = registers.pairs[RP];
 
-	uint32_t res = rpValue + HLValue;
+	uint32_t res = rpValue + registers.pairs[HL];
 	m_flags.setCY(res >> 16);
 
-	registers[L] = res & 0xFF;
-	registers[H] = (res & 0xFF00) >> 8;
-
-// ugly debug print block
-#ifdef _DEBUG
-	if (rpIdx == 0x3) {
-		DEBUG_PRINT("DAD 0x%04X(SP) + 0x%04X(HL) -> 0x%04X(HL)\n", rpValue, HLValue, res);
-	}
-	else {
-
-		uint8_t rpHi{}, rpLo{};
-		switch (rpIdx) {
-			case 0x0: rpHi = B; rpLo = C; break;
-			case 0x1: rpHi = D; rpLo = E; break;
-			case 0x2: rpHi = H; rpLo = L; break;
-		}
-		DEBUG_PRINT("DAD 0x%04X(%c%c) + 0x%04X(HL) -> 0x%04X(HL)\n",
-			rpValue,
-			GetRegisterFromIndex(rpHi), GetRegisterFromIndex(rpLo),
-			HLValue, res);
-	}
-#endif
+	registers.pairs[HL] = res & 0xFFFF;
 }
 
 void i8080::DAA()
 {
-	uint8_t initialA = registers[A];
-
-	uint8_t accLo = registers[A] & 0x0F;
-	if ((accLo > 0x9) || m_flags.ac() == 0x1) {
-		uint16_t res = registers[A] + 6;
-
-		setACF(initialA, 0x6, res);
-		accLo = res & 0xF;
-		registers[A] = res;
-	}
-
-	uint8_t accHi = registers[A] >> 4;
-	if ((accHi > 0x9) || m_flags.cy() == 0x1) {
-		accHi += 6;
-
-		m_flags.setCY((accHi >> 4) & 0x1);
-	}
-
-	uint8_t res = (accHi << 4) | accLo;
-	registers[A] = res;
-
-	setZSP(res);
-
-	DEBUG_PRINT("DAA 0x%02X(A) -> 0x%02X(A)\n", initialA, registers[A]);
+	registers[A] = m_flags.daa(registers[A]);
 }
 
 void i8080::CMA()
 {
 	uint8_t a = registers[A];
 	registers[A] = ~a;
-
-	DEBUG_PRINT("CMA 0x%02X(A) -> 0x%02X(A)\n", a, registers[A]);
 }
 
-void i8080::INR(uint8_t opcode)
+template<uint8_t REG>
+void i8080::INR()
 {
-	uint8_t regIndex = (opcode & 0x38) >> 3;
-
 	// INC byte at memory[HL]
-	if (regIndex == 0x6) {
-		uint16_t addr = LoadRegisterPair(H, L);
+	if constexpr (REG == MEMORY_REF) {
+		uint16_t addr = registers.pairs[HL];
 		uint8_t byte = m_Memory->Read(addr);
-		uint8_t res = add(byte, 1);
+		uint8_t res = m_flags.inr(byte);
 
 		m_Memory->Write(addr, res);
-
-		DEBUG_PRINT("INR 0x%02X(M) + 1 -> 0x%02X\n", byte, res);
-		return;
 	}
-
-	uint8_t reg = registers[regIndex];
-	uint8_t res = add(reg, 1);
-	registers[regIndex] = res;
-
-	DEBUG_PRINT("INR 0x%02X(%c) + 1 -> 0x%02X\n", reg, GetRegisterFromIndex(regIndex), res);
+	else {
+		uint8_t reg = registers[REG];
+		uint8_t res = m_flags.inr(reg);
+		registers[REG] = res;
+	}
 }
 
-void i8080::DCR(uint8_t opcode)
+template<uint8_t REG>
+void i8080::DCR()
 {
-	uint8_t regIndex = (opcode & 0x38) >> 3;
-
 	// DEC byte at memory[HL]
-	if (regIndex == 0x6) {
-		uint16_t addr = LoadRegisterPair(H, L);
+	if constexpr (REG == MEMORY_REF) {
+		uint16_t addr = registers.pairs[HL];
 		uint8_t byte = m_Memory->Read(addr);
-		uint8_t res = subtract(byte, 1);
+		uint8_t res = m_flags.dcr(byte);
 
 		m_Memory->Write(addr, res);
-
-		DEBUG_PRINT("DCR 0x%02X(M) - 1 -> 0x%02X\n", byte, res);
-		return;
 	}
-
-	uint8_t reg = registers[regIndex];
-	uint8_t res = subtract(reg, 1);
-	registers[regIndex] = res;
-
-	DEBUG_PRINT("DCR 0x%02X(%c) - 1 -> 0x%02X\n", reg, GetRegisterFromIndex(regIndex), res);
+	else {
+		uint8_t reg = registers[REG];
+		uint8_t res = m_flags.dcr(reg);
+		registers[REG] = res;
+	}
 }
 
-void i8080::INX(uint8_t opcode)
+template<uint8_t RP>
+void i8080::INX()
 {
-	uint8_t rpIndex = (opcode & 0x30) >> 4;
-
-	if (rpIndex == 0x3) {
+	if constexpr (RP == 0x3) {
 		SP++;
-		DEBUG_PRINT("INX SP + 1 -> 0x%04X\n", SP);
-		return;
 	}
-
-	uint8_t regHiIndex{};
-	uint8_t regLoIndex{};
-
-	switch (rpIndex) {
-		case 0x0: regHiIndex = B; regLoIndex = C; break;
-		case 0x1: regHiIndex = D; regLoIndex = E; break;
-		case 0x2: regHiIndex = H; regLoIndex = L; break;
+	else {
+		registers.pairs[RP]++;
 	}
-
-	uint16_t rpValue = LoadRegisterPair(regHiIndex, regLoIndex);
-	rpValue++;
-
-	registers[regHiIndex] = rpValue >> 8;
-	registers[regLoIndex] = rpValue & 0xFF;
-
-	DEBUG_PRINT("INX %c%c + 1 -> 0x%04X\n",
-		GetRegisterFromIndex(regHiIndex),
-		GetRegisterFromIndex(regLoIndex),
-		rpValue);
 }
 
-void i8080::DCX(uint8_t opcode)
+template<uint8_t RP>
+void i8080::DCX()
 {
-	uint8_t rpIndex = (opcode & 0x30) >> 4;
-
-	if (rpIndex == 0x3) {
+	if constexpr (RP == 0x3) {
 		SP--;
-		DEBUG_PRINT("DCX SP - 1 -> 0x%04X\n", SP);
-		return;
 	}
-
-	uint8_t regHiIndex{};
-	uint8_t regLoIndex{};
-
-	switch (rpIndex) {
-		case 0x0: regHiIndex = B; regLoIndex = C; break;
-		case 0x1: regHiIndex = D; regLoIndex = E; break;
-		case 0x2: regHiIndex = H; regLoIndex = L; break;
+	else {
+		registers.pairs[RP]--;
 	}
-
-	uint16_t rpValue = LoadRegisterPair(regHiIndex, regLoIndex);
-	rpValue--;
-
-	registers[regHiIndex] = rpValue >> 8;
-	registers[regLoIndex] = rpValue & 0xFF;
-
-	DEBUG_PRINT("DCX %c%c - 1 -> 0x%04X\n",
-		GetRegisterFromIndex(regHiIndex),
-		GetRegisterFromIndex(regLoIndex),
-		rpValue);
 }
 
-void i8080::LXI(uint8_t opcode)
+template<uint8_t RP>
+void i8080::LXI(uint16_t data)
 {
-	uint8_t regIdx = (opcode & 0x30) >> 4;
-
 	// Load into SP
-	if (regIdx == 0x3) {
-		uint16_t data = LoadWord();
+	if constexpr (RP == 0x3) {
 		SP = data;
-		DEBUG_PRINT("LXI 0x%04X -> SP\n", data);
-		return;
 	}
-
 	// Load into register pair
-	uint8_t rpHiIdx{};
-	uint8_t rpLoIdx{};
-
-	switch (regIdx) {
-		case 0x0: rpHiIdx = B; rpLoIdx = C; break;
-		case 0x1: rpHiIdx = D; rpLoIdx = E; break;
-		case 0x2: rpHiIdx = H; rpLoIdx = L; break;
+	else {
+		registers.pairs[RP] = data;
 	}
-
-	registers[rpLoIdx] = LoadByte();
-	registers[rpHiIdx] = LoadByte();
-
-	DEBUG_PRINT("LXI 0x%02X -> %c, 0x%02X -> %c\n",
-		registers[rpHiIdx], GetRegisterFromIndex(rpHiIdx),
-		registers[rpLoIdx], GetRegisterFromIndex(rpLoIdx));
 }
 
 /////////////////////////////////////////
@@ -737,10 +1033,8 @@ void i8080::LXI(uint8_t opcode)
 void i8080::ADI(uint8_t value)
 {
 	uint8_t a = registers[A];
-	uint16_t res = add(a, value);
+	uint8_t res = m_flags.add(a, value);
 	registers[A] = res;
-
-	DEBUG_PRINT("ADI 0x%02X(A) + 0x%02X -> 0x%02X\n", a, value, res);
 }
 
 void i8080::ACI(uint8_t value)
@@ -748,19 +1042,15 @@ void i8080::ACI(uint8_t value)
 	uint8_t a = registers[A];
 	uint8_t carry = m_flags.cy();
 
-	uint16_t res = add(a, value + carry);
+	uint8_t res = m_flags.add(a, value, carry);
 	registers[A] = res;
-
-	DEBUG_PRINT("ACI 0x%02X(A) + 0x%02X + 0x%02X -> 0x%02X\n", a, value, carry, res);
 }
 
 void i8080::SUI(uint8_t value)
 {
 	uint8_t a = registers[A];
-	uint16_t res = subtract(a, value);
+	uint8_t res = m_flags.subtract(a, value);
 	registers[A] = res;
-
-	DEBUG_PRINT("SUI 0x%02X(A) - 0x%02X -> 0x%02X\n", a, value, res);
 }
 
 void i8080::SBI(uint8_t value)
@@ -768,10 +1058,8 @@ void i8080::SBI(uint8_t value)
 	uint8_t a = registers[A];
 	uint8_t carry = m_flags.cy();
 
-	uint16_t res = subtract(a, value + carry);
+	uint8_t res = m_flags.subtract(a, value, carry);
 	registers[A] = res;
-
-	DEBUG_PRINT("SUI 0x%02X(A) - (0x%02X + 0x%02X) -> 0x%02X\n", a, value, carry, res);
 }
 
 void i8080::ANI(uint8_t value)
@@ -780,133 +1068,93 @@ void i8080::ANI(uint8_t value)
 	uint8_t res = registers[A] & value;
 	registers[A] = res;
 
-	setZSP(res);
-	m_flags.setCY(0);
-	m_flags.setAC(0);
-
-	DEBUG_PRINT("ANI 0x%02X(A) AND 0x%02X -> 0x%02X\n", a, value, res);
+	m_flags.logic(res, ((a | value) >> 3) & 0x1);
 }
 
 void i8080::XRI(uint8_t value)
 {
-	uint8_t a = registers[A];
-
 	uint8_t res = registers[A] ^ value;
 	registers[A] = res;
 
-	setZSP(res);
-	m_flags.setCY(0);
-
-	DEBUG_PRINT("XRI 0x%02X(A) XOR 0x%02X -> 0x%02X\n", a, value, res);
+	m_flags.logic(res, 0);
 }
 
 void i8080::ORI(uint8_t value)
 {
-	uint8_t a = registers[A];
-
 	uint8_t res = registers[A] | value;
 	registers[A] = res;
 
-	setZSP(res);
-	m_flags.setCY(0);
-
-	DEBUG_PRINT("ORI 0x%02X(A) OR 0x%02X -> 0x%02X\n", a, value, res);
+	m_flags.logic(res, 0);
 }
 
 void i8080::CPI(uint8_t value)
 {
-	uint8_t a = registers[A];
-	uint8_t res = compare(value);
-
-	DEBUG_PRINT("CPI 0x%02X(A), 0x%02X\n", a, value);
+	m_flags.compare(registers[A], value);
 }
 
 ////////////////////////////////////////
 ///////////REGISTER TO ACC/////////////
 //////////////////////////////////////
-void i8080::ADD(uint8_t value, uint8_t regIdx)
+void i8080::ADD(uint8_t value)
 {
 	uint8_t a = registers[A];
-	uint8_t res = add(a, value);
+	uint8_t res = m_flags.add(a, value);
 	registers[A] = res;
-
-	DEBUG_PRINT("ADD 0x%02X(A) + 0x%02X(%c) -> 0x%02X\n", a, value, GetRegisterFromIndex(regIdx), res);
 }
 
-void i8080::SUB(uint8_t value, uint8_t regIdx)
+void i8080::SUB(uint8_t value)
 {
 	uint8_t a = registers[A];
-	uint8_t res = subtract(a, value);
+	uint8_t res = m_flags.subtract(a, value);
 	registers[A] = res;
-
-	DEBUG_PRINT("SUB 0x%02X(A) - 0x%02X(%c) -> 0x%02X\n", a, value, GetRegisterFromIndex(regIdx), res);
 }
 
-void i8080::ADC(uint8_t value, uint8_t regIdx)
+void i8080::ADC(uint8_t value)
 {
 	uint8_t a = registers[A];
 	uint8_t carry = m_flags.cy();
 
-	uint8_t res = add(a, value + carry);
+	uint8_t res = m_flags.add(a, value, carry);
 	registers[A] = res;
-
-	DEBUG_PRINT("ADC 0x%02X(A) + 0x%02X(%c) + 0x%02X -> 0x%02X\n", a, value, GetRegisterFromIndex(regIdx), carry, res);
 }
 
-void i8080::SBB(uint8_t value, uint8_t regIdx)
+void i8080::SBB(uint8_t value)
 {
 	uint8_t a = registers[A];
 	uint8_t carry = m_flags.cy();
 
-	uint8_t res = subtract(a, value + carry);
+	uint8_t res = m_flags.subtract(a, value, carry);
 	registers[A] = res;
-
-	DEBUG_PRINT("SBB 0x%02X(A) - (0x%02X(%c) + 0x%02X) -> 0x%02X\n", a, value, GetRegisterFromIndex(regIdx), carry, res);
 }
 
-void i8080::ANA(uint8_t value, uint8_t regIdx)
+void i8080::ANA(uint8_t value)
 {
 	uint8_t a = registers[A];
 	uint8_t res = registers[A] & value;
 	registers[A] = res;
 
-	setZSP(res);
-	m_flags.setCY(0);
-
-	DEBUG_PRINT("ANA 0x%02X(A) AND 0x%02X -> 0x%02X\n", a, value, res);
+	m_flags.logic(res, ((a | value) >> 3) & 0x1);
 }
 
-void i8080::XRA(uint8_t value, uint8_t regIdx)
+void i8080::XRA(uint8_t value)
 {
-	uint8_t a = registers[A];
 	uint8_t res = registers[A] ^ value;
 	registers[A] = res;
 
-	setZSP(res);
-	m_flags.setCY(0);
-	setACF(a, value, res);
-
-	DEBUG_PRINT("XRA 0x%02X(A) XOR 0x%02X(%c) -> 0x%02X\n", a, value, GetRegisterFromIndex(regIdx), res);
+	m_flags.logic(res, 0);
 }
 
-void i8080::ORA(uint8_t value, uint8_t regIdx)
+void i8080::ORA(uint8_t value)
 {
-	uint8_t a = registers[A];
 	uint8_t res = registers[A] | value;
 	registers[A] = res;
 
-	setZSP(res);
-	m_flags.setCY(0);
-
-	DEBUG_PRINT("ORA 0x%02X(A) OR 0x%02X -> 0x%02X\n", a, value, res);
+	m_flags.logic(res, 0);
 }
 
-void i8080::CMP(uint8_t value, uint8_t regIdx)
+void i8080::CMP(uint8_t value)
 {
-	uint8_t a = registers[A];
-	uint8_t res = compare(value);
-
-	DEBUG_PRINT("CMP 0x%02X(A), 0x%02X(%c)\n", registers[A], value, GetRegisterFromIndex(regIdx));
+	m_flags.compare(registers[A], value);
 }
 
 void i8080::RLC()
@@ -915,8 +1163,6 @@ void i8080::RLC()
 
 	registers[A] <<= 1;
 	registers[A] |= m_flags.cy();
-
-	DEBUG_PRINT("RLC A<< -> 0x%02X\n", registers[A]);
 }
 
 void i8080::RRC()
@@ -925,8 +1171,6 @@ void i8080::RRC()
 
 	registers[A] >>= 1;
 	registers[A] |= (m_flags.cy() << 7);
-
-	DEBUG_PRINT("RRC A>> -> 0x%02X\n", registers[A]);
 }
 
 void i8080::RAL()
@@ -938,8 +1182,6 @@ void i8080::RAL()
 
 	registers[A] <<= 1;
 	registers[A] |= c;
-
-	DEBUG_PRINT("RAL c<<A -> 0x%02X\n", registers[A]);
 }
 
 void i8080::RAR()
@@ -951,8 +1193,6 @@ void i8080::RAR()
 
 	registers[A] >>= 1;
 	registers[A] |= (c << 7);
-
-	DEBUG_PRINT("RAR A>>c -> 0x%02X\n", registers[A]);
 }
 
 void i8080::ProcessPUSH(uint8_t opcode)
@@ -960,9 +1200,9 @@ void i8080::ProcessPUSH(uint8_t opcode)
 	uint8_t rpIdx = (opcode & 0x30) >> 4;
 
 	switch (rpIdx) {
-		case 0x0: PUSH(B, C); break;
-		case 0x1: PUSH(D, E); break;
-		case 0x2: PUSH(H, L); break;
+		case 0x0: PUSH(BC); break;
+		case 0x1: PUSH(DE); break;
+		case 0x2: PUSH(HL); break;
 		case 0x3: PUSH_PSW();
 	}
 }
@@ -972,14 +1212,14 @@ void i8080::ProcessPOP(uint8_t opcode)
 	uint8_t rpIdx = (opcode & 0x30) >> 4;
 
 	switch (rpIdx) {
-		case 0x0: POP(B, C); break;
-		case 0x1: POP(D, E); break;
-		case 0x2: POP(H, L); break;
+		case 0x0: POP(BC); break;
+		case 0x1: POP(DE); break;
+		case 0x2: POP(HL); break;
 		case 0x3: POP_PSW();
 	}
 }
 
-void i8080::ProcessJMP(uint8_t opcode)
+void i8080::ProcessJMP(uint8_t opcode, uint16_t addr)
 {
 	bool cond = 0;
 	uint8_t code = (opcode & 0x38) >> 3;
@@ -993,27 +1233,25 @@ void i8080::ProcessJMP(uint8_t opcode)
 		case 0x0:
 			if (jmpBit == 0x1) {
 				cond = true;
-				DEBUG_PRINT("JMP");
 			}
 			else {
 				cond = m_flags.z() == 0;
-				DEBUG_PRINT("JNZ");
 			}
 			break;
 
-		case 0x1: cond = m_flags.z() == 1;	DEBUG_PRINT("JZ");	break;
-		case 0x2: cond = m_flags.cy() == 0; DEBUG_PRINT("JNC");	break;
-		case 0x3: cond = m_flags.cy() == 1; DEBUG_PRINT("JC");	break;
-		case 0x4: cond = m_flags.p() == 0;	DEBUG_PRINT("JPO");	break;
-		case 0x5: cond = m_flags.p() == 1;	DEBUG_PRINT("JPE");	break;
-		case 0x6: cond = m_flags.s() == 0;	DEBUG_PRINT("JP");	break;
-		case 0x7: cond = m_flags.s() == 1;	DEBUG_PRINT("JM");	break;
+		case 0x1: cond = m_flags.z() == 1;	break;
+		case 0x2: cond = m_flags.cy() == 0;	break;
+		case 0x3: cond = m_flags.cy() == 1;	break;
+		case 0x4: cond = m_flags.p() == 0;	break;
+		case 0x5: cond = m_flags.p() == 1;	break;
+		case 0x6: cond = m_flags.s() == 0;	break;
+		case 0x7: cond = m_flags.s() == 1;	break;
 	}
 
-	JMP(cond);
+	JMP(cond, addr);
 }
 
-void i8080::ProcessCALL(uint8_t opcode)
+void i8080::ProcessCALL(uint8_t opcode, uint16_t addr)
 {
 	bool cond = 0;
 	uint8_t code = (opcode & 0x38) >> 3;
@@ -1027,24 +1265,22 @@ void i8080::ProcessCALL(uint8_t opcode)
 		case 0x1:
 			if (callBit == 0x1) {
 				cond = true;
-				DEBUG_PRINT("CALL");
 			}
 			else {
 				cond = m_flags.z() == 1;
-				DEBUG_PRINT("CZ");
 			}
 			break;
 
-		case 0x0: cond = m_flags.z() == 0;	DEBUG_PRINT("CNZ");	break;
-		case 0x2: cond = m_flags.cy() == 0; DEBUG_PRINT("CNC");	break;
-		case 0x3: cond = m_flags.cy() == 1; DEBUG_PRINT("CC");	break;
-		case 0x4: cond = m_flags.p() == 0;	DEBUG_PRINT("CPO");	break;
-		case 0x5: cond = m_flags.p() == 1;	DEBUG_PRINT("CPE");	break;
-		case 0x6: cond = m_flags.s() == 0;	DEBUG_PRINT("CP");	break;
-		case 0x7: cond = m_flags.s() == 1;	DEBUG_PRINT("CM");	break;
+		case 0x0: cond = m_flags.z() == 0;	break;
+		case 0x2: cond = m_flags.cy() == 0;	break;
+		case 0x3: cond = m_flags.cy() == 1;	break;
+		case 0x4: cond = m_flags.p() == 0;	break;
+		case 0x5: cond = m_flags.p() == 1;	break;
+		case 0x6: cond = m_flags.s() == 0;	break;
+		case 0x7: cond = m_flags.s() == 1;	break;
 	}
 
-	CALL(cond);
+	CALL(cond, addr, opcode == 0xCD ? 0 : BRANCH_TAKEN_CYCLES);
 }
 
 void i8080::ProcessRET(uint8_t opcode)
@@ -1061,24 +1297,22 @@ void i8080::ProcessRET(uint8_t opcode)
 		case 0x1:
 			if (retBit == 0x1) {
 				cond = true;
-				DEBUG_PRINT("RET");
 			}
 			else {
 				cond = m_flags.z() == 1;
-				DEBUG_PRINT("RZ");
 			}
 			break;
 
-		case 0x0: cond = m_flags.z() == 0;	DEBUG_PRINT("RNZ");	break;
-		case 0x2: cond = m_flags.cy() == 0; DEBUG_PRINT("RNC");	break;
-		case 0x3: cond = m_flags.cy() == 1; DEBUG_PRINT("RC");	break;
-		case 0x4: cond = m_flags.p() == 0;	DEBUG_PRINT("RPO");	break;
-		case 0x5: cond = m_flags.p() == 1;	DEBUG_PRINT("RPE");	break;
-		case 0x6: cond = m_flags.s() == 0;	DEBUG_PRINT("RP");	break;
-		case 0x7: cond = m_flags.s() == 1;	DEBUG_PRINT("RM");	break;
+		case 0x0: cond = m_flags.z() == 0;	break;
+		case 0x2: cond = m_flags.cy() == 0;	break;
+		case 0x3: cond = m_flags.cy() == 1;	break;
+		case 0x4: cond = m_flags.p() == 0;	break;
+		case 0x5: cond = m_flags.p() == 1;	break;
+		case 0x6: cond = m_flags.s() == 0;	break;
+		case 0x7: cond = m_flags.s() == 1;	break;
 	}
 
-	RET(cond);
+	RET(cond, opcode == 0xC9 ? 0 : BRANCH_TAKEN_CYCLES);
 }
 
 void i8080::ProcessRotateAcc(uint8_t opcode)
@@ -1098,14 +1332,7 @@ void i8080::ProcessAccTransfer(uint8_t opcode)
 	uint8_t rpIdx = (opcode & 0x10) >> 4;
 	uint8_t operationIdx = (opcode & 0x8) >> 3;
 
-	uint8_t rpHi{}, rpLo{};
-
-	switch (rpIdx) {
-		case 0x0: rpHi = B; rpLo = C; break;
-		case 0x1: rpHi = D; rpLo = E; break;
-	}
-
-	uint16_t addr = LoadRegisterPair(rpHi, rpLo);
+	uint16_t addr = registers.pairs[rpIdx];
 
 	switch (operationIdx) {
 		case 0x0: STAX(addr); break;
@@ -1113,10 +1340,9 @@ void i8080::ProcessAccTransfer(uint8_t opcode)
 	}
 }
 
-void i8080::ProcessImmediate(uint8_t opcode)
+void i8080::ProcessImmediate(uint8_t opcode, uint8_t val)
 {
 	uint8_t operationIdx = (opcode & 0x38) >> 3;
-	uint8_t val = LoadByte();
 
 	switch (operationIdx)
 	{
@@ -1129,44 +1355,36 @@ void i8080::ProcessImmediate(uint8_t opcode)
 		case 0x6: ORI(val); break;
 		case 0x7: CPI(val); break;
 		default:
-			DEBUG_PRINT("ProcessImmediate() - INVALID OPERATION\n");
-			exit(1);
+			Invalid();
 	}
 }
 
-void i8080::ProcessRegisterToAcc(uint8_t opcode)
+template<uint8_t OP>
+void i8080::ProcessRegisterToAcc()
 {
-	uint8_t operationIdx = (opcode & 0x38) >> 3;
-	uint8_t regIdx = opcode & 0x7;
+	constexpr uint8_t operationIdx = (OP & 0x38) >> 3;
+	constexpr uint8_t regIdx = OP & 0x7;
 
 	uint8_t val{};
-	if (regIdx == MEMORY_REF)
-		val = m_Memory->Read(LoadRegisterPair(H, L));
+	if constexpr (regIdx == MEMORY_REF)
+		val = m_Memory->Read(registers.pairs[HL]);
 	else
 		val = registers[regIdx];
 
-	switch (operationIdx)
-	{
-		case 0x0: ADD(val, regIdx); break;
-		case 0x1: ADC(val, regIdx); break;
-		case 0x2: SUB(val, regIdx); break;
-		case 0x3: SBB(val, regIdx); break;
-		case 0x4: ANA(val, regIdx); break;
-		case 0x5: XRA(val, regIdx); break;
-		case 0x6: ORA(val, regIdx); break;
-		case 0x7: CMP(val, regIdx); break;
-		default:
-			DEBUG_PRINT("ProcessRegisterToAcc() - INVALID OPERATION\n");
-			exit(1);
-	}
+	if constexpr (operationIdx == 0x0)		ADD(val);
+	else if constexpr (operationIdx == 0x1)	ADC(val);
+	else if constexpr (operationIdx == 0x2)	SUB(val);
+	else if constexpr (operationIdx == 0x3)	SBB(val);
+	else if constexpr (operationIdx == 0x4)	ANA(val);
+	else if constexpr (operationIdx == 0x5)	XRA(val);
+	else if constexpr (operationIdx == 0x6)	ORA(val);
+	else									CMP(val);
 }
 
-void i8080::ProcessDirectAddressing(uint8_t opcode)
+void i8080::ProcessDirectAddressing(uint8_t opcode, uint16_t addr)
 {
 	uint8_t operationIdx = (opcode & 0x18) >> 3;
 
-	uint16_t addr = LoadWord();
-
 	switch (operationIdx)
 	{
 		case 0x0: SHLD(addr); break;
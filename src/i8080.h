@@ -1,10 +1,17 @@
 #pragma once
 
+#include <array>
+#include <bit>
+#include <bitset>
+#include <utility>
 #include <cstdio>
 #include <cstdint>
+#include <memory>
 
 #include "Memory.h"
 #include "CPM.h"
+#include "Trace.h"
+#include "Coverage.h"
 
 #define A 0b111
 #define B 0b000
@@ -15,29 +22,189 @@
 #define L 0b101
 #define MEMORY_REF 0b110
 
+// Register pairs, numbered as in the opcode's rp field
+#define BC 0b00
+#define DE 0b01
+#define HL 0b10
+
+// Extra T-states a conditional CALL or RET takes when the condition holds
+#define BRANCH_TAKEN_CYCLES 6
+
+// T-states per second of a 2 MHz 8080
+#define I8080_CLOCK_HZ 2000000
+
+class BlockCache;
+class Jit;
+class Profiler;
+
 class i8080
 {
+public:
+	enum class Engine {
+		Interpreter,	// Cycle() through the dispatch table
+		Threaded,		// RunThreaded(), state kept in locals
+		Blocks,			// RunBlocks(), pre-decoded basic blocks
+		Jit				// RunJit(), blocks translated to x86-64
+	};
+
+	// Why Run() or RunUntil() returned. Halted, Exit and Error are sticky:
+	// once the CPU has executed HLT, the program went through WBOOT or it
+	// failed, every later call returns straight away with the same reason.
+	enum class StopReason {
+		None,			// internal only, never returned
+		Budget,			// the instruction budget ran out
+		Halted,			// HLT
+		Exit,			// CP/M warm boot, the program is done
+		Breakpoint,		// PC reached a breakpoint or the RunUntil() condition
+		Watchpoint,		// an instruction accessed a watched address, see Memory::GetWatchHit()
+		Error			// an invalid opcode or BDOS function, PC is past the opcode
+	};
+
+	// What stopped the CPU with StopReason::Error. The CPU prints nothing,
+	// the host decides whether and how to report it.
+	struct Fault {
+		enum class Kind : uint8_t {
+			None,
+			Opcode,		// code is the invalid opcode
+			BDOS		// code is the BDOS function in C that is not implemented
+		};
+
+		Kind kind{};
+		uint8_t code{};
+		uint16_t PC{};		// of the opcode, or of the CALL to the BDOS
+
+		bool operator==(const Fault&) const = default;
+	};
+
+	struct State {
+		uint8_t registers[8]{};
+		uint8_t flags{};
+		uint16_t PC{}, SP{};
+		uint64_t cycles{};
+		StopReason stop{};	// None until HLT, WBOOT or an error
+		Fault fault{};		// set along with StopReason::Error
+
+		bool operator==(const State&) const = default;
+	};
+
+	// The whole machine at one instant, see Snapshot()
+	struct MachineSnapshot;
+
 public:
 	i8080(Memory* memory, CPM* cpm);
 	~i8080();
 
 	void Cycle();
+	StopReason Run(uint64_t instructions);
+	StopReason RunCycles(uint64_t cycles);
+	template<typename Condition>
+	StopReason RunUntil(uint64_t instructions, Condition condition);
+	void RunThreaded(uint64_t count);
+	void RunBlocks(uint64_t count);
+	void RunJit(uint64_t count);
+
+	// Without the JIT compiled in, or if its code buffer can't be had, Jit
+	// quietly runs as Blocks. GetEngine() tells the host which one it got.
+	void SetEngine(Engine engine);
+	Engine GetEngine() const { return m_Engine; }
+
+	// With fusion on, the Interpreter and Threaded engines run the second
+	// instruction of a few common pairs, DCR r; JNZ and the like, straight
+	// from the first one's handler without dispatching it. What runs is
+	// the same either way. On by default.
+	void SetFusion(bool fuse) { m_Fuse = fuse; }
+	bool GetFusion() const { return m_Fuse; }
+
+	State GetState() const;
+	void SetState(const State& state);
+	uint16_t GetPC() const { return PC; }
+
+	// Captures and puts back the CPU, its Memory and its CPM together.
+	// Memory pages are shared copy-on-write, so a snapshot costs the pages
+	// written since the last one and a restore the pages written since
+	// this one. Breakpoints, the engine and anything attached stay as
+	// they are. Cached code over restored bytes is dropped.
+	MachineSnapshot Snapshot();
+	void Restore(const MachineSnapshot& snapshot);
+
+	// T-states executed since construction
+	uint64_t GetCycles() const { return m_Cycles; }
+
+	// Breakpoints stop Run() before the instruction at the address is
+	// executed. While any are set Run() goes through RunUntil() on the
+	// interpreter, otherwise they cost nothing.
+	void SetBreakpoint(uint16_t addr);
+	void ClearBreakpoint(uint16_t addr);
+
+	// Watchpoints are set on the Memory. While it has any, Run() goes
+	// through RunUntil() as for breakpoints and stops after the instruction
+	// that hit one. The hit is cleared when the next Run() starts.
+	void SetWatchpoint(uint16_t addr, uint8_t access) { m_Memory->SetWatchpoint(addr, access); }
+	void ClearWatchpoint(uint16_t addr) { m_Memory->ClearWatchpoint(addr); }
+
+#if I8080_TRACE
+	// Every instruction the CPU executes is pushed to the buffer while one
+	// is attached. Like breakpoints, this routes Run() through the
+	// interpreter. Pass nullptr to detach.
+	void SetTrace(TraceBuffer* trace) { m_Trace = trace; }
+#endif
+
+#if I8080_COVERAGE
+	// Every engine counts its control flow edges into the map while one is
+	// attached, see Coverage, and keeps its own dispatch. Pass nullptr to
+	// detach. ResetCoverage() forgets the previous block, as for a fresh
+	// run from a snapshot.
+	void SetCoverage(uint8_t* map) { m_Coverage = map; }
+	void ResetCoverage() { m_CoveragePrev = 0; }
+#endif
+
+	// Counts every instruction into the profiler while one is attached.
+	// Each engine keeps its own dispatch, but the JIT runs its blocks
+	// through their handlers and no engine skips idle loops. Pass nullptr
+	// to detach.
+	void SetProfiler(Profiler* profiler) { m_Profiler = profiler; }
+
+	// Writes the mnemonic for the instruction, e.g. "MVI A,0x3F"
+	static void Disassemble(uint8_t opcode, uint16_t operand, char* out, size_t size);
 
 private:
 	struct flags {
-		uint8_t reg{0};
+		// Flags are evaluated lazily: ALU ops record their kind and operands,
+		// and the Z/S/P/CY/AC bits are only looked up in AluTables once
+		// something reads them (conditional JMP/CALL/RET, PUSH PSW, DAA,
+		// carry consumers). Bits set in pending are still owed by the
+		// recorded op, every other bit of reg is already up to date.
+		enum class LazyOp : uint8_t { None, Add, Subtract, Logic };
+
+		static constexpr uint8_t CY_BIT = 0x01;
+		static constexpr uint8_t P_BIT  = 0x04;
+		static constexpr uint8_t AC_BIT = 0x10;
+		static constexpr uint8_t Z_BIT  = 0x40;
+		static constexpr uint8_t S_BIT  = 0x80;
+		static constexpr uint8_t ALL_BITS = CY_BIT | P_BIT | AC_BIT | Z_BIT | S_BIT;
 
-		uint8_t cy() const { return (reg & 0x1); }
-		uint8_t p()  const { return ((reg >> 2) & 0x1); }
-		uint8_t ac() const { return ((reg >> 4) & 0x1); }
-		uint8_t z()  const { return ((reg >> 6) & 0x1); }
-		uint8_t s()  const { return ((reg >> 7) & 0x1); }
+		mutable uint8_t reg{0};
+		mutable uint8_t pending{0};
+		LazyOp lazyOp{LazyOp::None};
+		uint8_t lazyV1{0}, lazyV2{0}, lazyCarry{0};
+
+		uint8_t cy() const { resolve(CY_BIT); return (reg & 0x1); }
+		uint8_t p()  const { resolve(P_BIT);  return ((reg >> 2) & 0x1); }
+		uint8_t ac() const { resolve(AC_BIT); return ((reg >> 4) & 0x1); }
+		uint8_t z()  const { resolve(Z_BIT);  return ((reg >> 6) & 0x1); }
+		uint8_t s()  const { resolve(S_BIT);  return ((reg >> 7) & 0x1); }
+
+		// Whole flag byte, as pushed by PUSH PSW.
+		uint8_t get() const { resolve(ALL_BITS); return reg; }
+		void set(uint8_t val) { reg = val; pending = 0; }
 
 		void setBit(uint8_t bit, uint8_t val) {
 			if (val)
 				reg |= (val << bit);
 			else
 				reg &= ~(0x1 << bit);
+
+			pending &= ~(0x1 << bit);
 		}
 
 		void setCY(uint8_t val) { setBit(0, val); }
@@ -46,43 +213,218 @@ private:
 		void setZ(uint8_t val)  { setBit(6, val); }
 		void setS(uint8_t val)	{ setBit(7, val); }
 
-		void reset() { reg = 0; }
+		void reset() { reg = 0; pending = 0; lazyOp = LazyOp::None; }
+
+		void resolve(uint8_t bits) const { if (pending & bits) materialize(); }
+		void materialize() const;
+
+		void record(LazyOp op, uint8_t v1, uint8_t v2, uint8_t carry, uint8_t bits) {
+			lazyOp = op;
+			lazyV1 = v1;
+			lazyV2 = v2;
+			lazyCarry = carry;
+			pending = bits;
+		}
+
+		uint8_t add(const uint8_t v1, const uint8_t v2, const uint8_t carry = 0) {
+			record(LazyOp::Add, v1, v2, carry, ALL_BITS);
+			return v1 + v2 + carry;
+		}
+
+		uint8_t subtract(const uint8_t v1, const uint8_t v2, const uint8_t borrow = 0) {
+			record(LazyOp::Subtract, v1, v2, borrow, ALL_BITS);
+			return v1 - v2 - borrow;
+		}
+
+		void compare(const uint8_t acc, const uint8_t value) {
+			record(LazyOp::Subtract, acc, value, 0, ALL_BITS);
+		}
+
+		// INR/DCR leave CY alone, so a carry still owed by the previous op
+		// has to be settled before it is overwritten.
+		uint8_t inr(const uint8_t v) {
+			resolve(CY_BIT);
+			record(LazyOp::Add, v, 1, 0, ALL_BITS & ~CY_BIT);
+			return v + 1;
+		}
+
+		uint8_t dcr(const uint8_t v) {
+			resolve(CY_BIT);
+			record(LazyOp::Subtract, v, 1, 0, ALL_BITS & ~CY_BIT);
+			return v - 1;
+		}
+
+		// ANA/XRA/ORA and their immediates: CY is cleared, AC is given by the
+		// caller (bit 3 of v1|v2 for ANA/ANI, clear otherwise), Z/S/P follow
+		// the result.
+		void logic(const uint8_t res, const uint8_t acBit) {
+			reg = (reg & ~(CY_BIT | AC_BIT)) | (acBit ? AC_BIT : 0);
+			record(LazyOp::Logic, res, 0, 0, Z_BIT | S_BIT | P_BIT);
+		}
+
+		uint8_t daa(const uint8_t acc);
 	} m_flags;
 
-	uint8_t registers[8]{0};
+	// B,C / D,E / H,L share storage with the native 16-bit words of BC, DE
+	// and HL, so pair operations and M-operand addressing are a single
+	// load or store. Register indices stay in opcode order, high byte
+	// first, which on a little-endian host is the second byte of each
+	// word: the index is flipped into its physical byte at compile time.
+	union RegisterFile {
+		static constexpr uint8_t SWAP = std::endian::native == std::endian::little ? 1 : 0;
+
+		uint8_t bytes[8];
+		uint16_t pairs[4];	// BC, DE, HL, and A sharing a word with the unused M slot
+
+		uint8_t& operator[](uint8_t idx) { return bytes[idx ^ SWAP]; }
+		uint8_t operator[](uint8_t idx) const { return bytes[idx ^ SWAP]; }
+
+		// Byte offset of a register, for generated code
+		static constexpr uint8_t Offset(uint8_t idx) { return idx ^ SWAP; }
+	} registers{};
+
+	static_assert(sizeof(RegisterFile) == 8, "register pairs must overlay the registers exactly");
+
 	uint16_t PC{}, SP{};
 
+	// The interpreter adds each instruction's cost as it runs it. The
+	// block engines add a whole block up front, and the CALL/RET handlers
+	// add BRANCH_TAKEN_CYCLES on top when a conditional branch is taken.
+	uint64_t m_Cycles = 0;
+
 	Memory* m_Memory = nullptr;
 	CPM* m_CPM = nullptr;
 
+	friend class BlockCache;
+	friend class Jit;
+	friend class Lockstep;
+
+	// Set by HLT, WBOOT and errors, checked by the engines between blocks
+	// or after the instructions that can set it
+	StopReason m_Stop = StopReason::None;
+	Fault m_Fault{};
+
+	std::bitset<65536> m_Breakpoints;
+	size_t m_BreakpointCount = 0;
+
+#if I8080_TRACE
+	TraceBuffer* m_Trace = nullptr;
+#endif
+
+#if I8080_COVERAGE
+	// Called by the control flow handlers with the PC they leave for
+	void CoverEdge(uint16_t pc)
+	{
+		if (m_Coverage)
+			Coverage::Hit(m_Coverage, m_CoveragePrev, pc);
+	}
+
+	uint8_t* m_Coverage = nullptr;
+	uint16_t m_CoveragePrev = 0;
+#endif
+
+	Profiler* m_Profiler = nullptr;
+
+	Engine m_Engine = Engine::Interpreter;
+	bool m_Fuse = true;
+	std::unique_ptr<BlockCache> m_BlockCache;
+	std::unique_ptr<Jit> m_Jit;
+
 private:
-	uint16_t add(const uint8_t v1, const uint8_t v2);
-	uint16_t subtract(const uint8_t v1, const uint8_t v2);
-	uint8_t compare(const uint8_t value);
-	void setACF(uint8_t v1, uint8_t v2, uint8_t v3);
-	void setZSP(const uint8_t value);
+	enum class OpGroup : uint8_t {
+		Invalid,
+		NOP, HLT, CMA, DAA, STC, CMC, PCHL, XTHL, XCHG, SPHL,
+		INR, INX, DCX, DCR, MOV, DAD, LXI, MVI,
+		RotateAcc, AccTransfer, DirectAddressing, Immediate, RegisterToAcc,
+		PUSH, POP, JMP, CALL, RET
+	};
 
+	static constexpr OpGroup Decode(uint8_t opcode);
+	static constexpr uint8_t InstructionLength(OpGroup group);
+	static constexpr uint8_t InstructionCycles(uint8_t opcode);
+	static constexpr int FusedPartner(uint8_t opcode);
+
+	// Every opcode maps straight to its own instantiation of Execute<>,
+	// so Cycle() is a single indirect call and the operand fields are
+	// fixed at compile time. Execute<> fetches the immediate operand and
+	// hands it to Operate<>, which the block cache calls directly with
+	// operands it decoded ahead of time.
+	using OpHandler = void (i8080::*)();
+	using OperandHandler = void (i8080::*)(uint16_t operand);
+	using JitHandler = void (*)(i8080* cpu, uint16_t operand);
+	using FusedHandler = uint32_t (i8080::*)(uint64_t budget);
+
+	static const std::array<OpHandler, 256> s_DispatchTable;
+	static const std::array<OperandHandler, 256> s_OperandTable;
+	static const std::array<uint8_t, 256> s_LengthTable;
+	static const std::array<uint8_t, 256> s_CycleTable;
+	static const std::array<OpGroup, 256> s_GroupTable;
+	static const std::array<JitHandler, 256> s_JitTable;
+	static const std::array<FusedHandler, 256> s_FusedTable;
+
+	template<size_t... OPS>
+	static constexpr std::array<OpHandler, 256> BuildDispatchTable(std::index_sequence<OPS...>);
+	template<size_t... OPS>
+	static constexpr std::array<OperandHandler, 256> BuildOperandTable(std::index_sequence<OPS...>);
+	template<size_t... OPS>
+	static constexpr std::array<uint8_t, 256> BuildLengthTable(std::index_sequence<OPS...>);
+	template<size_t... OPS>
+	static constexpr std::array<uint8_t, 256> BuildCycleTable(std::index_sequence<OPS...>);
+	template<size_t... OPS>
+	static constexpr std::array<OpGroup, 256> BuildGroupTable(std::index_sequence<OPS...>);
+	template<size_t... OPS>
+	static constexpr std::array<JitHandler, 256> BuildJitTable(std::index_sequence<OPS...>);
+	template<size_t... OPS>
+	static constexpr std::array<FusedHandler, 256> BuildFusedTable(std::index_sequence<OPS...>);
+
+	template<uint8_t OP>
+	void Execute();
+	template<uint8_t OP>
+	void Operate(uint16_t operand);
+
+	// Execute<OP>, then its partner if that comes next and the budget has
+	// room for it. Returns the instructions run.
+	template<uint8_t OP>
+	uint32_t ExecuteFused(uint64_t budget);
+	void RunFused(uint64_t instructions);
+
+	// Plain function entry points into Operate<> for generated code
+	template<uint8_t OP>
+	static void JitOperate(i8080* cpu, uint16_t operand) { cpu->Operate<OP>(operand); }
+
+	void Invalid();
+
+	StopReason RunProfiled(uint64_t instructions);
+	void ProfiledCycle();
+	void ProfileStack(uint16_t pc, uint8_t opcode, uint16_t sp);
+
+	template<bool PROFILED, bool FUSED>
+	void ThreadedLoop(uint64_t count);
+
+private:
 	uint8_t LoadByte();
 	uint16_t LoadWord();
-	uint16_t LoadRegisterPair(uint8_t rhIdx, uint8_t rlIdx);
 
-	void RET(bool cond);
-	void JMP(bool cond);
-	void CALL(bool cond);
+	void RET(bool cond, uint8_t takenCycles);
+	void JMP(bool cond, uint16_t addr);
+	void CALL(bool cond, uint16_t addr, uint8_t takenCycles);
 	void PCHL();
 
-	void POP(uint8_t rhIdx, uint8_t rlIdx);
+	void POP(uint8_t rpIdx);
 	void POP_PSW();
-	void PUSH(uint8_t rhIdx, uint8_t rlIdx);
+	void PUSH(uint8_t rpIdx);
 	void PUSH_PSW();
 
+	void NOP();
+	void HLT();
 	void STC();
 	void CMC();
 
-	void MOV(uint8_t opcode);
+	template<uint8_t DST, uint8_t SRC>
+	void MOV();
 
-	void MVI(uint8_t opcode);
-	void LXI(uint8_t opcode);
+	template<uint8_t REG> void MVI(uint8_t byte);
+	template<uint8_t RP> void LXI(uint16_t data);
 	void XCHG();
 	void XTHL();
 	void SPHL();
@@ -95,14 +437,14 @@ private:
 	void STA(uint16_t addr);
 	void LDA(uint16_t addr);
 
-	void DAD(uint8_t opcode);
+	template<uint8_t RP> void DAD();
 	void DAA();
 
 	void CMA();
-	void INR(uint8_t opcode);
-	void DCR(uint8_t opcode);
-	void INX(uint8_t opcode);
-	void DCX(uint8_t opcode);
+	template<uint8_t REG> void INR();
+	template<uint8_t REG> void DCR();
+	template<uint8_t RP> void INX();
+	template<uint8_t RP> void DCX();
 
 	void ADI(uint8_t value);
 	void ACI(uint8_t value);
@@ -113,14 +455,14 @@ private:
 	void ORI(uint8_t value);
 	void CPI(uint8_t value);
 
-	void ADD(uint8_t value, uint8_t regIdx);
-	void SUB(uint8_t value, uint8_t regIdx);
-	void ADC(uint8_t value, uint8_t regIdx);
-	void SBB(uint8_t value, uint8_t regIdx);
-	void ANA(uint8_t value, uint8_t regIdx);
-	void XRA(uint8_t value, uint8_t regIdx);
-	void ORA(uint8_t value, uint8_t regIdx);
-	void CMP(uint8_t value, uint8_t regIdx);
+	void ADD(uint8_t value);
+	void SUB(uint8_t value);
+	void ADC(uint8_t value);
+	void SBB(uint8_t value);
+	void ANA(uint8_t value);
+	void XRA(uint8_t value);
+	void ORA(uint8_t value);
+	void CMP(uint8_t value);
 
 	void RLC();
 	void RRC();
@@ -129,13 +471,46 @@ private:
 
 	void ProcessPUSH(uint8_t opcode);
 	void ProcessPOP(uint8_t opcode);
-	void ProcessJMP(uint8_t opcode);
-	void ProcessCALL(uint8_t opcode);
+	void ProcessJMP(uint8_t opcode, uint16_t addr);
+	void ProcessCALL(uint8_t opcode, uint16_t addr);
 	void ProcessRET(uint8_t opcode);
 
 	void ProcessRotateAcc(uint8_t opcode);
 	void ProcessAccTransfer(uint8_t opcode);
-	void ProcessImmediate(uint8_t opcode);
-	void ProcessRegisterToAcc(uint8_t opcode);
-	void ProcessDirectAddressing(uint8_t opcode);
-};
\ No newline at end of file
+	void ProcessImmediate(uint8_t opcode, uint8_t val);
+	template<uint8_t OP> void ProcessRegisterToAcc();
+	void ProcessDirectAddressing(uint8_t opcode, uint16_t addr);
+};
+struct i8080::MachineSnapshot {
+	RegisterFile registers{};
+	flags cpuFlags{};
+	uint16_t PC{}, SP{};
+	uint64_t cycles = 0;
+	StopReason stop = StopReason::None;
+	Fault fault{};
+
+	Memory::Snapshot memory;
+	CPM::State cpm;
+};
+
+// Runs on the interpreter and tests condition(const i8080&) after every
+// instruction. The condition is a template parameter, so it is inlined
+// into the loop rather than called through a pointer.
+template<typename Condition>
+i8080::StopReason i8080::RunUntil(uint64_t instructions, Condition condition)
+{
+	if (m_Stop != StopReason::None)
+		return m_Stop;
+
+	for (uint64_t i = 0; i < instructions; i++) {
+		Cycle();
+
+		if (m_Stop != StopReason::None)
+			return m_Stop;
+
+		if (condition(*this))
+			return StopReason::Breakpoint;
+	}
+
+	return StopReason::Budget;
+}
@@ -0,0 +1,67 @@
+#include "i8080.h"
+#include "BlockCache.h"
+
+///////////////////////////////////
+/////////////BLOCKS///////////////
+/////////////////////////////////
+
+// Runs pre-decoded blocks from the cache. The operands were fetched
+// when the block was translated, so each instruction is a single call
+// into its Operate<> handler. A write that drops any cached block ends
+// the current block early, since its remaining instructions may be stale.
+// HLT and the CP/M traps only ever end a block, so a stop is checked
+// once per block. T-states are charged for the whole block up front and
+// handed back for the instructions an early exit skipped. Delay loops
+// recognized by the cache are skipped to their last iteration, unless a
+// profiler is attached and has to see every instruction.
+void i8080::RunBlocks(uint64_t count)
+{
+	BlockCache* cache = m_BlockCache.get();
+
+	while (count > 0 && m_Stop == StopReason::None) {
+		cache->ClearInvalidated();
+
+		const BlockCache::Block* block = cache->Lookup(PC);
+
+		if (block && block->idle.kind != BlockCache::IdleLoop::Kind::None && !m_Profiler) {
+			uint64_t skipped = BlockCache::SkipIdleLoop(this, *block, count);
+
+			if (skipped > 0) {
+				count -= skipped;
+				continue;
+			}
+		}
+
+		if (!block || block->instructions.size() > count) {
+			if (m_Profiler)
+				ProfiledCycle();
+			else
+				Cycle();
+			count--;
+			continue;
+		}
+
+		if (m_Profiler) {
+			count -= cache->RunProfiled(this, *block);
+			continue;
+		}
+
+		m_Cycles += block->cycles;
+
+		const BlockCache::Instruction* instr = block->instructions.data();
+		const BlockCache::Instruction* end = instr + block->instructions.size();
+
+		while (instr != end) {
+			PC += instr->length;
+			(this->*instr->handler)(instr->operand);
+			count--;
+			instr++;
+
+			if (cache->Invalidated()) {
+				for (; instr != end; instr++)
+					m_Cycles -= instr->cycles;
+				break;
+			}
+		}
+	}
+}
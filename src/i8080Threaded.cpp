@@ -0,0 +1,528 @@
+#include "i8080.h"
+#include "Profiler.h"
+
+// Direct-threaded dispatch needs the GCC/Clang labels-as-values
+// extension. Other compilers fall back to a switch in a loop.
+#ifndef I8080_COMPUTED_GOTO
+	#if defined(__GNUC__)
+		#define I8080_COMPUTED_GOTO 1
+	#else
+		#define I8080_COMPUTED_GOTO 0
+	#endif
+#endif
+
+#define READ(addr)			mem->Read(addr)
+#define WRITE(addr, val)	mem->Write(addr, val)
+#define FETCH()				mem->Fetch(pc++)
+#define FETCH_WORD()		(pc += 2, static_cast<uint16_t>(mem->Fetch(pc - 2) | (mem->Fetch(pc - 1) << 8)))
+
+#define PAIR(rp)			r.pairs[rp]
+
+#define DO_ADD(v)	r[A] = f.add(r[A], v)
+#define DO_ADC(v)	r[A] = f.add(r[A], v, f.cy())
+#define DO_SUB(v)	r[A] = f.subtract(r[A], v)
+#define DO_SBB(v)	r[A] = f.subtract(r[A], v, f.cy())
+#define DO_ANA(v)	{ uint8_t v_ = (v), ac_ = ((r[A] | v_) >> 3) & 0x1; r[A] &= v_; f.logic(r[A], ac_); }
+#define DO_XRA(v)	{ r[A] ^= (v); f.logic(r[A], 0); }
+#define DO_ORA(v)	{ r[A] |= (v); f.logic(r[A], 0); }
+#define DO_CMP(v)	f.compare(r[A], v)
+
+#define DO_ADI(v)	DO_ADD(v)
+#define DO_ACI(v)	DO_ADC(v)
+#define DO_SUI(v)	DO_SUB(v)
+#define DO_SBI(v)	DO_SBB(v)
+#define DO_ANI(v)	DO_ANA(v)
+#define DO_XRI(v)	{ r[A] ^= (v); f.logic(r[A], 0); }
+#define DO_ORI(v)	DO_ORA(v)
+#define DO_CPI(v)	DO_CMP(v)
+
+#define DO_RLC()	{ f.setCY(r[A] >> 7); r[A] = (r[A] << 1) | f.cy(); }
+#define DO_RRC()	{ f.setCY(r[A] & 0x1); r[A] = (r[A] >> 1) | (f.cy() << 7); }
+#define DO_RAL()	{ uint8_t c_ = f.cy(); f.setCY(r[A] >> 7); r[A] = (r[A] << 1) | c_; }
+#define DO_RAR()	{ uint8_t c_ = f.cy(); f.setCY(r[A] & 0x1); r[A] = (r[A] >> 1) | (c_ << 7); }
+
+#define DO_DAD(v)	{ uint32_t res_ = (v) + PAIR(HL); f.setCY(res_ >> 16); PAIR(HL) = res_ & 0xFFFF; }
+
+#define DO_XCHG()	std::swap(PAIR(HL), PAIR(DE))
+#define DO_XTHL()	{ uint8_t t_ = r[L]; r[L] = READ(sp); WRITE(sp, t_); \
+					  t_ = r[H]; r[H] = READ(sp + 1); WRITE(sp + 1, t_); }
+
+// Control flow edges go to the coverage map as in i8080::JMP(), CALL(),
+// RET() and PCHL(), once PC is where the instruction leaves for
+#if I8080_COVERAGE
+	#define COVER()	CoverEdge(pc)
+#else
+	#define COVER()
+#endif
+
+// A profiled run reports each instruction once the next one is
+// dispatched, or on the way out, with the T-states it took. A taken CALL
+// or RET is noted for it and applied to the call stack after the count,
+// as i8080::ProfiledCycle() does. BDOS calls are a call and a return.
+#define PROFILE_START() \
+	if constexpr (PROFILED) { \
+		pending = true; \
+		start = pc; \
+		startCycles = cycles; \
+	}
+
+#define PROFILE_END() \
+	if constexpr (PROFILED) { \
+		if (pending) { \
+			profiler->Count(start, op, static_cast<uint32_t>(cycles - startCycles)); \
+			if (called >= 0) { \
+				profiler->OnCall(static_cast<uint16_t>(called)); \
+				if (called == 0x0005) \
+					profiler->OnReturn(); \
+				called = -1; \
+			} \
+			if (returned) { \
+				profiler->OnReturn(); \
+				returned = false; \
+			} \
+			pending = false; \
+		} \
+	}
+
+#define PROFILE_CALL(target)	if constexpr (PROFILED) { called = (target); }
+#define PROFILE_RETURN()		if constexpr (PROFILED) { returned = true; }
+
+#define DO_RET(cond, taken) \
+	if (cond) { \
+		PROFILE_RETURN(); \
+		cycles += taken; \
+		uint8_t lo_ = READ(sp++); \
+		uint8_t hi_ = READ(sp++); \
+		pc = lo_ | (hi_ << 8); \
+	} \
+	COVER()
+
+#define DO_JMP(cond) { \
+	uint16_t addr_ = FETCH_WORD(); \
+	if (cond) { \
+		pc = addr_; \
+		COVER(); \
+		if (addr_ == 0x0) { \
+			m_CPM->WBOOT(); \
+			m_Stop = StopReason::Exit; \
+			goto done; \
+		} \
+	} \
+	else { \
+		COVER(); \
+	} }
+
+// BDOS calls trap on the target address regardless of the condition,
+// the same as i8080::CALL()
+#define DO_CALL(cond, taken) { \
+	uint16_t addr_ = FETCH_WORD(); \
+	if (addr_ == 0x0005) { \
+		uint8_t result_; \
+		PROFILE_CALL(addr_); \
+		if (m_CPM->Call(r[C], PAIR(DE), result_)) { \
+			r[A] = result_; \
+			r[L] = result_; \
+		} \
+		if (m_CPM->Exited()) { \
+			m_Stop = StopReason::Exit; \
+			goto done; \
+		} \
+		if (m_CPM->Failed()) { \
+			m_Fault = { Fault::Kind::BDOS, r[C], static_cast<uint16_t>(pc - 3) }; \
+			m_Stop = StopReason::Error; \
+			goto done; \
+		} \
+	} \
+	else { \
+		if (cond) { \
+			PROFILE_CALL(addr_); \
+			cycles += taken; \
+			WRITE(--sp, pc >> 8); \
+			WRITE(--sp, pc & 0xFF); \
+			pc = addr_; \
+		} \
+		COVER(); \
+	} }
+
+// With fusion, the first instruction of a pair in i8080::FusedPartner()
+// runs the second, body, when its opcode comes next and the budget has
+// room for it, and the dispatch in between is saved
+#define FUSE(next, body) \
+	if constexpr (FUSED) { \
+		if (count > 0 && mem->Fetch(pc) == (next)) { \
+			count--; \
+			pc++; \
+			op = (next); \
+			cycles += s_CycleTable[next]; \
+			body; \
+		} \
+	}
+
+#if I8080_COMPUTED_GOTO
+	#define OPCODE(n)	op_##n
+	#define NEXT		do { if (PROFILED) goto profile; if (count-- == 0) goto done; op = FETCH(); cycles += s_CycleTable[op]; goto *s_Labels[op]; } while (0)
+#else
+	#define OPCODE(n)	case n
+	#define NEXT		goto dispatch
+#endif
+
+
+///////////////////////////////////
+////////////THREADED//////////////
+/////////////////////////////////
+
+// Second execution engine. The CPU state lives in locals for the
+// whole run and is only written back to the members on exit, so
+// the compiler can keep it in host registers across instructions.
+// Semantics follow the handlers in i8080.cpp opcode for opcode.
+// A profiled run is its own instantiation, so an unprofiled one pays
+// nothing for it, and so is a fused one. Profiled runs are not fused,
+// each instruction is counted on its own.
+void i8080::RunThreaded(uint64_t count)
+{
+	if (m_Profiler)
+		ThreadedLoop<true, false>(count);
+	else if (m_Fuse)
+		ThreadedLoop<false, true>(count);
+	else
+		ThreadedLoop<false, false>(count);
+}
+
+template<bool PROFILED, bool FUSED>
+void i8080::ThreadedLoop(uint64_t count)
+{
+	Memory* mem = m_Memory;
+
+	RegisterFile r = registers;
+
+	uint16_t pc = PC;
+	uint16_t sp = SP;
+	flags f = m_flags;
+
+	uint64_t cycles = m_Cycles;
+	uint8_t op = 0;
+
+	// The instruction being profiled, see PROFILE_END()
+	[[maybe_unused]] Profiler* profiler = m_Profiler;
+	[[maybe_unused]] bool pending = false;
+	[[maybe_unused]] uint16_t start = pc;
+	[[maybe_unused]] uint64_t startCycles = cycles;
+	[[maybe_unused]] int32_t called = -1;
+	[[maybe_unused]] bool returned = false;
+
+#if I8080_COMPUTED_GOTO
+	#define LABEL(n)		&&op_##n
+	#define LABEL_ROW(h) \
+		LABEL(h##0), LABEL(h##1), LABEL(h##2), LABEL(h##3), LABEL(h##4), LABEL(h##5), LABEL(h##6), LABEL(h##7), \
+		LABEL(h##8), LABEL(h##9), LABEL(h##A), LABEL(h##B), LABEL(h##C), LABEL(h##D), LABEL(h##E), LABEL(h##F)
+
+	static void* const s_Labels[256] = {
+		LABEL_ROW(0x0), LABEL_ROW(0x1), LABEL_ROW(0x2), LABEL_ROW(0x3),
+		LABEL_ROW(0x4), LABEL_ROW(0x5), LABEL_ROW(0x6), LABEL_ROW(0x7),
+		LABEL_ROW(0x8), LABEL_ROW(0x9), LABEL_ROW(0xA), LABEL_ROW(0xB),
+		LABEL_ROW(0xC), LABEL_ROW(0xD), LABEL_ROW(0xE), LABEL_ROW(0xF),
+	};
+
+	#undef LABEL_ROW
+	#undef LABEL
+
+	NEXT;
+
+	// A profiled run dispatches from here alone, so the profiler is
+	// inlined once rather than at every opcode
+profile:
+	PROFILE_END();
+
+	if (count-- == 0)
+		goto done;
+
+	PROFILE_START();
+	op = FETCH();
+	cycles += s_CycleTable[op];
+	goto *s_Labels[op];
+	{
+#else
+dispatch:
+	PROFILE_END();
+
+	if (count-- == 0)
+		goto done;
+
+	PROFILE_START();
+	op = FETCH();
+	cycles += s_CycleTable[op];
+
+	switch (op)
+	{
+#endif
+		OPCODE(0x00): NEXT;
+		OPCODE(0x01): PAIR(BC) = FETCH_WORD(); NEXT;
+		OPCODE(0x02): WRITE(PAIR(BC), r[A]); NEXT;
+		OPCODE(0x03): PAIR(BC)++; NEXT;
+		OPCODE(0x04): r[B] = f.inr(r[B]); NEXT;
+		OPCODE(0x05): r[B] = f.dcr(r[B]); FUSE(0xC2, DO_JMP(f.z() == 0)); NEXT;
+		OPCODE(0x06): r[B] = FETCH(); NEXT;
+		OPCODE(0x07): DO_RLC(); NEXT;
+		OPCODE(0x08): goto invalid;
+		OPCODE(0x09): DO_DAD(PAIR(BC)); NEXT;
+		OPCODE(0x0A): r[A] = READ(PAIR(BC)); FUSE(0x12, WRITE(PAIR(DE), r[A])); NEXT;
+		OPCODE(0x0B): PAIR(BC)--; NEXT;
+		OPCODE(0x0C): r[C] = f.inr(r[C]); NEXT;
+		OPCODE(0x0D): r[C] = f.dcr(r[C]); FUSE(0xC2, DO_JMP(f.z() == 0)); NEXT;
+		OPCODE(0x0E): r[C] = FETCH(); NEXT;
+		OPCODE(0x0F): DO_RRC(); NEXT;
+		OPCODE(0x10): goto invalid;
+		OPCODE(0x11): PAIR(DE) = FETCH_WORD(); NEXT;
+		OPCODE(0x12): WRITE(PAIR(DE), r[A]); NEXT;
+		OPCODE(0x13): PAIR(DE)++; NEXT;
+		OPCODE(0x14): r[D] = f.inr(r[D]); NEXT;
+		OPCODE(0x15): r[D] = f.dcr(r[D]); FUSE(0xC2, DO_JMP(f.z() == 0)); NEXT;
+		OPCODE(0x16): r[D] = FETCH(); NEXT;
+		OPCODE(0x17): DO_RAL(); NEXT;
+		OPCODE(0x18): goto invalid;
+		OPCODE(0x19): DO_DAD(PAIR(DE)); NEXT;
+		OPCODE(0x1A): r[A] = READ(PAIR(DE)); FUSE(0x02, WRITE(PAIR(BC), r[A])); NEXT;
+		OPCODE(0x1B): PAIR(DE)--; NEXT;
+		OPCODE(0x1C): r[E] = f.inr(r[E]); NEXT;
+		OPCODE(0x1D): r[E] = f.dcr(r[E]); FUSE(0xC2, DO_JMP(f.z() == 0)); NEXT;
+		OPCODE(0x1E): r[E] = FETCH(); NEXT;
+		OPCODE(0x1F): DO_RAR(); NEXT;
+		OPCODE(0x20): goto invalid;
+		OPCODE(0x21): PAIR(HL) = FETCH_WORD(); NEXT;
+		OPCODE(0x22): { uint16_t addr = FETCH_WORD(); WRITE(addr, r[L]); WRITE(addr + 1, r[H]); } NEXT;
+		OPCODE(0x23): PAIR(HL)++; FUSE(0x7E, r[A] = READ(PAIR(HL))); NEXT;
+		OPCODE(0x24): r[H] = f.inr(r[H]); NEXT;
+		OPCODE(0x25): r[H] = f.dcr(r[H]); FUSE(0xC2, DO_JMP(f.z() == 0)); NEXT;
+		OPCODE(0x26): r[H] = FETCH(); NEXT;
+		OPCODE(0x27): r[A] = f.daa(r[A]); NEXT;
+		OPCODE(0x28): goto invalid;
+		OPCODE(0x29): DO_DAD(PAIR(HL)); NEXT;
+		OPCODE(0x2A): { uint16_t addr = FETCH_WORD(); r[L] = READ(addr); r[H] = READ(addr + 1); } NEXT;
+		OPCODE(0x2B): PAIR(HL)--; NEXT;
+		OPCODE(0x2C): r[L] = f.inr(r[L]); NEXT;
+		OPCODE(0x2D): r[L] = f.dcr(r[L]); FUSE(0xC2, DO_JMP(f.z() == 0)); NEXT;
+		OPCODE(0x2E): r[L] = FETCH(); NEXT;
+		OPCODE(0x2F): r[A] = ~r[A]; NEXT;
+		OPCODE(0x30): goto invalid;
+		OPCODE(0x31): sp = FETCH_WORD(); NEXT;
+		OPCODE(0x32): WRITE(FETCH_WORD(), r[A]); NEXT;
+		OPCODE(0x33): sp++; NEXT;
+		OPCODE(0x34): { uint16_t addr = PAIR(HL); WRITE(addr, f.inr(READ(addr))); } NEXT;
+		OPCODE(0x35): { uint16_t addr = PAIR(HL); WRITE(addr, f.dcr(READ(addr))); } NEXT;
+		OPCODE(0x36): { uint8_t byte = FETCH(); WRITE(PAIR(HL), byte); } NEXT;
+		OPCODE(0x37): f.setCY(0x1); NEXT;
+		OPCODE(0x38): goto invalid;
+		OPCODE(0x39): DO_DAD(sp); NEXT;
+		OPCODE(0x3A): r[A] = READ(FETCH_WORD()); NEXT;
+		OPCODE(0x3B): sp--; NEXT;
+		OPCODE(0x3C): r[A] = f.inr(r[A]); NEXT;
+		OPCODE(0x3D): r[A] = f.dcr(r[A]); FUSE(0xC2, DO_JMP(f.z() == 0)); NEXT;
+		OPCODE(0x3E): r[A] = FETCH(); NEXT;
+		OPCODE(0x3F): f.setCY(!f.cy()); NEXT;
+		OPCODE(0x40): r[B] = r[B]; NEXT;
+		OPCODE(0x41): r[B] = r[C]; NEXT;
+		OPCODE(0x42): r[B] = r[D]; NEXT;
+		OPCODE(0x43): r[B] = r[E]; NEXT;
+		OPCODE(0x44): r[B] = r[H]; NEXT;
+		OPCODE(0x45): r[B] = r[L]; NEXT;
+		OPCODE(0x46): r[B] = READ(PAIR(HL)); NEXT;
+		OPCODE(0x47): r[B] = r[A]; NEXT;
+		OPCODE(0x48): r[C] = r[B]; NEXT;
+		OPCODE(0x49): r[C] = r[C]; NEXT;
+		OPCODE(0x4A): r[C] = r[D]; NEXT;
+		OPCODE(0x4B): r[C] = r[E]; NEXT;
+		OPCODE(0x4C): r[C] = r[H]; NEXT;
+		OPCODE(0x4D): r[C] = r[L]; NEXT;
+		OPCODE(0x4E): r[C] = READ(PAIR(HL)); NEXT;
+		OPCODE(0x4F): r[C] = r[A]; NEXT;
+		OPCODE(0x50): r[D] = r[B]; NEXT;
+		OPCODE(0x51): r[D] = r[C]; NEXT;
+		OPCODE(0x52): r[D] = r[D]; NEXT;
+		OPCODE(0x53): r[D] = r[E]; NEXT;
+		OPCODE(0x54): r[D] = r[H]; NEXT;
+		OPCODE(0x55): r[D] = r[L]; NEXT;
+		OPCODE(0x56): r[D] = READ(PAIR(HL)); NEXT;
+		OPCODE(0x57): r[D] = r[A]; NEXT;
+		OPCODE(0x58): r[E] = r[B]; NEXT;
+		OPCODE(0x59): r[E] = r[C]; NEXT;
+		OPCODE(0x5A): r[E] = r[D]; NEXT;
+		OPCODE(0x5B): r[E] = r[E]; NEXT;
+		OPCODE(0x5C): r[E] = r[H]; NEXT;
+		OPCODE(0x5D): r[E] = r[L]; NEXT;
+		OPCODE(0x5E): r[E] = READ(PAIR(HL)); NEXT;
+		OPCODE(0x5F): r[E] = r[A]; NEXT;
+		OPCODE(0x60): r[H] = r[B]; NEXT;
+		OPCODE(0x61): r[H] = r[C]; NEXT;
+		OPCODE(0x62): r[H] = r[D]; NEXT;
+		OPCODE(0x63): r[H] = r[E]; NEXT;
+		OPCODE(0x64): r[H] = r[H]; NEXT;
+		OPCODE(0x65): r[H] = r[L]; NEXT;
+		OPCODE(0x66): r[H] = READ(PAIR(HL)); NEXT;
+		OPCODE(0x67): r[H] = r[A]; NEXT;
+		OPCODE(0x68): r[L] = r[B]; NEXT;
+		OPCODE(0x69): r[L] = r[C]; NEXT;
+		OPCODE(0x6A): r[L] = r[D]; NEXT;
+		OPCODE(0x6B): r[L] = r[E]; NEXT;
+		OPCODE(0x6C): r[L] = r[H]; NEXT;
+		OPCODE(0x6D): r[L] = r[L]; NEXT;
+		OPCODE(0x6E): r[L] = READ(PAIR(HL)); NEXT;
+		OPCODE(0x6F): r[L] = r[A]; NEXT;
+		OPCODE(0x70): WRITE(PAIR(HL), r[B]); NEXT;
+		OPCODE(0x71): WRITE(PAIR(HL), r[C]); NEXT;
+		OPCODE(0x72): WRITE(PAIR(HL), r[D]); NEXT;
+		OPCODE(0x73): WRITE(PAIR(HL), r[E]); NEXT;
+		OPCODE(0x74): WRITE(PAIR(HL), r[H]); NEXT;
+		OPCODE(0x75): WRITE(PAIR(HL), r[L]); NEXT;
+		OPCODE(0x76): m_Stop = StopReason::Halted; goto done;
+		OPCODE(0x77): WRITE(PAIR(HL), r[A]); FUSE(0x23, PAIR(HL)++); NEXT;
+		OPCODE(0x78): r[A] = r[B]; NEXT;
+		OPCODE(0x79): r[A] = r[C]; NEXT;
+		OPCODE(0x7A): r[A] = r[D]; NEXT;
+		OPCODE(0x7B): r[A] = r[E]; NEXT;
+		OPCODE(0x7C): r[A] = r[H]; NEXT;
+		OPCODE(0x7D): r[A] = r[L]; NEXT;
+		OPCODE(0x7E): r[A] = READ(PAIR(HL)); NEXT;
+		OPCODE(0x7F): r[A] = r[A]; NEXT;
+		OPCODE(0x80): DO_ADD(r[B]); NEXT;
+		OPCODE(0x81): DO_ADD(r[C]); NEXT;
+		OPCODE(0x82): DO_ADD(r[D]); NEXT;
+		OPCODE(0x83): DO_ADD(r[E]); NEXT;
+		OPCODE(0x84): DO_ADD(r[H]); NEXT;
+		OPCODE(0x85): DO_ADD(r[L]); NEXT;
+		OPCODE(0x86): DO_ADD(READ(PAIR(HL))); NEXT;
+		OPCODE(0x87): DO_ADD(r[A]); NEXT;
+		OPCODE(0x88): DO_ADC(r[B]); NEXT;
+		OPCODE(0x89): DO_ADC(r[C]); NEXT;
+		OPCODE(0x8A): DO_ADC(r[D]); NEXT;
+		OPCODE(0x8B): DO_ADC(r[E]); NEXT;
+		OPCODE(0x8C): DO_ADC(r[H]); NEXT;
+		OPCODE(0x8D): DO_ADC(r[L]); NEXT;
+		OPCODE(0x8E): DO_ADC(READ(PAIR(HL))); NEXT;
+		OPCODE(0x8F): DO_ADC(r[A]); NEXT;
+		OPCODE(0x90): DO_SUB(r[B]); NEXT;
+		OPCODE(0x91): DO_SUB(r[C]); NEXT;
+		OPCODE(0x92): DO_SUB(r[D]); NEXT;
+		OPCODE(0x93): DO_SUB(r[E]); NEXT;
+		OPCODE(0x94): DO_SUB(r[H]); NEXT;
+		OPCODE(0x95): DO_SUB(r[L]); NEXT;
+		OPCODE(0x96): DO_SUB(READ(PAIR(HL))); NEXT;
+		OPCODE(0x97): DO_SUB(r[A]); NEXT;
+		OPCODE(0x98): DO_SBB(r[B]); NEXT;
+		OPCODE(0x99): DO_SBB(r[C]); NEXT;
+		OPCODE(0x9A): DO_SBB(r[D]); NEXT;
+		OPCODE(0x9B): DO_SBB(r[E]); NEXT;
+		OPCODE(0x9C): DO_SBB(r[H]); NEXT;
+		OPCODE(0x9D): DO_SBB(r[L]); NEXT;
+		OPCODE(0x9E): DO_SBB(READ(PAIR(HL))); NEXT;
+		OPCODE(0x9F): DO_SBB(r[A]); NEXT;
+		OPCODE(0xA0): DO_ANA(r[B]); NEXT;
+		OPCODE(0xA1): DO_ANA(r[C]); NEXT;
+		OPCODE(0xA2): DO_ANA(r[D]); NEXT;
+		OPCODE(0xA3): DO_ANA(r[E]); NEXT;
+		OPCODE(0xA4): DO_ANA(r[H]); NEXT;
+		OPCODE(0xA5): DO_ANA(r[L]); NEXT;
+		OPCODE(0xA6): DO_ANA(READ(PAIR(HL))); NEXT;
+		OPCODE(0xA7): DO_ANA(r[A]); NEXT;
+		OPCODE(0xA8): DO_XRA(r[B]); NEXT;
+		OPCODE(0xA9): DO_XRA(r[C]); NEXT;
+		OPCODE(0xAA): DO_XRA(r[D]); NEXT;
+		OPCODE(0xAB): DO_XRA(r[E]); NEXT;
+		OPCODE(0xAC): DO_XRA(r[H]); NEXT;
+		OPCODE(0xAD): DO_XRA(r[L]); NEXT;
+		OPCODE(0xAE): DO_XRA(READ(PAIR(HL))); NEXT;
+		OPCODE(0xAF): DO_XRA(r[A]); NEXT;
+		OPCODE(0xB0): DO_ORA(r[B]); NEXT;
+		OPCODE(0xB1): DO_ORA(r[C]); NEXT;
+		OPCODE(0xB2): DO_ORA(r[D]); NEXT;
+		OPCODE(0xB3): DO_ORA(r[E]); NEXT;
+		OPCODE(0xB4): DO_ORA(r[H]); NEXT;
+		OPCODE(0xB5): DO_ORA(r[L]); NEXT;
+		OPCODE(0xB6): DO_ORA(READ(PAIR(HL))); NEXT;
+		OPCODE(0xB7): DO_ORA(r[A]); NEXT;
+		OPCODE(0xB8): DO_CMP(r[B]); NEXT;
+		OPCODE(0xB9): DO_CMP(r[C]); NEXT;
+		OPCODE(0xBA): DO_CMP(r[D]); NEXT;
+		OPCODE(0xBB): DO_CMP(r[E]); NEXT;
+		OPCODE(0xBC): DO_CMP(r[H]); NEXT;
+		OPCODE(0xBD): DO_CMP(r[L]); NEXT;
+		OPCODE(0xBE): DO_CMP(READ(PAIR(HL))); NEXT;
+		OPCODE(0xBF): DO_CMP(r[A]); NEXT;
+		OPCODE(0xC0): DO_RET(f.z() == 0, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xC1): r[C] = READ(sp++); r[B] = READ(sp++); NEXT;
+		OPCODE(0xC2): DO_JMP(f.z() == 0); NEXT;
+		OPCODE(0xC3): DO_JMP(true); NEXT;
+		OPCODE(0xC4): DO_CALL(f.z() == 0, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xC5): WRITE(--sp, r[B]); WRITE(--sp, r[C]); NEXT;
+		OPCODE(0xC6): DO_ADI(FETCH()); NEXT;
+		OPCODE(0xC7): goto invalid;
+		OPCODE(0xC8): DO_RET(f.z() == 1, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xC9): DO_RET(true, 0); NEXT;
+		OPCODE(0xCA): DO_JMP(f.z() == 1); NEXT;
+		OPCODE(0xCB): DO_JMP(f.z() == 1); NEXT;
+		OPCODE(0xCC): DO_CALL(f.z() == 1, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xCD): DO_CALL(true, 0); NEXT;
+		OPCODE(0xCE): DO_ACI(FETCH()); NEXT;
+		OPCODE(0xCF): goto invalid;
+		OPCODE(0xD0): DO_RET(f.cy() == 0, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xD1): r[E] = READ(sp++); r[D] = READ(sp++); NEXT;
+		OPCODE(0xD2): DO_JMP(f.cy() == 0); NEXT;
+		OPCODE(0xD3): DO_JMP(f.cy() == 0); NEXT;
+		OPCODE(0xD4): DO_CALL(f.cy() == 0, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xD5): WRITE(--sp, r[D]); WRITE(--sp, r[E]); NEXT;
+		OPCODE(0xD6): DO_SUI(FETCH()); NEXT;
+		OPCODE(0xD7): goto invalid;
+		OPCODE(0xD8): DO_RET(f.cy() == 1, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xD9): DO_RET(f.cy() == 1, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xDA): DO_JMP(f.cy() == 1); NEXT;
+		OPCODE(0xDB): DO_JMP(f.cy() == 1); NEXT;
+		OPCODE(0xDC): DO_CALL(f.cy() == 1, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xDD): DO_CALL(f.cy() == 1, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xDE): DO_SBI(FETCH()); NEXT;
+		OPCODE(0xDF): goto invalid;
+		OPCODE(0xE0): DO_RET(f.p() == 0, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xE1): r[L] = READ(sp++); r[H] = READ(sp++); NEXT;
+		OPCODE(0xE2): DO_JMP(f.p() == 0); NEXT;
+		OPCODE(0xE3): DO_XTHL(); NEXT;
+		OPCODE(0xE4): DO_CALL(f.p() == 0, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xE5): WRITE(--sp, r[H]); WRITE(--sp, r[L]); NEXT;
+		OPCODE(0xE6): DO_ANI(FETCH()); NEXT;
+		OPCODE(0xE7): goto invalid;
+		OPCODE(0xE8): DO_RET(f.p() == 1, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xE9): pc = PAIR(HL); COVER(); NEXT;
+		OPCODE(0xEA): DO_JMP(f.p() == 1); NEXT;
+		OPCODE(0xEB): DO_XCHG(); NEXT;
+		OPCODE(0xEC): DO_CALL(f.p() == 1, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xED): DO_CALL(f.p() == 1, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xEE): DO_XRI(FETCH()); NEXT;
+		OPCODE(0xEF): goto invalid;
+		OPCODE(0xF0): DO_RET(f.s() == 0, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xF1): f.set(READ(sp++)); r[A] = READ(sp++); NEXT;
+		OPCODE(0xF2): DO_JMP(f.s() == 0); NEXT;
+		OPCODE(0xF3): DO_JMP(f.s() == 0); NEXT;
+		OPCODE(0xF4): DO_CALL(f.s() == 0, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xF5): WRITE(--sp, r[A]); WRITE(--sp, f.get()); NEXT;
+		OPCODE(0xF6): DO_ORI(FETCH()); NEXT;
+		OPCODE(0xF7): goto invalid;
+		OPCODE(0xF8): DO_RET(f.s() == 1, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xF9): sp = PAIR(HL); NEXT;
+		OPCODE(0xFA): DO_JMP(f.s() == 1); NEXT;
+		OPCODE(0xFB): DO_JMP(f.s() == 1); NEXT;
+		OPCODE(0xFC): DO_CALL(f.s() == 1, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xFD): DO_CALL(f.s() == 1, BRANCH_TAKEN_CYCLES); NEXT;
+		OPCODE(0xFE): DO_CPI(FETCH()); FUSE(0xCA, DO_JMP(f.z() == 1)); NEXT;
+		OPCODE(0xFF): goto invalid;
+	}
+
+invalid:
+	m_Fault = { Fault::Kind::Opcode, op, static_cast<uint16_t>(pc - 1) };
+	m_Stop = StopReason::Error;
+
+done:
+	PROFILE_END();
+
+	registers = r;
+	PC = pc;
+	SP = sp;
+	m_flags = f;
+	m_Cycles = cycles;
+}
@@ -1,26 +1,859 @@
+#include <algorithm>
 #include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
 
 #include "i8080.h"
 #include "Memory.h"
 #include "CPM.h"
+#include "Profiler.h"
+#include "Loader.h"
+#include "Checkpoint.h"
+#include "Batch.h"
+#include "Lockstep.h"
+#include "ForkServer.h"
+#include "BankSwitch.h"
 
-int main()
+// Instructions handed to the engine per call to Run()
+#define RUN_SLICE 1000000
+
+// Instructions each engine runs between state comparisons
+#define COMPARE_SLICE 4096
+
+// Longest random input --fuzz feeds the guest
+#define FUZZ_MAX_INPUT 64
+
+// Slices between two checkpoints unless --checkpoint-every says otherwise
+#define CHECKPOINT_SLICES 100
+
+// Rows per table in the --profile report
+#define PROFILE_REPORT_ROWS 20
+
+static void PrintState(const char* name, const i8080::State& state)
+{
+	fprintf(stderr, "%-12s PC=0x%04X SP=0x%04X F=0x%02X A=0x%02X B=0x%02X C=0x%02X D=0x%02X E=0x%02X H=0x%02X L=0x%02X\n",
+		name, state.PC, state.SP, state.flags,
+		state.registers[A], state.registers[B], state.registers[C], state.registers[D],
+		state.registers[E], state.registers[H], state.registers[L]);
+}
+
+// What stopped a machine with StopReason::Error, the CPU itself prints
+// nothing
+static void PrintFault(FILE* file, const i8080::Fault& fault)
+{
+	switch (fault.kind)
+	{
+		case i8080::Fault::Kind::Opcode:
+			fprintf(file, "INVALID OPERATION 0x%02X at 0x%04X\n", fault.code, fault.PC);
+			break;
+
+		case i8080::Fault::Kind::BDOS:
+			fprintf(file, "INVALID CPM FUNCTION CALL 0x%02X at 0x%04X\n", fault.code, fault.PC);
+			break;
+
+		default:
+			break;
+	}
+}
+
+static const char* GetEngineName(i8080::Engine engine)
+{
+	switch (engine)
+	{
+		case i8080::Engine::Threaded:	return "Threaded:";
+		case i8080::Engine::Blocks:		return "Blocks:";
+		case i8080::Engine::Jit:		return "JIT:";
+		default:						return "Interpreter:";
+	}
+}
+
+// The core falls back from the JIT without a word, the host says so
+static void ReportEngine(i8080::Engine requested, i8080::Engine running)
+{
+	if (requested != running)
+		fprintf(stderr, "JIT not available, using blocks\n");
+}
+
+static const char* GetStopReasonName(i8080::StopReason reason)
+{
+	switch (reason)
+	{
+		case i8080::StopReason::Halted:		return "halted";
+		case i8080::StopReason::Exit:		return "exited";
+		case i8080::StopReason::Breakpoint:	return "breakpoint";
+		case i8080::StopReason::Watchpoint:	return "watchpoint";
+		case i8080::StopReason::Error:		return "failed";
+		default:							return "running";
+	}
+}
+
+// Loads each "path[@address]" image in turn. Prints the first error.
+static bool LoadImages(Memory* memory, const std::vector<const char*>& images)
+{
+	for (const char* spec : images) {
+		std::string path, error;
+		uint16_t address;
+
+		if (!Loader::ParseImageSpec(spec, path, address, error) ||
+			!Loader::Load(memory, path.c_str(), address, error)) {
+			fprintf(stderr, "%s\n", error.c_str());
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Prints a trace file written by --trace, one instruction per line
+static int DecodeTrace(const char* tracePath)
+{
+	std::vector<TraceRecord> records;
+
+	if (!TraceBuffer::Load(tracePath, records)) {
+		fprintf(stderr, "Failed to read trace %s\n", tracePath);
+		return 1;
+	}
+
+	for (const TraceRecord& record : records) {
+		char text[32];
+		i8080::Disassemble(record.opcode, record.operand, text, sizeof(text));
+
+		printf("0x%04X  %-14s A=0x%02X F=0x%02X CYC=%llu\n",
+			record.PC, text, record.accumulator, record.flags, (unsigned long long)record.cycles);
+	}
+
+	return 0;
+}
+
+#if I8080_TRACE
+static TraceBuffer* s_Trace = nullptr;
+static const char* s_TracePath = nullptr;
+
+// Registered with atexit() so the trace is saved however main() returns
+static void SaveTrace()
+{
+	if (s_Trace && !s_Trace->Save(s_TracePath))
+		fprintf(stderr, "Failed to write trace %s\n", s_TracePath);
+}
+#endif
+
+static Profiler* s_Profiler = nullptr;
+static const char* s_ProfilePath = nullptr;
+static const Memory* s_ProfileMemory = nullptr;
+
+// Registered with atexit() for the same reason as SaveTrace()
+static void SaveProfile()
+{
+	if (!s_Profiler)
+		return;
+
+	if (!s_Profiler->SaveFolded(s_ProfilePath))
+		fprintf(stderr, "Failed to write profile %s\n", s_ProfilePath);
+
+	s_Profiler->PrintReport(stderr, s_ProfileMemory, PROFILE_REPORT_ROWS);
+}
+
+// Pages first..first+count-1 banked into banks copies, selected through
+// the register at registerAddr. No banks while count is 0.
+struct BankOptions {
+	uint32_t first = 0;
+	uint32_t count = 0;
+	uint32_t banks = 0;
+	uint32_t registerAddr = 0;
+};
+
+// "FIRST,COUNT,BANKS,REGISTER", all in hex
+static bool ParseBanks(const char* text, BankOptions& options)
+{
+	uint32_t* fields[] = { &options.first, &options.count, &options.banks, &options.registerAddr };
+
+	for (size_t i = 0; i < 4; i++) {
+		char* end;
+		*fields[i] = static_cast<uint32_t>(strtoul(text, &end, 16));
+
+		if (end == text || *end != (i < 3 ? ',' : '\0'))
+			return false;
+
+		text = end + 1;
+	}
+
+	return options.first < MEMORY_PAGES && options.registerAddr < MEMORY_SIZE;
+}
+
+// Banks the memory as --banks asked. Prints why it cannot.
+static bool MapBanks(Memory* memory, const BankOptions& options, std::unique_ptr<BankSwitch>& banks)
+{
+	if (options.count == 0)
+		return true;
+
+	banks = std::make_unique<BankSwitch>(memory, static_cast<uint8_t>(options.first), options.count,
+		options.banks, static_cast<uint16_t>(options.registerAddr));
+
+	if (!banks->Valid())
+		fprintf(stderr, "Cannot bank %u pages from page 0x%02X with the register at 0x%04X\n",
+			options.count, options.first, options.registerAddr);
+
+	return banks->Valid();
+}
+
+// The banks not selected, the selected one is in m_Memory
+static bool SameBanks(const Memory* a, const Memory* b)
+{
+	const Memory::Banks& x = a->GetBanks();
+	const Memory::Banks& y = b->GetBanks();
+
+	if (x.selected != y.selected || x.pages.size() != y.pages.size())
+		return false;
+
+	const size_t pages = a->GetBankCount() ? x.pages.size() / a->GetBankCount() : 0;
+
+	for (size_t slot = 0; slot < x.pages.size(); slot++) {
+		if (slot / pages != x.selected && *x.pages[slot] != *y.pages[slot])
+			return false;
+	}
+
+	return true;
+}
+
+// Runs the same ROM on the interpreter and another engine in lockstep
+// and stops at the first slice after which registers, flags, memory,
+// console output or the stop reason differ. Returns 0 if both machines
+// stop the same way, after printing the console output they share. The
+// reference interpreter never fuses, so fusion is checked on the other.
+static int CompareEngines(const std::vector<const char*>& images, i8080::Engine engine, bool fuse, const BankOptions& bankOptions)
+{
+	std::unique_ptr<Memory> memory[2];
+	std::unique_ptr<BankSwitch> banks[2];
+	std::unique_ptr<CPM> cpm[2];
+	std::unique_ptr<i8080> cpu[2];
+	std::string output[2];
+	BufferConsole console[2] = { BufferConsole(&output[0]), BufferConsole(&output[1]) };
+
+	for (int i = 0; i < 2; i++) {
+		memory[i] = std::make_unique<Memory>();
+
+		if (!LoadImages(memory[i].get(), images) || !MapBanks(memory[i].get(), bankOptions, banks[i]))
+			return 1;
+
+		cpm[i] = std::make_unique<CPM>(memory[i].get());
+		cpm[i]->SetConsole(&console[i]);
+		cpu[i] = std::make_unique<i8080>(memory[i].get(), cpm[i].get());
+	}
+
+	cpu[0]->SetEngine(i8080::Engine::Interpreter);
+	cpu[0]->SetFusion(false);
+	cpu[1]->SetEngine(engine);
+	cpu[1]->SetFusion(fuse);
+	ReportEngine(engine, cpu[1]->GetEngine());
+
+	uint64_t executed = 0;
+
+	while (1) {
+		i8080::StopReason reason[2];
+		reason[0] = cpu[0]->Run(COMPARE_SLICE);
+		reason[1] = cpu[1]->Run(COMPARE_SLICE);
+		executed += COMPARE_SLICE;
+
+		bool sameState = cpu[0]->GetState() == cpu[1]->GetState();
+		bool sameMemory = memcmp(memory[0]->m_Memory, memory[1]->m_Memory, sizeof(memory[0]->m_Memory)) == 0 &&
+			SameBanks(memory[0].get(), memory[1].get());
+		bool sameReason = reason[0] == reason[1];
+		bool sameCycles = cpu[0]->GetCycles() == cpu[1]->GetCycles();
+		bool sameOutput = output[0] == output[1];
+
+		if (!sameState || !sameMemory || !sameReason || !sameCycles || !sameOutput) {
+			fprintf(stderr, "Engines diverged within %llu instructions%s%s\n", (unsigned long long)executed,
+				sameMemory ? "" : " (memory differs)", sameOutput ? "" : " (output differs)");
+			fprintf(stderr, "Interpreter %s after %llu T-states, %s %s after %llu T-states\n",
+				GetStopReasonName(reason[0]), (unsigned long long)cpu[0]->GetCycles(),
+				GetEngineName(engine), GetStopReasonName(reason[1]), (unsigned long long)cpu[1]->GetCycles());
+			PrintState("Interpreter:", cpu[0]->GetState());
+			PrintState(GetEngineName(engine), cpu[1]->GetState());
+			return 1;
+		}
+
+		if (reason[0] != i8080::StopReason::Budget) {
+			fprintf(stderr, "Engines matched: both %s within %llu instructions, %llu T-states\n",
+				GetStopReasonName(reason[0]), (unsigned long long)executed, (unsigned long long)cpu[0]->GetCycles());
+			PrintState("Final:", cpu[0]->GetState());
+			PrintFault(stderr, cpu[0]->GetState().fault);
+			fwrite(output[0].data(), 1, output[0].size(), stdout);
+			return 0;
+		}
+	}
+}
+
+// Runs every lane of a Lockstep next to a scalar interpreter of its own,
+// each loaded with the ROM and, if seedAddr is given, its lane index
+// written there so that the lanes' data and paths differ. Stops at the
+// first slice after which a lane's registers, flags, cycles, memory,
+// console output or stop reason differ from its interpreter's. Returns 0
+// if every lane matches to the end.
+static int CompareLockstep(const std::vector<const char*>& images, int seedAddr)
+{
+	Lockstep* lockstep = new Lockstep();
+	const uint32_t lanes = lockstep->GetLaneCount();
+
+	std::vector<Memory*> memory(lanes);
+	std::vector<CPM*> cpm(lanes);
+	std::vector<i8080*> cpu(lanes);
+	std::vector<std::string> output[2] = { std::vector<std::string>(lanes), std::vector<std::string>(lanes) };
+	std::vector<BufferConsole> console[2];
+
+	// Filled up front, the CPMs keep pointers into them
+	for (uint32_t lane = 0; lane < lanes; lane++) {
+		console[0].emplace_back(&output[0][lane]);
+		console[1].emplace_back(&output[1][lane]);
+	}
+
+	for (uint32_t lane = 0; lane < lanes; lane++) {
+		memory[lane] = new Memory();
+
+		if (!LoadImages(memory[lane], images) || !LoadImages(lockstep->GetMemory(lane), images))
+			return 1;
+
+		if (seedAddr >= 0) {
+			memory[lane]->Write(static_cast<uint16_t>(seedAddr), static_cast<uint8_t>(lane));
+			lockstep->GetMemory(lane)->Write(static_cast<uint16_t>(seedAddr), static_cast<uint8_t>(lane));
+		}
+
+		cpm[lane] = new CPM(memory[lane]);
+		cpm[lane]->SetConsole(&console[0][lane]);
+		lockstep->GetCPM(lane)->SetConsole(&console[1][lane]);
+
+		cpu[lane] = new i8080(memory[lane], cpm[lane]);
+	}
+
+	double scalarSeconds = 0, lockstepSeconds = 0;
+	uint64_t executed = 0;
+
+	while (1) {
+		auto start = std::chrono::steady_clock::now();
+		for (uint32_t lane = 0; lane < lanes; lane++)
+			cpu[lane]->Run(COMPARE_SLICE);
+
+		auto middle = std::chrono::steady_clock::now();
+		uint32_t running = lockstep->Run(COMPARE_SLICE);
+
+		auto end = std::chrono::steady_clock::now();
+		scalarSeconds += std::chrono::duration<double>(middle - start).count();
+		lockstepSeconds += std::chrono::duration<double>(end - middle).count();
+		executed += COMPARE_SLICE;
+
+		for (uint32_t lane = 0; lane < lanes; lane++) {
+			bool sameState = cpu[lane]->GetState() == lockstep->GetState(lane);
+			bool sameMemory = memcmp(memory[lane]->m_Memory, lockstep->GetMemory(lane)->m_Memory, sizeof(memory[lane]->m_Memory)) == 0;
+			bool sameOutput = output[0][lane] == output[1][lane];
+
+			if (!sameState || !sameMemory || !sameOutput) {
+				fprintf(stderr, "Lane %u diverged within %llu instructions%s%s\n", lane, (unsigned long long)executed,
+					sameMemory ? "" : " (memory differs)", sameOutput ? "" : " (output differs)");
+				PrintState("Interpreter:", cpu[lane]->GetState());
+				PrintState("Lockstep:", lockstep->GetState(lane));
+				return 1;
+			}
+		}
+
+		if (running == 0)
+			break;
+	}
+
+	const Lockstep::Stats& stats = lockstep->GetStats();
+	const uint64_t total = stats.laneSteps + stats.scalarSteps;
+
+	fprintf(stderr, "Lanes matched: %u lanes within %llu instructions each\n", lanes, (unsigned long long)executed);
+	fprintf(stderr, "%llu convoy steps for %llu lane instructions (%.1f lanes per step), %llu run alone, %llu splits, %llu joins\n",
+		(unsigned long long)stats.vectorSteps, (unsigned long long)stats.laneSteps, stats.Occupancy(), (unsigned long long)stats.scalarSteps,
+		(unsigned long long)stats.splits, (unsigned long long)stats.joins);
+	fprintf(stderr, "%llu convoys formed, %llu handed back to the lanes' own cores\n",
+		(unsigned long long)stats.convoys, (unsigned long long)stats.disbanded);
+	fprintf(stderr, "Interpreter %.1f MIPS, lockstep %.1f MIPS over all lanes (%.1f%% in the convoy)\n",
+		total / scalarSeconds / 1e6, total / lockstepSeconds / 1e6, total ? 100.0 * stats.laneSteps / total : 0.0);
+
+	for (uint32_t lane = 0; lane < lanes; lane++) {
+		delete cpu[lane];
+		delete cpm[lane];
+		delete memory[lane];
+	}
+
+	delete lockstep;
+	return 0;
+}
+
+// Boots the ROM on a ForkServer and feeds it random inputs, reporting
+// executions per second and how the runs ended. With coverage compiled
+// in, inputs that reach new edges are kept and later ones mutated from
+// them, a fuzzer's loop in miniature.
+static int RunFuzz(const std::vector<const char*>& images, i8080::Engine engine, uint64_t executions, uint16_t bootPC,
+	ForkServer::InputMode mode, uint16_t inputAddr)
+{
+	ForkServer* server = new ForkServer();
+	server->SetEngine(engine);
+	ReportEngine(engine, server->GetEngine());
+	server->SetInputMode(mode, inputAddr);
+
+	std::string error;
+	if (!server->Boot(std::vector<std::string>(images.begin(), images.end()), bootPC, FORK_SERVER_DEFAULT_BUDGET, error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		delete server;
+		return 1;
+	}
+
+	// xorshift64, seeded the same every time so runs repeat
+	uint64_t seed = 0x9E3779B97F4A7C15ull;
+	auto next = [&seed] {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		return seed;
+	};
+
+	std::vector<uint8_t> input;
+	uint64_t reasons[static_cast<size_t>(i8080::StopReason::Error) + 1]{};
+	uint64_t cycles = 0;
+
+#if I8080_COVERAGE
+	std::vector<uint8_t> map(COVERAGE_MAP_SIZE), seen(COVERAGE_MAP_SIZE);
+	std::vector<std::vector<uint8_t>> corpus(1);
+	size_t edges = 0;
+
+	server->SetCoverage(map.data());
+#endif
+
+	// Every run starts from the boot's cycle count
+	const uint64_t bootCycles = server->GetState().cycles;
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (uint64_t i = 0; i < executions; i++) {
+#if I8080_COVERAGE
+		// One to four changes: a byte replaced, inserted or removed
+		input = corpus[next() % corpus.size()];
+
+		for (uint64_t changes = next() % 4 + 1; changes > 0; changes--) {
+			const uint64_t r = next();
+			const size_t at = input.empty() ? 0 : (r >> 8) % input.size();
+
+			if (r % 3 == 0 && !input.empty())
+				input[at] = static_cast<uint8_t>(r >> 32);
+			else if (r % 3 == 1 && input.size() < FUZZ_MAX_INPUT)
+				input.insert(input.begin() + at, static_cast<uint8_t>(r >> 32));
+			else if (!input.empty())
+				input.erase(input.begin() + at);
+		}
+#else
+		next();
+
+		input.resize(seed % (FUZZ_MAX_INPUT + 1));
+		for (size_t j = 0; j < input.size(); j++)
+			input[j] = static_cast<uint8_t>(seed >> (j % 8 * 8)) ^ static_cast<uint8_t>(j * 0x9D);
+#endif
+
+		reasons[static_cast<size_t>(server->Execute(input.data(), input.size()))]++;
+		cycles += server->GetState().cycles - bootCycles;
+
+#if I8080_COVERAGE
+		// A run touches few edges, so the map is scanned a word at a time
+		// and only nonzero words are looked into
+		bool found = false;
+
+		for (size_t word = 0; word < COVERAGE_MAP_SIZE; word += sizeof(uint64_t)) {
+			uint64_t counters;
+			memcpy(&counters, &map[word], sizeof(counters));
+
+			if (!counters)
+				continue;
+
+			for (size_t e = word; e < word + sizeof(uint64_t); e++) {
+				if (map[e] && !seen[e]) {
+					seen[e] = 1;
+					edges++;
+					found = true;
+				}
+			}
+
+			memset(&map[word], 0, sizeof(uint64_t));
+		}
+
+		if (found)
+			corpus.push_back(input);
+#endif
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	fprintf(stderr, "%llu executions in %.3f s: %.0f per second, %.1f MHz emulated\n", (unsigned long long)executions,
+		seconds, executions / seconds, cycles / seconds / 1e6);
+
+#if I8080_COVERAGE
+	fprintf(stderr, "%zu edges covered, %zu inputs kept\n", edges, corpus.size());
+#endif
+
+	for (size_t reason = 0; reason < sizeof(reasons) / sizeof(reasons[0]); reason++) {
+		if (reasons[reason])
+			fprintf(stderr, "  %-10s %llu\n", GetStopReasonName(static_cast<i8080::StopReason>(reason)), (unsigned long long)reasons[reason]);
+	}
+
+	delete server;
+	return 0;
+}
+
+// The job file's jobs, each repeat times over
+static bool LoadBatch(const char* jobPath, i8080::Engine engine, uint32_t repeat, std::vector<BatchJob>& jobs)
+{
+	std::vector<BatchJob> file;
+	std::string error;
+
+	if (!BatchRunner::LoadJobFile(jobPath, engine, file, error)) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return false;
+	}
+
+	for (uint32_t i = 0; i < repeat; i++)
+		jobs.insert(jobs.end(), file.begin(), file.end());
+
+	return true;
+}
+
+// Runs the batch on 1, 2, 4... threads up to the core count, or up to
+// --threads, and prints the throughput of each against one thread.
+// Jobs that fail are counted like any other.
+static int RunBatchScaling(const std::vector<BatchJob>& jobs, unsigned maxThreads)
+{
+	if (maxThreads == 0)
+		maxThreads = std::max(1u, std::thread::hardware_concurrency());
+
+	fprintf(stderr, "%zu jobs, up to %u threads\n", jobs.size(), maxThreads);
+	fprintf(stderr, "threads      jobs/s   MHz emulated   speedup   efficiency\n");
+
+	double baseline = 0;
+
+	for (unsigned threads = 1; ; threads = std::min(threads * 2, maxThreads)) {
+		BatchRunner runner(threads);
+
+		auto start = std::chrono::steady_clock::now();
+		std::vector<BatchResult> results = runner.Run(jobs);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		uint64_t cycles = 0;
+		for (const BatchResult& result : results)
+			cycles += result.state.cycles;
+
+		double rate = jobs.size() / seconds;
+		if (threads == 1)
+			baseline = rate;
+
+		fprintf(stderr, "%7u %11.1f %14.1f %8.2fx %11.0f%%\n",
+			threads, rate, cycles / seconds / 1e6, rate / baseline, rate / baseline / threads * 100);
+
+		if (threads == maxThreads)
+			break;
+	}
+
+	return 0;
+}
+
+// Runs every job in the file on a pool of threads and prints how each
+// one ended, then its console output, in job order. Returns 1 if any
+// job failed to load or stopped with an error.
+static int RunBatch(const char* jobPath, i8080::Engine engine, unsigned threads, uint32_t repeat, bool scaling)
+{
+	std::vector<BatchJob> jobs;
+
+	if (!LoadBatch(jobPath, engine, repeat, jobs))
+		return 1;
+
+	if (scaling)
+		return RunBatchScaling(jobs, threads);
+
+	BatchRunner runner(threads);
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<BatchResult> results = runner.Run(jobs);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	int status = 0;
+
+	// Every job asked for the same engine, so one fallback means all
+	for (const BatchResult& result : results) {
+		if (result.error.empty()) {
+			ReportEngine(engine, result.engine);
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < results.size(); i++) {
+		const BatchResult& result = results[i];
+
+		if (!result.error.empty()) {
+			printf("job %zu: %s\n", i, result.error.c_str());
+			status = 1;
+			continue;
+		}
+
+		printf("job %zu: %s after %llu T-states in %.3f s, PC=0x%04X\n",
+			i, GetStopReasonName(result.reason), (unsigned long long)result.state.cycles, result.seconds, result.state.PC);
+		fputs(result.output.c_str(), stdout);
+
+		if (result.reason == i8080::StopReason::Error) {
+			PrintFault(stdout, result.state.fault);
+			status = 1;
+		}
+	}
+
+	fprintf(stderr, "%zu jobs on %u threads in %.3f s\n", results.size(), runner.GetThreadCount(), seconds);
+	return status;
+}
+
+int main(int argc, char** argv)
 {
+	// Each image is "path[@address]", the address in hex and 0x100 if
+	// left out. Later images overwrite earlier ones where they overlap.
+	std::vector<const char*> images;
+
+	i8080::Engine engine = i8080::Engine::Interpreter;
+	bool interpreter = false;
+	bool fuse = true;
+	bool compare = false;
+	bool stats = false;
+	const char* tracePath = nullptr;
+	const char* profilePath = nullptr;
+	const char* checkpointPath = nullptr;
+	std::vector<uint16_t> watchpoints;
+	uint64_t checkpointSlices = CHECKPOINT_SLICES;
+	const char* batchPath = nullptr;
+	bool batchScaling = false;
+	unsigned threads = 0;
+	uint32_t repeat = 1;
+	bool lockstep = false;
+	int laneSeed = -1;
+	uint64_t fuzzExecutions = 0;
+	uint16_t fuzzBoot = LOADER_DEFAULT_ADDRESS;
+	ForkServer::InputMode fuzzInput = ForkServer::InputMode::Console;
+	uint16_t fuzzInputAddr = 0;
+	const char* consolePath = nullptr;
+	bool asyncConsole = false;
+	BankOptions bankOptions;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--interpreter") == 0) {
+			engine = i8080::Engine::Interpreter;
+			interpreter = true;
+		}
+		else if (strcmp(argv[i], "--threaded") == 0)
+			engine = i8080::Engine::Threaded;
+		else if (strcmp(argv[i], "--blocks") == 0)
+			engine = i8080::Engine::Blocks;
+		else if (strcmp(argv[i], "--jit") == 0)
+			engine = i8080::Engine::Jit;
+		else if (strcmp(argv[i], "--no-fusion") == 0)
+			fuse = false;
+		else if (strcmp(argv[i], "--compare") == 0)
+			compare = true;
+		else if (strcmp(argv[i], "--stats") == 0)
+			stats = true;
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			tracePath = argv[++i];
+		else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+			profilePath = argv[++i];
+		else if (strcmp(argv[i], "--checkpoints") == 0 && i + 1 < argc)
+			checkpointPath = argv[++i];
+		else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc)
+			checkpointSlices = std::max<uint64_t>(1, strtoull(argv[++i], nullptr, 10));
+		else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc)
+			watchpoints.push_back(static_cast<uint16_t>(strtoul(argv[++i], nullptr, 16)));
+		else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+			batchPath = argv[++i];
+		else if (strcmp(argv[i], "--batch-scaling") == 0)
+			batchScaling = true;
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = static_cast<unsigned>(strtoul(argv[++i], nullptr, 10));
+		else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+			repeat = std::max<uint32_t>(1, static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10)));
+		else if (strcmp(argv[i], "--lockstep") == 0)
+			lockstep = true;
+		else if (strcmp(argv[i], "--lane-seed") == 0 && i + 1 < argc)
+			laneSeed = static_cast<int>(strtoul(argv[++i], nullptr, 16) & 0xFFFF);
+		else if (strcmp(argv[i], "--fuzz") == 0 && i + 1 < argc)
+			fuzzExecutions = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "--fuzz-boot") == 0 && i + 1 < argc)
+			fuzzBoot = static_cast<uint16_t>(strtoul(argv[++i], nullptr, 16));
+		else if (strcmp(argv[i], "--fuzz-input") == 0 && i + 1 < argc) {
+			const char* where = argv[++i];
+
+			if (strcmp(where, "console") == 0)
+				fuzzInput = ForkServer::InputMode::Console;
+			else if (strcmp(where, "tail") == 0)
+				fuzzInput = ForkServer::InputMode::CommandTail;
+			else {
+				fuzzInput = ForkServer::InputMode::Memory;
+				fuzzInputAddr = static_cast<uint16_t>(strtoul(where, nullptr, 16));
+			}
+		}
+		else if (strcmp(argv[i], "--console") == 0 && i + 1 < argc)
+			consolePath = argv[++i];
+		else if (strcmp(argv[i], "--async-console") == 0)
+			asyncConsole = true;
+		else if (strcmp(argv[i], "--banks") == 0 && i + 1 < argc) {
+			if (!ParseBanks(argv[++i], bankOptions)) {
+				fprintf(stderr, "--banks takes FIRST,COUNT,BANKS,REGISTER in hex\n");
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--decode-trace") == 0 && i + 1 < argc)
+			return DecodeTrace(argv[++i]);
+		else
+			images.push_back(argv[i]);
+	}
+
+	if (batchPath)
+		return RunBatch(batchPath, engine, threads, repeat, batchScaling);
+
+	if (images.empty()) {
+		images.push_back("roms/TST8080.COM");
+		//images.push_back("roms/8080PRE.COM");
+	}
+
+	if (fuzzExecutions)
+		return RunFuzz(images, engine, fuzzExecutions, fuzzBoot, fuzzInput, fuzzInputAddr);
+
+	if (lockstep)
+		return CompareLockstep(images, laneSeed);
+
+	// The interpreter is compared with itself only when asked for, to
+	// check its fusion
+	if (compare) {
+		if (engine == i8080::Engine::Interpreter && !interpreter)
+			engine = i8080::Engine::Threaded;
+
+		return CompareEngines(images, engine, fuse, bankOptions);
+	}
+
 	Memory* memory = new Memory();
-	memory->LoadROM("roms/TST8080.COM");
-	//memory->LoadROM("roms/8080PRE.COM");
-	
+	std::unique_ptr<BankSwitch> banks;
+
+	if (!LoadImages(memory, images) || !MapBanks(memory, bankOptions, banks)) {
+		delete memory;
+		return 1;
+	}
+
+	// Console output goes to the file if one is given, through a writer
+	// thread with --async-console
+	FILE* consoleFile = nullptr;
+	if (consolePath && !(consoleFile = fopen(consolePath, "wb"))) {
+		fprintf(stderr, "Cannot open %s\n", consolePath);
+		banks.reset();
+		delete memory;
+		return 1;
+	}
+
+	ConsoleSink* console = consoleFile ? new FileConsole(consoleFile) : nullptr;
+	AsyncConsole* async = asyncConsole ? new AsyncConsole(console ? console : FileConsole::Stdout()) : nullptr;
+
 	CPM* cpm = new CPM(memory);
+	cpm->SetConsole(async ? async : console);
 
 	i8080* cpu = new i8080(memory, cpm);
+	cpu->SetEngine(engine);
+	cpu->SetFusion(fuse);
+	ReportEngine(engine, cpu->GetEngine());
+
+	if (tracePath) {
+#if I8080_TRACE
+		s_Trace = new TraceBuffer();
+		s_TracePath = tracePath;
+		cpu->SetTrace(s_Trace);
+		atexit(SaveTrace);
+#else
+		fprintf(stderr, "Tracing is not compiled in, build with I8080_TRACE=1\n");
+#endif
+	}
+
+	// Folded stacks go to the file, the hot spot report to stderr
+	if (profilePath) {
+		s_Profiler = new Profiler();
+		s_ProfilePath = profilePath;
+		s_ProfileMemory = memory;
+		cpu->SetProfiler(s_Profiler);
+		atexit(SaveProfile);
+	}
+
+	// Every read and write of a watched address is printed, then the run
+	// goes on
+	for (uint16_t addr : watchpoints)
+		cpu->SetWatchpoint(addr, WATCH_READ | WATCH_WRITE);
+
+	// One checkpoint before the first instruction, then one every
+	// checkpointSlices million instructions, and the log saved at the end
+	CheckpointLog* checkpoints = nullptr;
+	if (checkpointPath) {
+		checkpoints = new CheckpointLog(cpu, memory, cpm);
+		checkpoints->Add();
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	uint64_t slices = 0;
+	i8080::StopReason reason;
 
 	while (1) {
-		cpu->Cycle();
+		reason = cpu->Run(RUN_SLICE);
+
+		if (reason == i8080::StopReason::Watchpoint) {
+			const Memory::WatchHit& hit = memory->GetWatchHit();
+
+			fprintf(stderr, "Watchpoint: %s 0x%02X at 0x%04X, next PC=0x%04X\n",
+				hit.access == WATCH_WRITE ? "wrote" : "read", hit.value, hit.addr, cpu->GetPC());
+			continue;
+		}
+
+		if (reason != i8080::StopReason::Budget)
+			break;
+
+		if (checkpoints && ++slices % checkpointSlices == 0)
+			checkpoints->Add();
+	}
+
+	if (reason == i8080::StopReason::Error)
+		PrintFault(stderr, cpu->GetState().fault);
+
+	if (stats) {
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		double mhz = cpu->GetCycles() / seconds / 1e6;
+
+		fprintf(stderr, "%llu T-states in %.3f s: %.1f MHz emulated, %.1fx a %.0f MHz 8080\n",
+			(unsigned long long)cpu->GetCycles(), seconds, mhz, mhz * 1e6 / I8080_CLOCK_HZ, I8080_CLOCK_HZ / 1e6);
+	}
+
+	if (checkpoints) {
+		checkpoints->Add();
+
+		if (!checkpoints->Save(checkpointPath))
+			fprintf(stderr, "Failed to write checkpoints %s\n", checkpointPath);
+
+		delete checkpoints;
+	}
+
+	// Report now, the memory it reads is about to go
+	if (s_Profiler) {
+		SaveProfile();
+		delete s_Profiler;
+		s_Profiler = nullptr;
 	}
 
 	delete cpu;
 	delete cpm;
+	banks.reset();
 	delete memory;
 
-	return 0;
-}
\ No newline at end of file
+	// Passes on what the writer has not yet
+	delete async;
+	delete console;
+	if (consoleFile)
+		fclose(consoleFile);
+
+	return reason == i8080::StopReason::Error ? 1 : 0;
+}
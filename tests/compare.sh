@@ -0,0 +1,41 @@
+#!/bin/sh
+# Runs each test program on the interpreter side by side with every
+# engine through --compare, and checks the checksum it prints against
+# the one the interpreter is known to give. The interpreter is checked
+# against itself with and without fusion.
+#
+#   tests/compare.sh path/to/i8080
+#
+# The programs are assembled from the .ASM next to each .COM with any
+# 8080 assembler. Exits with 1 if any engine diverges or any checksum
+# is wrong. Options a program needs, such as --banks, follow its
+# checksum.
+
+EMULATOR=${1:?usage: $0 path/to/i8080}
+DIR=$(dirname "$0")
+STATUS=0
+
+check() {
+	program=$1
+	expected=$2
+	shift 2
+
+	for engine in --interpreter --threaded --blocks --jit; do
+		output=$("$EMULATOR" --compare $engine "$@" "$DIR/$program" 2>/dev/null)
+		status=$?
+
+		if [ $status -ne 0 ] || ! printf '%s\n' "$output" | tr -d '\r' | grep -qx "$expected"; then
+			echo "FAIL $program $engine"
+			"$EMULATOR" --compare $engine "$@" "$DIR/$program" >/dev/null
+			STATUS=1
+		else
+			echo "ok   $program $engine"
+		fi
+	done
+}
+
+check ALUTEST.COM "ALUTEST 618C"
+check FLOWTEST.COM "FLOWTEST 0671"
+check BANKTEST.COM "BANKTEST E1E4" --banks 80,40,4,7000
+
+exit $STATUS